@@ -191,9 +191,35 @@ typedef CL_API_ENTRY cl_int (CL_API_CALL *clTerminateContextKHR_fn)(cl_context /
 #define CL_DEVICE_GLOBAL_EXT2_MEM_MAX_ALLOC_TI      0x4065
 #define CL_DEVICE_MSMC_MEM_MAX_ALLOC_TI             0x4066
 #define CL_DEVICE_LOCAL_MEM_MAX_ALLOC_TI            0x4067
+#define CL_DEVICE_ZERO_COPY_BYTES_TI                0x4068
 
 #define CL_MEM_USE_MSMC_TI                          (1 << 20)
 
+/* cl_ti_command_graph: record commands once, replay them with one call */
+#define cl_ti_command_graph 1
+
+typedef struct _cl_command_graph_ti * cl_command_graph_ti;
+
+extern CL_API_ENTRY cl_int CL_API_CALL
+clBeginCommandGraphTI(cl_command_queue /* command_queue */);
+
+extern CL_API_ENTRY cl_command_graph_ti CL_API_CALL
+clEndCommandGraphTI(cl_command_queue /* command_queue */,
+                    cl_int *         /* errcode_ret */);
+
+extern CL_API_ENTRY cl_int CL_API_CALL
+clEnqueueCommandGraphTI(cl_command_queue    /* command_queue */,
+                        cl_command_graph_ti /* graph */,
+                        cl_uint             /* num_events_in_wait_list */,
+                        const cl_event *    /* event_wait_list */,
+                        cl_event *          /* event */);
+
+extern CL_API_ENTRY cl_int CL_API_CALL
+clRetainCommandGraphTI(cl_command_graph_ti /* graph */);
+
+extern CL_API_ENTRY cl_int CL_API_CALL
+clReleaseCommandGraphTI(cl_command_graph_ti /* graph */);
+
 /* cl_device_info */
 #define CL_DEVICE_MAX_ATOMIC_COUNTERS_EXT           0x4032
 
@@ -31,10 +31,12 @@
  */
 
 #include <core/commandqueue.h>
+#include <core/commandgraph.h>
 #include <core/deviceinterface.h>
 #include <core/context.h>
 
 #include <CL/cl.h>
+#include <CL/cl_ext.h>
 
 // Command Queue APIs
 cl_command_queue
@@ -138,3 +140,120 @@ clSetCommandQueueProperty(cl_command_queue              d_command_queue,
 
     return command_queue->setProperty(properties, enable, old_properties);
 }
+
+// Command Graph APIs (cl_ti_command_graph)
+cl_int
+clBeginCommandGraphTI(cl_command_queue d_command_queue)
+{
+    auto command_queue = pobj(d_command_queue);
+
+    if (!command_queue->isA(Coal::Object::T_CommandQueue))
+        return CL_INVALID_COMMAND_QUEUE;
+
+    if (command_queue->recording())
+        return CL_INVALID_OPERATION;
+
+    // Let the queued events run first, the graph replays only its own
+    command_queue->flush();
+    command_queue->beginGraph(new Coal::CommandGraph(command_queue));
+
+    return CL_SUCCESS;
+}
+
+cl_command_graph_ti
+clEndCommandGraphTI(cl_command_queue d_command_queue,
+                    cl_int *         errcode_ret)
+{
+    cl_int default_errcode_ret;
+    auto command_queue = pobj(d_command_queue);
+
+    // No errcode_ret ?
+    if (!errcode_ret)
+        errcode_ret = &default_errcode_ret;
+
+    if (!command_queue->isA(Coal::Object::T_CommandQueue))
+    {
+        *errcode_ret = CL_INVALID_COMMAND_QUEUE;
+        return 0;
+    }
+
+    Coal::CommandGraph *graph = command_queue->endGraph();
+
+    if (!graph)
+    {
+        *errcode_ret = CL_INVALID_OPERATION;
+        return 0;
+    }
+
+    *errcode_ret = CL_SUCCESS;
+
+    return desc(graph);
+}
+
+cl_int
+clEnqueueCommandGraphTI(cl_command_queue    d_command_queue,
+                        cl_command_graph_ti d_graph,
+                        cl_uint             num_events_in_wait_list,
+                        const cl_event *    event_wait_list,
+                        cl_event *          event)
+{
+    auto command_queue = pobj(d_command_queue);
+    auto graph = pobj(d_graph);
+
+    if (!command_queue->isA(Coal::Object::T_CommandQueue))
+        return CL_INVALID_COMMAND_QUEUE;
+
+    if (!graph->isA(Coal::Object::T_CommandGraph))
+        return CL_INVALID_VALUE;
+
+    // A graph replays on the queue it was recorded on
+    if (graph->parent() != command_queue)
+        return CL_INVALID_COMMAND_QUEUE;
+
+    if (command_queue->recording())
+        return CL_INVALID_OPERATION;
+
+    if ((!event_wait_list && num_events_in_wait_list) ||
+        (event_wait_list && !num_events_in_wait_list))
+        return CL_INVALID_EVENT_WAIT_LIST;
+
+    for (cl_uint i=0; i<num_events_in_wait_list; ++i)
+    {
+        auto wait_event = pobj(event_wait_list[i]);
+
+        if (!wait_event->isA(Coal::Object::T_Event))
+            return CL_INVALID_EVENT_WAIT_LIST;
+
+        if (wait_event->status() < 0)
+            return CL_EXEC_STATUS_ERROR_FOR_EVENTS_IN_WAIT_LIST;
+    }
+
+    return graph->enqueue(num_events_in_wait_list, event_wait_list, event);
+}
+
+cl_int
+clRetainCommandGraphTI(cl_command_graph_ti d_graph)
+{
+    auto graph = pobj(d_graph);
+
+    if (!graph->isA(Coal::Object::T_CommandGraph))
+        return CL_INVALID_VALUE;
+
+    graph->reference();
+
+    return CL_SUCCESS;
+}
+
+cl_int
+clReleaseCommandGraphTI(cl_command_graph_ti d_graph)
+{
+    auto graph = pobj(d_graph);
+
+    if (!graph->isA(Coal::Object::T_CommandGraph))
+        return CL_INVALID_VALUE;
+
+    if (graph->dereference())
+        delete graph;
+
+    return CL_SUCCESS;
+}
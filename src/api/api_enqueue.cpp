@@ -49,6 +49,16 @@ static inline cl_int queueEvent(Coal::CommandQueue *queue,
 {
     cl_int rs;
 
+    /*------------------------------------------------------------------------
+    * Commands recorded in a command graph only run when the graph is
+    * enqueued, they cannot be waited for nor given to the application.
+    *-----------------------------------------------------------------------*/
+    if (queue->recording() && (event || blocking))
+    {
+        delete command;
+        return CL_INVALID_OPERATION;
+    }
+
     if (event)
     {
 #if 0
@@ -915,7 +925,7 @@ clEnqueueMarkerWithWaitList(cl_command_queue d_command_queue,
 	// Free events, they were memcpyed by CommandQueue::events()
 	for (unsigned int i=0; i<count; ++i)
 	{
-	    events[i]->dereference();
+	    clReleaseEvent(desc(events[i]));
 	}
 	if (events != NULL)  std::free(events);
 	if (e_wait_list != NULL) std::free(e_wait_list);
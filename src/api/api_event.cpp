@@ -35,10 +35,35 @@
 #include <core/commandqueue.h>
 #include <core/events.h>
 #include <core/context.h>
+#include <core/util.h>
 #include <stdio.h>
 
 using namespace Coal;
 
+namespace
+{
+/*
+ * Events waited for by clWaitForEvents(). Freed by the last of the waiting
+ * thread and of the callbacks of the events to be done with it.
+ */
+struct EventsWaiter
+{
+    volatile int remaining;     /* events not completed yet, futex word */
+    volatile int refs;
+};
+
+void CL_CALLBACK eventCompleted(cl_event, cl_int, void *user_data)
+{
+    EventsWaiter *waiter = (EventsWaiter *)user_data;
+
+    if (__sync_sub_and_fetch(&waiter->remaining, 1) == 0)
+        futex_wake(&waiter->remaining);
+
+    if (__sync_sub_and_fetch(&waiter->refs, 1) == 0)
+        delete waiter;
+}
+}
+
 // Event Object APIs
 cl_int
 clWaitForEvents(cl_uint             num_events,
@@ -80,12 +105,36 @@ clWaitForEvents(cl_uint             num_events,
     }
 
     // Wait for the events
+    if (num_events == 1)
+    {
+        pobj(event_list[0])->waitForStatus(CL_COMPLETE);
+        return CL_SUCCESS;
+    }
+
+    // Several events are counted down by their completion callbacks, so
+    // that we wait once for all of them instead of once for each
+    EventsWaiter *waiter = new EventsWaiter;
+    waiter->remaining = num_events;
+    waiter->refs = num_events + 1;
+
     for (cl_uint i=0; i<num_events; ++i)
+        pobj(event_list[i])->setCallback(CL_COMPLETE, eventCompleted, waiter);
+
+    volatile int *remaining = &waiter->remaining;
+
+    if (!spin_until([=]() { return *remaining == 0; }))
     {
-        auto event = pobj(event_list[i]);
-        event->waitForStatus(CL_COMPLETE);
+        int left;
+
+        while ((left = *remaining) != 0)
+            futex_wait(remaining, left);
     }
 
+    __sync_synchronize();
+
+    if (__sync_sub_and_fetch(&waiter->refs, 1) == 0)
+        delete waiter;
+
     return CL_SUCCESS;
 }
 
@@ -150,7 +199,7 @@ clReleaseEvent(cl_event d_event)
     if (!event->isA(Coal::Object::T_Event))
         return CL_INVALID_EVENT;
 
-    if (event->dereference())
+    if (event->releaseReference())
     {
         event->freeDeviceData();
         delete event;
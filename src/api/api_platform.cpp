@@ -84,6 +84,21 @@ void * clGetExtensionFunctionAddress(const char *funcname)
     if (strcmp(funcname, "clIcdGetPlatformIDsKHR") == 0)
         return (void*)clGetPlatformIDs;
 
+    if (strcmp(funcname, "clBeginCommandGraphTI") == 0)
+        return (void*)clBeginCommandGraphTI;
+
+    if (strcmp(funcname, "clEndCommandGraphTI") == 0)
+        return (void*)clEndCommandGraphTI;
+
+    if (strcmp(funcname, "clEnqueueCommandGraphTI") == 0)
+        return (void*)clEnqueueCommandGraphTI;
+
+    if (strcmp(funcname, "clRetainCommandGraphTI") == 0)
+        return (void*)clRetainCommandGraphTI;
+
+    if (strcmp(funcname, "clReleaseCommandGraphTI") == 0)
+        return (void*)clReleaseCommandGraphTI;
+
     return NULL;
 }
 
@@ -317,9 +317,6 @@ clBuildProgram(cl_program           d_program,
 	free(devices);
     }
 
-    if (pfn_notify)
-        pfn_notify(d_program, user_data);
-
     return result;
 }
 
@@ -355,9 +352,6 @@ clCompileProgram(cl_program           d_program,
 	free(devices);
     }
 
-    if (pfn_notify)
-        pfn_notify(d_program, user_data);
-
     return (result);
 }
 
@@ -419,12 +413,8 @@ clLinkProgram(cl_context           d_context,
                                  num_input_programs, input_programs);
 	free(devices);
 
-        // Note: Unlike clCompileProgram() and clLinkProgram(), which per the 1.2 spec,
-	// must trigger the callback whether the build succeeds or not, here we must have a
-	// program object to pass to the pfn_notify() callback.
-        if (pfn_notify)
-            pfn_notify(desc(program), user_data);
-
+        // With pfn_notify, the link is done in the background and its
+        // errors are reported through the build status of the program.
         if (retcode != CL_SUCCESS)
         {
             delete program;
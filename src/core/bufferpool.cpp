@@ -0,0 +1,184 @@
+/******************************************************************************
+ * Copyright (c) 2014, Texas Instruments Incorporated - http://www.ti.com/
+ *   All rights reserved.
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *       * Neither the name of Texas Instruments Incorporated nor the
+ *         names of its contributors may be used to endorse or promote products
+ *         derived from this software without specific prior written permission.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *   AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *   IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *   ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ *   LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *   CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *   SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *   INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *   CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *   ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ *   THE POSSIBILITY OF SUCH DAMAGE.
+ *****************************************************************************/
+/**
+ * \file bufferpool.cpp
+ * \brief Host memory recycled for the buffers of a context
+ */
+#include "bufferpool.h"
+
+#include <cstdlib>
+#include <sys/mman.h>
+
+using namespace Coal;
+
+/**
+ * \brief Blocks larger than this are mappings of their own
+ */
+#define BUFFER_POOL_LARGE (256 * 1024)
+
+/******************************************************************************
+* Settings of the pools, read once from the environment
+******************************************************************************/
+static size_t         pool_max_cached = 256 * 1024 * 1024;
+static bool           pool_populate   = false;
+static pthread_once_t pool_settings_once = PTHREAD_ONCE_INIT;
+
+static void read_pool_settings()
+{
+    const char *value = getenv("TI_OCL_BUFFER_POOL_MAX");
+
+    if (value)
+        pool_max_cached = strtoul(value, NULL, 10);
+
+    pool_populate = (getenv("TI_OCL_BUFFER_POOL_POPULATE") != NULL);
+}
+
+/******************************************************************************
+* BufferPool::BufferPool
+******************************************************************************/
+BufferPool::BufferPool()
+: p_cached(0)
+{
+    pthread_mutex_init(&p_mutex, 0);
+    pthread_once(&pool_settings_once, read_pool_settings);
+}
+
+/******************************************************************************
+* BufferPool::~BufferPool
+******************************************************************************/
+BufferPool::~BufferPool()
+{
+    std::map<size_t, std::vector<void *> >::iterator it;
+
+    for (it = p_free.begin(); it != p_free.end(); ++it)
+    {
+        for (size_t i=0; i<it->second.size(); ++i)
+            freeBlock(it->second[i], it->first);
+    }
+
+    pthread_mutex_destroy(&p_mutex);
+}
+
+/******************************************************************************
+* size_t BufferPool::classSize(size_t size)
+******************************************************************************/
+size_t BufferPool::classSize(size_t size)
+{
+    size_t pow2 = 128;
+
+    while (pow2 < size)
+        pow2 <<= 1;
+
+    if (pow2 <= 4096)
+        return pow2;
+
+    // Four classes between two powers of two
+    size_t step = pow2 / 8;
+
+    return (size + step - 1) / step * step;
+}
+
+/******************************************************************************
+* void *BufferPool::alloc(size_t size)
+******************************************************************************/
+void *BufferPool::alloc(size_t size)
+{
+    size_t class_size = classSize(size);
+    void *ptr = 0;
+
+    // Reuse a block of the same class
+    pthread_mutex_lock(&p_mutex);
+
+    std::map<size_t, std::vector<void *> >::iterator it = p_free.find(class_size);
+
+    if (it != p_free.end() && !it->second.empty())
+    {
+        ptr = it->second.back();
+        it->second.pop_back();
+        p_cached -= class_size;
+    }
+
+    pthread_mutex_unlock(&p_mutex);
+
+    if (ptr)
+        return ptr;
+
+    // Nothing to reuse, ask the system
+    if (class_size <= BUFFER_POOL_LARGE)
+    {
+        if (posix_memalign(&ptr, 128, class_size))  // align for type double16 size.
+            return 0;
+
+        return ptr;
+    }
+
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+
+#ifdef MAP_POPULATE
+    if (pool_populate)
+        flags |= MAP_POPULATE;
+#endif
+
+    ptr = mmap(0, class_size, PROT_READ | PROT_WRITE, flags, -1, 0);
+
+    return (ptr == MAP_FAILED ? 0 : ptr);
+}
+
+/******************************************************************************
+* void BufferPool::release(void *ptr, size_t size)
+******************************************************************************/
+void BufferPool::release(void *ptr, size_t size)
+{
+    size_t class_size = classSize(size);
+
+    pthread_mutex_lock(&p_mutex);
+
+    if (p_cached + class_size <= pool_max_cached)
+    {
+        p_free[class_size].push_back(ptr);
+        p_cached += class_size;
+        ptr = 0;
+    }
+
+    pthread_mutex_unlock(&p_mutex);
+
+    // The pool is full
+    if (ptr)
+        freeBlock(ptr, class_size);
+}
+
+/******************************************************************************
+* void BufferPool::freeBlock(void *ptr, size_t class_size)
+******************************************************************************/
+void BufferPool::freeBlock(void *ptr, size_t class_size)
+{
+    if (class_size <= BUFFER_POOL_LARGE)
+        std::free(ptr);
+    else
+        munmap(ptr, class_size);
+}
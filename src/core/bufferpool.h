@@ -0,0 +1,96 @@
+/******************************************************************************
+ * Copyright (c) 2014, Texas Instruments Incorporated - http://www.ti.com/
+ *   All rights reserved.
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *       * Neither the name of Texas Instruments Incorporated nor the
+ *         names of its contributors may be used to endorse or promote products
+ *         derived from this software without specific prior written permission.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *   AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *   IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *   ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ *   LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *   CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *   SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *   INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *   CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *   ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ *   THE POSSIBILITY OF SUCH DAMAGE.
+ *****************************************************************************/
+/**
+ * \file bufferpool.h
+ * \brief Host memory recycled for the buffers of a context
+ */
+#ifndef __BUFFERPOOL_H__
+#define __BUFFERPOOL_H__
+
+#include <pthread.h>
+#include <cstddef>
+#include <map>
+#include <vector>
+
+namespace Coal
+{
+
+/**
+ * \brief Pool of host memory for the buffers of a \c Coal::Context
+ *
+ * Buffers living in host memory, like the ones of the CPU device, take their
+ * storage from the pool of their context and give it back when released.
+ * Sizes are rounded up to a size class: powers of two up to 4 KB, then four
+ * classes per power of two, so that at most a fifth of a block is lost.
+ * Blocks released are kept in a free list per class and reused by the next
+ * buffers of the same class, so that creating and releasing temporary
+ * buffers in steady state neither calls the system allocator nor touches
+ * fresh pages.
+ *
+ * Blocks up to \c BUFFER_POOL_LARGE bytes come from \c posix_memalign(),
+ * larger ones are mappings of their own. When \c TI_OCL_BUFFER_POOL_POPULATE
+ * is set, the mappings are pre-faulted with \c MAP_POPULATE.
+ *
+ * The free lists hold at most \c TI_OCL_BUFFER_POOL_MAX bytes, 256 MB by
+ * default. Beyond that, released blocks go back to the system.
+ */
+class BufferPool
+{
+    public:
+        BufferPool();
+        ~BufferPool();      /*!< \brief Give the cached blocks back to the system */
+
+        /**
+         * \brief Allocate a block of at least \p size bytes
+         * \return the block, aligned on 128 bytes, 0 if out of memory
+         */
+        void *alloc(size_t size);
+
+        /**
+         * \brief Release a block
+         * \param ptr block returned by \c alloc()
+         * \param size size given to \c alloc()
+         */
+        void release(void *ptr, size_t size);
+
+        /**
+         * \brief Size of the blocks allocated for \p size bytes
+         */
+        static size_t classSize(size_t size);
+
+    private:
+        void freeBlock(void *ptr, size_t class_size);
+
+        std::map<size_t, std::vector<void *> > p_free;  /*!< \brief Blocks released, by class size */
+        size_t p_cached;                                /*!< \brief Bytes in \c p_free */
+        pthread_mutex_t p_mutex;
+};
+
+}
+
+#endif
@@ -0,0 +1,196 @@
+/******************************************************************************
+ * Copyright (c) 2014, Texas Instruments Incorporated - http://www.ti.com/
+ *   All rights reserved.
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *       * Neither the name of Texas Instruments Incorporated nor the
+ *         names of its contributors may be used to endorse or promote products
+ *         derived from this software without specific prior written permission.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *   AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *   IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *   ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ *   LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *   CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *   SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *   INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *   CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *   ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ *   THE POSSIBILITY OF SUCH DAMAGE.
+ *****************************************************************************/
+/**
+ * \file commandgraph.cpp
+ * \brief Recorded sequences of commands
+ */
+
+#include "commandgraph.h"
+#include "commandqueue.h"
+#include "events.h"
+
+using namespace Coal;
+
+/******************************************************************************
+* CommandGraph::CommandGraph
+******************************************************************************/
+CommandGraph::CommandGraph(CommandQueue *queue)
+: Object(Object::T_CommandGraph, queue), p_replayed(false)
+{
+    pthread_mutex_init(&p_mutex, 0);
+}
+
+/******************************************************************************
+* CommandGraph::~CommandGraph
+******************************************************************************/
+CommandGraph::~CommandGraph()
+{
+    waitIdle();
+
+    for (size_t i=0; i<p_commands.size(); ++i)
+        clReleaseEvent(desc(p_commands[i]));
+
+    pthread_mutex_destroy(&p_mutex);
+}
+
+/******************************************************************************
+* void CommandGraph::append(Event *event)
+******************************************************************************/
+void CommandGraph::append(Event *event)
+{
+    // The event is deleted before us, it must not release the queue
+    event->setReleaseParent(false);
+    event->setRecorded();
+    p_commands.push_back(event);
+}
+
+/******************************************************************************
+* void CommandGraph::waitIdle()
+******************************************************************************/
+void CommandGraph::waitIdle()
+{
+    if (!p_replayed)
+        return;
+
+    // An event is completed before its command queue is done with it, it
+    // only drops its reference at the very end
+    for (size_t i=0; i<p_commands.size(); ++i)
+    {
+        Event *command = p_commands[i];
+
+        command->waitForStatus(CL_COMPLETE);
+        command->waitUnreferenced();
+    }
+}
+
+/******************************************************************************
+* cl_int CommandGraph::enqueue
+******************************************************************************/
+cl_int CommandGraph::enqueue(cl_uint num_events_in_wait_list,
+                             const cl_event *event_wait_list, cl_event *event)
+{
+    CommandQueue *queue = (CommandQueue *)parent();
+    cl_command_queue_properties properties = 0;
+    cl_int rs = CL_SUCCESS;
+
+    queue->info(CL_QUEUE_PROPERTIES, sizeof(properties), &properties, 0);
+
+    bool is_ooo = (properties & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE) != 0;
+
+    pthread_mutex_lock(&p_mutex);
+
+    // The commands of the graph stay internal, the application gets a marker
+    // completing with the replay. It is validated before anything runs, a
+    // failure leaves the graph as the previous replay left it. The marker
+    // waits for the last command once re-armed, or if nothing is recorded,
+    // for the given events.
+    MarkerEvent *marker = 0;
+    bool empty = p_commands.empty();
+
+    if (event)
+    {
+        marker = new MarkerEvent(queue, (empty ? num_events_in_wait_list : 0),
+                                 (empty ? event_wait_list : 0), &rs);
+
+        if (rs != CL_SUCCESS)
+        {
+            pthread_mutex_unlock(&p_mutex);
+            delete marker;
+            return rs;
+        }
+    }
+
+    if (!empty)
+    {
+        waitIdle();
+
+        // Nothing is re-armed yet if the device fails, the events stay as the
+        // previous replay left them
+        rs = queue->resetEvents(&p_commands[0], p_commands.size());
+
+        if (rs != CL_SUCCESS)
+        {
+            pthread_mutex_unlock(&p_mutex);
+            delete marker;
+            return rs;
+        }
+
+        // Re-arm the events, the first one waits on the given events and, as
+        // nothing orders the commands on an out-of-order queue, the other
+        // ones on the previous command
+        for (size_t i=0; i<p_commands.size(); ++i)
+        {
+            Event *command = p_commands[i];
+
+            command->rearm();
+
+            if (i == 0)
+            {
+                for (cl_uint j=0; j<num_events_in_wait_list; ++j)
+                    command->addWaitEvent(pobj(event_wait_list[j]));
+            }
+            else if (is_ooo)
+            {
+                command->addWaitEvent(p_commands[i - 1]);
+            }
+        }
+
+        if (marker)
+            marker->addWaitEvent(p_commands.back());
+
+        p_replayed = true;
+
+        queue->replayEvents(&p_commands[0], p_commands.size());
+    }
+
+    if (marker)
+    {
+        // The application only gets the marker once the queue holds it
+        marker->reference();
+
+        rs = queue->queueEvent(marker);
+
+        if (rs != CL_SUCCESS)
+        {
+            // The last command notifies the marker when it completes
+            if (!empty)
+                waitIdle();
+
+            marker->dereference();
+            delete marker;
+        }
+        else
+        {
+            *event = desc((Event *)marker);
+        }
+    }
+
+    pthread_mutex_unlock(&p_mutex);
+
+    return rs;
+}
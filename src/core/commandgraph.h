@@ -0,0 +1,122 @@
+/******************************************************************************
+ * Copyright (c) 2014, Texas Instruments Incorporated - http://www.ti.com/
+ *   All rights reserved.
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *       * Neither the name of Texas Instruments Incorporated nor the
+ *         names of its contributors may be used to endorse or promote products
+ *         derived from this software without specific prior written permission.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *   AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *   IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *   ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ *   LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *   CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *   SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *   INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *   CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *   ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ *   THE POSSIBILITY OF SUCH DAMAGE.
+ *****************************************************************************/
+/**
+ * \file commandgraph.h
+ * \brief Recorded sequences of commands
+ */
+
+#ifndef __COMMANDGRAPH_H__
+#define __COMMANDGRAPH_H__
+
+#include "object.h"
+#include "icd.h"
+
+#include <CL/cl.h>
+#include <CL/cl_ext.h>
+
+#include <pthread.h>
+#include <vector>
+
+namespace Coal
+{
+  class CommandGraph;
+}
+struct _cl_command_graph_ti: public Coal::descriptor<Coal::CommandGraph, _cl_command_graph_ti> {};
+
+namespace Coal
+{
+
+class CommandQueue;
+class Event;
+
+/**
+ * \brief Sequence of commands recorded once and replayed on a command queue
+ *
+ * Between \c clBeginCommandGraphTI() and \c clEndCommandGraphTI(), the
+ * commands enqueued on a command queue are not run. Their events are built
+ * and checked as usual, and the device prepares them with
+ * \c Coal::DeviceInterface::initEventDeviceData(), but they are kept in the
+ * graph. \c clEnqueueCommandGraphTI() then queues these same events again,
+ * so that a replay does not allocate, check or prepare anything. The events
+ * are re-armed with \c Coal::Event::rearm() and the device resets their data
+ * with \c Coal::DeviceInterface::resetEventDeviceData().
+ *
+ * The commands of a graph run one after the other, after the events given
+ * when it is replayed, even on an out-of-order command queue. They cannot
+ * have wait lists or return events. The recorded kernels keep the arguments
+ * they had when they were recorded.
+ *
+ * A replay first waits for the previous one to complete, so that its events
+ * can be reused. Replays of the same graph from several threads are
+ * serialized by the lock of the graph.
+ */
+class CommandGraph : public _cl_command_graph_ti, public Object
+{
+    public:
+        /**
+         * \brief Constructor
+         * \param queue command queue whose commands are recorded
+         */
+        CommandGraph(CommandQueue *queue);
+        ~CommandGraph();
+
+        /**
+         * \brief Record an event
+         *
+         * Called by \c Coal::CommandQueue::queueEvent() while recording. The
+         * graph takes over the reference the queue would have held.
+         */
+        void append(Event *event);
+
+        /**
+         * \brief Replay the recorded commands
+         *
+         * If the marker cannot be created or the device cannot reset the
+         * commands, none of them is queued and the graph can be replayed
+         * again.
+         *
+         * \param num_events_in_wait_list number of events to wait on
+         * \param event_wait_list events the first command waits on
+         * \param event if not 0, set to a marker completing with the replay,
+         *              left untouched on failure
+         * \return \c CL_SUCCESS if success, otherwise an error code
+         */
+        cl_int enqueue(cl_uint num_events_in_wait_list,
+                       const cl_event *event_wait_list, cl_event *event);
+
+    private:
+        void waitIdle();                /*!< \brief Wait for the events of the previous replay to be released by the queue */
+
+        std::vector<Event *> p_commands;
+        bool p_replayed;
+        pthread_mutex_t p_mutex;        /*!< \brief Held by \c enqueue() */
+};
+
+}
+
+#endif
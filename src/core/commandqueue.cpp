@@ -37,17 +37,19 @@
 #include "deviceinterface.h"
 #include "propertylist.h"
 #include "events.h"
+#include "commandgraph.h"
+#include "util.h"
 
 #include <cstring>
 #include <cstdlib>
 #include <ctime>
 #include <iostream>
+#include <new>
 #include <stdio.h>
 
 using namespace Coal;
 
 #define ONLY_MAIN_THREAD_CAN_RELEASE_EVENT	0
-#define OOO_QUEUE_PUSH_EVENTS_THRESHOLD		64
 
 /******************************************************************************
 * CommandQueue::CommandQueue
@@ -58,13 +60,20 @@ CommandQueue::CommandQueue(Context *ctx,
                            cl_int *errcode_ret)
 : Object(Object::T_CommandQueue, ctx), p_device(device),
   p_num_events_in_queue(0), p_num_events_on_device(0),
-  p_num_events_completed(0),
-  p_properties(properties), p_flushed(true)
+  p_properties(properties), p_ring_head(0), p_ring_tail(0),
+  p_submit_pending(0), p_fence(0), p_recording(0)
 {
     // Initialize the locking machinery
     pthread_mutex_init(&p_event_list_mutex, 0);
     pthread_cond_init(&p_event_list_cond, 0);
 
+    // Slot i takes ticket i first
+    for (unsigned int i=0; i<COMMAND_QUEUE_RING_SIZE; ++i)
+    {
+        p_ring[i].seq = i;
+        p_ring[i].event = 0;
+    }
+
     // Check that the device belongs to the context
     if (!ctx->hasDevice(device))
     {
@@ -203,18 +212,27 @@ void CommandQueue::flush()
 ******************************************************************************/
 void CommandQueue::finish()
 {
-    // As pushEventsOnDevice doesn't remove SUCCESS events, we may need
-    // to do that here in order not to be stuck.
     cleanEvents();
 
     // All the queued events must have completed. When they are, they get
     // deleted from the command queue, so simply wait for it to become empty.
+    // Poll a little first, short commands complete sooner than we would be
+    // woken up.
+    volatile cl_int *num_events = &p_num_events_in_queue;
+
+    if (spin_until([=]() { return *num_events == 0; }))
+    {
+        __sync_synchronize();
+        cleanReleasedEvents();
+        return;
+    }
+
     pthread_mutex_lock(&p_event_list_mutex);
 
     while (p_num_events_in_queue != 0)
         pthread_cond_wait(&p_event_list_cond, &p_event_list_mutex);
 
-    pthread_mutex_unlock(&p_event_list_mutex);
+    unlockEvents();
 
     cleanReleasedEvents();
 }
@@ -231,102 +249,290 @@ cl_int CommandQueue::queueEvent(Event *event)
     if (rs != CL_SUCCESS)
         return rs;
 
-    // Append the event at the end of the list
+    // Recorded, run when the graph is replayed. Locked, so that the graph
+    // cannot be handed out by endGraph() while the event joins it.
     pthread_mutex_lock(&p_event_list_mutex);
 
-    p_events.push_back(event);
-    p_num_events_in_queue += 1;
-    p_flushed = false;
+    if (p_recording)
+    {
+        p_recording->append(event);
+        unlockEvents();
+        return CL_SUCCESS;
+    }
 
-    pthread_mutex_unlock(&p_event_list_mutex);
+    unlockEvents();
 
-    // Timing info if needed
-    if (p_properties & CL_QUEUE_PROFILING_ENABLE)
-        event->updateTiming(Event::Queue);
+    submitEvent(event, true);
 
-    // Explore the list for events we can push on the device
-    pushEventsOnDevice();
+    return CL_SUCCESS;
+}
 
-    cleanReleasedEvents();
+/******************************************************************************
+* cl_int CommandQueue::resetEvents(Event **events, size_t count)
+******************************************************************************/
+cl_int CommandQueue::resetEvents(Event **events, size_t count)
+{
+    for (size_t i=0; i<count; ++i)
+    {
+        cl_int rs = p_device->resetEventDeviceData(events[i]);
+
+        if (rs != CL_SUCCESS)
+            return rs;
+    }
 
     return CL_SUCCESS;
 }
 
 /******************************************************************************
-* void CommandQueue::releaseEvent()
+* void CommandQueue::replayEvents(Event **events, size_t count)
 ******************************************************************************/
-void CommandQueue::releaseEvent(Event *e)
+void CommandQueue::replayEvents(Event **events, size_t count)
 {
-#if ONLY_MAIN_THREAD_CAN_RELEASE_EVENT
-    pthread_mutex_lock(&p_event_list_mutex);
-    p_released_events.push_back(e);
-    pthread_mutex_unlock(&p_event_list_mutex);
-#else
-    clReleaseEvent(desc(e));
-#endif
+    // The reference the queue holds on its events, dropped once completed
+    for (size_t i=0; i<count; ++i)
+    {
+        events[i]->reference();
+        submitEvent(events[i], false);
+    }
+
+    // Explore the list for events we can push on the device, once
+    pushEventsOnDevice();
+
+    cleanReleasedEvents();
 }
 
 /******************************************************************************
-* void CommandQueue::cleanEvents()
+* Command graph recording
 ******************************************************************************/
-void CommandQueue::cleanEvents()
+void CommandQueue::beginGraph(CommandGraph *graph)
 {
-    bool is_inorder = 
-                  (p_properties & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE) == 0;
+    pthread_mutex_lock(&p_event_list_mutex);
+    p_recording = graph;
+    unlockEvents();
+}
 
+CommandGraph *CommandQueue::endGraph()
+{
     pthread_mutex_lock(&p_event_list_mutex);
 
-    // No need to cleanEvents() every time an event finishes, so that we can
-    // save on the event traversal time.  16 is a number that can be tuned 
-    // (e.g. using ooo example).
-    if (p_num_events_completed < 16 && p_num_events_on_device > 0 &&
-        p_num_events_in_queue - p_num_events_completed > 0)
+    CommandGraph *graph = p_recording;
+
+    p_recording = 0;
+
+    unlockEvents();
+
+    return graph;
+}
+
+bool CommandQueue::recording() const
+{
+    CommandQueue *queue = const_cast<CommandQueue *>(this);
+
+    pthread_mutex_lock(&queue->p_event_list_mutex);
+    bool result = (p_recording != 0);
+    queue->unlockEvents();
+
+    return result;
+}
+
+/******************************************************************************
+* void CommandQueue::submitEvent(Event *event, bool push)
+******************************************************************************/
+void CommandQueue::submitEvent(Event *event, bool push)
+{
+    // Timing info if needed, before another thread can submit the event
+    if (p_properties & CL_QUEUE_PROFILING_ENABLE)
+        event->updateTiming(Event::Queue);
+
+    __sync_add_and_fetch(&p_num_events_in_queue, 1);
+
+    // Hand the event over without lock. If the ring is full, empty it and
+    // append the event directly, the events submitted before it by this
+    // thread are already in the ring, so that their order is kept.
+    if (!submit(event))
     {
-        pthread_mutex_unlock(&p_event_list_mutex);
-        return;
+        pthread_mutex_lock(&p_event_list_mutex);
+        drainSubmissions();
+        appendEvent(event);
+        unlockEvents();
     }
 
-    std::list<Event *>::iterator it = p_events.begin(), oldit;
+    if (!push)
+        return;
 
-    while (it != p_events.end())
+    // Explore the list for events we can push on the device, unless another
+    // thread holds the lock: it then pushes our event when it releases it.
+    p_submit_pending = 1;
+    pushPending();
+
+    cleanReleasedEvents();
+}
+
+/******************************************************************************
+* bool CommandQueue::submit(Event *event)
+* Bounded multi-producer ring: a slot whose seq equals a ticket is free for the
+* producer holding that ticket, and seq = ticket + 1 once the event is in.
+******************************************************************************/
+bool CommandQueue::submit(Event *event)
+{
+    unsigned int ticket = p_ring_head;
+
+    while (true)
     {
-        Event *event = *it;
+        Submission &slot = p_ring[ticket % COMMAND_QUEUE_RING_SIZE];
+        int diff = (int)(slot.seq - ticket);
 
-        if (event->status() == CL_COMPLETE)
-        {
-            // We cannot be deleted from inside us
-            event->setReleaseParent(false);
-            oldit = it;
-            ++it;
-
-            p_num_events_in_queue -= 1;
-            p_num_events_completed -= 1;
-            p_events.erase(oldit);
-            // put Completed events into another list
-            // let main thread release/delete them
-#if ONLY_MAIN_THREAD_CAN_RELEASE_EVENT
-            p_released_events.push_back(event);
-#else
-            clReleaseEvent(desc(event));
-#endif
-        }
-        else if (is_inorder) 
+        if (diff < 0)
+            return false;   // The consumer has not freed the slot yet, full
+
+        if (diff == 0 &&
+            __sync_bool_compare_and_swap(&p_ring_head, ticket, ticket + 1))
         {
-            // In Order Queue events are dispatched and completed in Order
-            break;
+            slot.event = event;
+            __sync_synchronize();   // Publish the event before the ticket
+            slot.seq = ticket + 1;
+            return true;
         }
-        else
+
+        // Another producer took the ticket
+        ticket = p_ring_head;
+    }
+}
+
+/******************************************************************************
+* void CommandQueue::drainSubmissions()
+******************************************************************************/
+void CommandQueue::drainSubmissions()
+{
+    // Submissions published from now on flag themselves again
+    p_submit_pending = 0;
+    __sync_synchronize();
+
+    while (true)
+    {
+        Submission &slot = p_ring[p_ring_tail % COMMAND_QUEUE_RING_SIZE];
+
+        if (slot.seq != p_ring_tail + 1)
+            break;          // Empty, or the producer is still filling it
+
+        __sync_synchronize();
+        Event *event = slot.event;
+
+        // Give the slot back to producers, for the ticket one lap ahead
+        __sync_synchronize();
+        slot.seq = p_ring_tail + COMMAND_QUEUE_RING_SIZE;
+        p_ring_tail += 1;
+
+        appendEvent(event);
+    }
+}
+
+/******************************************************************************
+* void CommandQueue::appendEvent(Event *event)
+******************************************************************************/
+void CommandQueue::appendEvent(Event *event)
+{
+    // An event whose wait list failed has been terminated before reaching
+    // the list, it never runs
+    if (event->status() < 0)
+    {
+        event->setReleaseParent(false);
+
+        if (__sync_sub_and_fetch(&p_num_events_in_queue, 1) == 0)
+            pthread_cond_broadcast(&p_event_list_cond);
+
+        releaseEvent(event);
+        return;
+    }
+
+    if (p_properties & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE)
+    {
+        // The order of an out-of-order queue only comes from its barriers:
+        // a barrier waits for all the events before it, and the events after
+        // a barrier or a clEnqueueWaitForEvents() wait for it.
+        if (p_fence)
+            event->addWaitEvent(p_fence);
+
+        if (event->type() == Event::Barrier)
         {
-            ++it;
+            for (std::list<Event *>::iterator it = p_events.begin();
+                 it != p_events.end(); ++it)
+                event->addWaitEvent(*it);
         }
+
+        if (event->type() == Event::Barrier ||
+            event->type() == Event::WaitForEvents)
+            p_fence = event;
+    }
+
+    p_events.push_back(event);
+
+    Event::QueueLink &link = event->queueLink();
+    link.queued = true;
+    link.ready = false;
+    link.pos = --p_events.end();
+
+    if (p_properties & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE)
+        markReady(event);
+}
+
+/******************************************************************************
+* bool CommandQueue::removeEvent(Event *event)
+******************************************************************************/
+bool CommandQueue::removeEvent(Event *event)
+{
+    pthread_mutex_lock(&p_event_list_mutex);
+
+    Event::QueueLink &link = event->queueLink();
+
+    if (!link.queued)
+    {
+        unlockEvents();
+        return false;
+    }
+
+    // We cannot be deleted from inside us
+    event->setReleaseParent(false);
+    p_events.erase(link.pos);
+    link.queued = false;
+
+    if (link.ready)
+    {
+        p_ready.erase(link.ready_pos);
+        link.ready = false;
     }
 
-    // We have cleared the list, so wake up the sleeping threads
-    if (p_num_events_in_queue == 0)
+    if (event == p_fence)
+        p_fence = NULL;
+
+    // We may have cleared the list, so wake up the sleeping threads
+    if (__sync_sub_and_fetch(&p_num_events_in_queue, 1) == 0)
         pthread_cond_broadcast(&p_event_list_cond);
 
-    pthread_mutex_unlock(&p_event_list_mutex);
+    unlockEvents();
 
+    return true;
+}
+
+/******************************************************************************
+* void CommandQueue::releaseEvent()
+******************************************************************************/
+void CommandQueue::releaseEvent(Event *e)
+{
+#if ONLY_MAIN_THREAD_CAN_RELEASE_EVENT
+    pthread_mutex_lock(&p_event_list_mutex);
+    p_released_events.push_back(e);
+    unlockEvents();
+#else
+    clReleaseEvent(desc(e));
+#endif
+}
+
+/******************************************************************************
+* void CommandQueue::cleanEvents()
+******************************************************************************/
+void CommandQueue::cleanEvents()
+{
     // Check now if we have to be deleted
     if (references() == 0)
     {
@@ -351,7 +557,7 @@ void CommandQueue::cleanReleasedEvents()
         p_released_events.pop_front();
     }
 
-    pthread_mutex_unlock(&p_event_list_mutex);
+    unlockEvents();
 #endif
 }
 
@@ -366,157 +572,166 @@ void CommandQueue::cleanReleasedEvents()
 void CommandQueue::pushEventsOnDevice(Event *ready_event,
                                       bool one_event_completed_on_device)
 {
-    int non_complete_events_traversed = 0;
+    pthread_mutex_lock(&p_event_list_mutex);
+    pushLocked(ready_event, one_event_completed_on_device);
+    pushPending();
+}
+
+/******************************************************************************
+* void CommandQueue::pushPending()
+* Pairs with submitEvent(): either its trylock succeeds, or the holder of the
+* lock sees p_submit_pending once it has released it.
+******************************************************************************/
+void CommandQueue::pushPending()
+{
+    __sync_synchronize();
+
+    while (p_submit_pending && pthread_mutex_trylock(&p_event_list_mutex) == 0)
+        pushLocked(NULL, false);
+}
+
+/******************************************************************************
+* void CommandQueue::unlockEvents()
+******************************************************************************/
+void CommandQueue::unlockEvents()
+{
+    pthread_mutex_unlock(&p_event_list_mutex);
+    pushPending();
+}
+
+/******************************************************************************
+* void CommandQueue::pushLocked(Event *ready_event, bool one_completed)
+* Body of pushEventsOnDevice(), entered with the lock held, returns without.
+******************************************************************************/
+void CommandQueue::pushLocked(Event *ready_event,
+                              bool one_event_completed_on_device)
+{
     bool is_ooo = (p_properties & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE) != 0;
     bool do_profile = (p_properties & CL_QUEUE_PROFILING_ENABLE) != 0;
 
-    pthread_mutex_lock(&p_event_list_mutex);
+    drainSubmissions();
 
     if (one_event_completed_on_device)
-    {
         p_num_events_on_device -= 1;
-        p_num_events_completed += 1;
+
+    if (!is_ooo)
+    {
+        // Completed events are not in the list anymore, only the head of an
+        // in-order queue can be pushed, once its dependencies are met. It is
+        // otherwise already pushed, or completing and about to be removed by
+        // Event::setStatus().
+        Event *event = (p_events.empty() ? NULL : p_events.front());
+
+        if (event && event->waitEventsAllCompleted() &&
+            event->status() == CL_QUEUED)
+        {
+            if (event->isInstantaneous())
+            {
+                completeInstantaneous(event, do_profile);
+                return;
+            }
+
+            pushToDevice(event, do_profile);
+        }
+
+        pthread_mutex_unlock(&p_event_list_mutex);
+        return;
     }
 
+    // Out-of-order: the last dependency of ready_event just completed
+    if (ready_event != NULL)
+        markReady(ready_event);
+
     // No need to push more events on Device if 1) device has already got
     // enough to work on, and 2) not pushing won't cause starvation of this
-    // commandqueue.  Not pushing can save p_event_list traversal time.
+    // commandqueue. The ready events are pushed by the next call.
     // 2 is a QoS number, set to 2 for the time being
     // imagaine there are multiple commandqueues on same device
-    if(is_ooo && ready_event == NULL &&
+    if(ready_event == NULL &&
        p_num_events_on_device > 2 && p_device->gotEnoughToWorkOn())
     {
         pthread_mutex_unlock(&p_event_list_mutex);
         return;
     }
 
-    // Explore the events in p_events and push on the device all of them that
-    // are :
-    //
-    // - Not already pushed (in CL_QUEUED state)
-    // - Not after a barrier, except if we begin with a barrier
-    // - If we are in-order, only the first event in CL_QUEUED state can
-    //   be pushed
-
-    std::list<Event *>::iterator it = p_events.begin();
-    std::list<Event *>::iterator oldit;
-    bool first = true;
-
-    // We assume that we will flush the command queue (submit all the events)
-    // This will be changed in the while() when we know that not all events
-    // are submitted.
-    p_flushed = true;
-
-    while (it != p_events.end())
+    while (!p_ready.empty())
     {
-        Event *event = *it;
-
-        // If the event is completed, remove it
-        if (event->status() == CL_COMPLETE || event->status() < 0)
-        {
-            event->setReleaseParent(false);
-            oldit = it;
-            ++it;
-
-            p_num_events_completed -= 1;
-            p_num_events_in_queue -= 1;
-            p_events.erase(oldit);
-            // put Completed events into another list
-            // let main thread release/delete them
-#if ONLY_MAIN_THREAD_CAN_RELEASE_EVENT
-            p_released_events.push_back(event);
-#else
-            clReleaseEvent(desc(event));
-#endif
-            continue;
-        }
+        Event *event = p_ready.front();
 
-        // If OOO queue threshold is met, skip examining the rest of events
-        if(ready_event == NULL && 
-           non_complete_events_traversed > OOO_QUEUE_PUSH_EVENTS_THRESHOLD)
-            break;
-        non_complete_events_traversed += 1;
+        p_ready.pop_front();
+        event->queueLink().ready = false;
 
-        // We cannot do out-of-order, so we can only push the first event.
-        if (!is_ooo && !first)
+        if (event->isInstantaneous())
         {
-            p_flushed = false; // There are remaining events.
-            break;
+            completeInstantaneous(event, do_profile);
+            return;
         }
 
-        // Stop if we encounter a barrier that isn't the first event in the list.
-        if (event->type() == Event::Barrier && !first)
-        {
-            // We have events to wait, stop
-            p_flushed = false;
-            break;
-        }
+        pushToDevice(event, do_profile);
+    }
 
-        // Completed events and first barriers are out, it remains real events
-        // that have to block in-order execution.
-        first = false;
+    pthread_mutex_unlock(&p_event_list_mutex);
+}
 
-        // If the event is not "pushable" (in CL_QUEUED state), skip it
-        // It is either Submitted or Running.
-        if (event->status() != CL_QUEUED)
-        {
-            // Intended event is scheduled, skip the rest in queue
-            if (event == ready_event) break;
+/******************************************************************************
+* void CommandQueue::markReady(Event *event)
+******************************************************************************/
+void CommandQueue::markReady(Event *event)
+{
+    Event::QueueLink &link = event->queueLink();
 
-            ++it;
-            continue;
-        }
+    if (!link.queued || link.ready || !event->waitEventsAllCompleted())
+        return;
 
-        // Check that all the waiting-on events of this event are finished
-        if (! event->waitEventsAllCompleted())
-        {
-            p_flushed = false;
-            // If we encounter a WaitForEvents event that is not "finished",
-            // don't push events after it.
-            if (event->type() == Event::WaitForEvents)
-                break;
-
-            // The event has its dependencies not already met.
-            ++it;
-            continue;
-        }
+    link.ready = true;
+    link.ready_pos = p_ready.insert(p_ready.end(), event);
+}
 
-        if (event->isInstantaneous())
-        {
-            // Remove event from the queue, otherwise, another thread may
-            // come in and try to set the event status to Complete again
-            p_num_events_in_queue -= 1;
-            p_events.erase(it);
-            p_flushed = (p_num_events_in_queue == 0);
-            // Pretend begin pushed to device, to maintain proper counting
-            p_num_events_on_device += 1;
-
-            // Set the event as completed. This will call pushEventsOnDevice,
-            // again, so release the lock to avoid a deadlock. We also return
-            // because the recursive call will continue our work.
-            if (p_flushed)
-                pthread_cond_broadcast(&p_event_list_cond);
-            pthread_mutex_unlock(&p_event_list_mutex);
-            event->setStatus(CL_COMPLETE);
-            clReleaseEvent(desc(event));
-            return;
-        }
+/******************************************************************************
+* void CommandQueue::pushToDevice(Event *event, bool do_profile)
+******************************************************************************/
+void CommandQueue::pushToDevice(Event *event, bool do_profile)
+{
+    if (do_profile) event->updateTiming(Event::Submit);
 
-        // The event can be pushed, if we need to
-        if (do_profile) event->updateTiming(Event::Submit);
+    event->setStatus(CL_SUBMITTED);
+    p_num_events_on_device += 1;
+    p_device->pushEvent(event);
+}
 
-        event->setStatus(CL_SUBMITTED);
-        p_num_events_on_device += 1;
-        p_device->pushEvent(event);
+/******************************************************************************
+* void CommandQueue::completeInstantaneous(Event *event, bool do_profile)
+******************************************************************************/
+void CommandQueue::completeInstantaneous(Event *event, bool do_profile)
+{
+    // Commands skipped by the device still report when they ran
+    if (do_profile)
+    {
+        event->updateTiming(Event::Submit);
+        event->updateTiming(Event::Start);
+        event->updateTiming(Event::End);
     }
 
-    if (ready_event != NULL && p_flushed)
-        p_flushed = (p_num_events_in_queue == 0);
+    // Remove event from the queue, otherwise, another thread may
+    // come in and try to set the event status to Complete again
+    p_events.erase(event->queueLink().pos);
+    event->queueLink().queued = false;
+
+    if (event == p_fence)
+        p_fence = NULL;
 
-    if (p_flushed)
+    // Pretend begin pushed to device, to maintain proper counting
+    p_num_events_on_device += 1;
+
+    if (__sync_sub_and_fetch(&p_num_events_in_queue, 1) == 0)
         pthread_cond_broadcast(&p_event_list_cond);
 
+    // Set the event as completed. This will call pushEventsOnDevice,
+    // again, so release the lock to avoid a deadlock. The recursive call
+    // continues our work.
     pthread_mutex_unlock(&p_event_list_mutex);
+    event->setStatus(CL_COMPLETE);
+    clReleaseEvent(desc(event));
 }
 
 /******************************************************************************
@@ -529,6 +744,9 @@ Event **CommandQueue::events(unsigned int &count,
 
     pthread_mutex_lock(&p_event_list_mutex);
 
+    drainSubmissions();
+
+    // Events still being submitted are counted, count is an upper bound
     count = p_num_events_in_queue;
     if (count > 0)
         result = (Event **)std::malloc(count * sizeof(Event *));
@@ -560,7 +778,7 @@ Event **CommandQueue::events(unsigned int &count,
     // Now result contains an immutable list of events. Even if the events
     // become completed in another thread while result is used, the events
     // are retained and so guaranteed to remain valid.
-    pthread_mutex_unlock(&p_event_list_mutex);
+    unlockEvents();
 
     return result;
 }
@@ -574,7 +792,8 @@ Event::Event(CommandQueue *parent,
              const cl_event *event_wait_list,
              cl_int *errcode_ret)
 : Object(Object::T_Event, parent),
-  p_status(status), p_device_data(0)
+  p_status(status), p_recorded(false), p_device_data(0),
+  p_instantaneous(false), p_num_wait_events(0)
 {
     // Initialize the locking machinery
     pthread_cond_init(&p_state_change_cond, 0);
@@ -582,6 +801,16 @@ Event::Event(CommandQueue *parent,
 
     std::memset(&p_timing, 0, sizeof(p_timing));
 
+    p_queue_link.queued = false;
+    p_queue_link.ready = false;
+
+    // Recorded commands are ordered by their command graph
+    if (parent && parent->recording() && num_events_in_wait_list)
+    {
+        *errcode_ret = CL_INVALID_OPERATION;
+        return;
+    }
+
     // Check sanity of parameters
     if (!event_wait_list && num_events_in_wait_list)
     {
@@ -619,7 +848,7 @@ Event::Event(CommandQueue *parent,
             // if event_wait_list[i] is already COMPLETE, don't add it!!!
 	    Event *wait_event = pobj(event_wait_list[i]);
             if (wait_event->addDependentEvent((Event *) this))
-                p_wait_events.push_back(wait_event);
+                p_num_wait_events += 1;
         }
         pthread_mutex_unlock(&p_state_mutex);
     }
@@ -650,6 +879,22 @@ Event::~Event()
     pthread_cond_destroy(&p_state_change_cond);
 }
 
+void *Event::operator new(size_t size)
+{
+    void *ptr = pool_alloc(size);
+
+    if (!ptr)
+        throw std::bad_alloc();
+
+    return ptr;
+}
+
+// The destructor is virtual, size is the one of the most derived class
+void Event::operator delete(void *ptr, size_t size)
+{
+    pool_free(ptr, size);
+}
+
 /******************************************************************************
 * bool Event::isInstantaneous() 
 ******************************************************************************/
@@ -658,6 +903,9 @@ bool Event::isInstantaneous() const
     // A dummy event has nothing to do on an execution device and must be
     // completed directly after being "submitted".
 
+    if (p_instantaneous)
+        return true;
+
     switch (type())
     {
         case Marker:
@@ -671,6 +919,14 @@ bool Event::isInstantaneous() const
     }
 }
 
+/******************************************************************************
+* void Event::setInstantaneous()
+******************************************************************************/
+void Event::setInstantaneous()
+{
+    p_instantaneous = true;
+}
+
 /******************************************************************************
 * void Event::setStatus
 ******************************************************************************/
@@ -704,55 +960,75 @@ int Event::setStatusHelper(Status status)
 
 void Event::setStatus(Status status)
 {
-    if (type() == Event::User || (parent() && status == CL_COMPLETE))
+    if (type() == Event::User ||
+        (parent() && (status == CL_COMPLETE || status < 0)))
+        finish(status, true);
+    else
+        setStatusHelper(status);
+}
+
+/******************************************************************************
+* void Event::finish(Status status, bool on_device)
+* Complete or terminate an event, then its dependents. on_device tells if the
+* event was counted by the device of its queue, terminated dependents never
+* reached it.
+******************************************************************************/
+void Event::finish(Status status, bool on_device)
+{
+    CommandQueue *cq = (CommandQueue *) parent();
+    if (cq != NULL)  clRetainCommandQueue(desc(cq));
+    bool already_pushed = false;
+
+    int num_dependent_events = setStatusHelper(status);
+
+    /*-------------------------------------------------------------------------
+    * Leave the event list of our queue, so that the events after us can
+    * be pushed. The queue keeps its reference on us until the end.
+    *------------------------------------------------------------------------*/
+    bool dequeued = (cq != NULL && cq->removeEvent(this));
+
+    /*-------------------------------------------------------------------------
+    * Notify dependent events, remove dependence, and push them if possible
+    * pushEventsOnDevice will remove events that are "completed".
+    *------------------------------------------------------------------------*/
+    for (int i = 0; i < num_dependent_events; i += 1)
     {
-        CommandQueue *cq = (CommandQueue *) parent();
-        if (cq != NULL)  clRetainCommandQueue(desc(cq));
-        bool already_pushed = false;
-
-        int num_dependent_events = setStatusHelper(status);  
-        /*---------------------------------------------------------------------
-        * From this point on, the event could be dereferenced to 0 and deleted!
-        * Thus we cannot call flushQueues(). Need to save these queues.
-        *--------------------------------------------------------------------*/
-
-        /*---------------------------------------------------------------------
-        * Notify dependent events, remove dependence, and push them if possible
-        * pushEventsOnDevice will remove events that are "completed".
-        *--------------------------------------------------------------------*/
-        for (int i = 0; i < num_dependent_events; i += 1)
+        Event *d_event = p_dependent_events[i];
+        CommandQueue *q = (CommandQueue *) d_event->parent();
+        if (d_event->removeWaitEvent(this) && q != NULL)  // order!
         {
-            Event *d_event = p_dependent_events[i];
-            CommandQueue *q = (CommandQueue *) d_event->parent();
-            if (d_event->removeWaitEvent(this) && q != NULL)  // order!
-            {
-	        // Terminate dependent events whose prececessor set an error code:
-	        if (status < 0) {
-                    d_event->setStatusHelper(status);
-	        }
-                q->pushEventsOnDevice(d_event, (cq == q));
-                if (cq == q)  already_pushed = true;
+            // Terminate dependent events whose predecessor set an error
+            // code, and theirs in turn: a barrier after a failed command
+            // would otherwise hold the events after it forever.
+            if (status < 0) {
+                d_event->finish(status, false);
+                d_event = NULL;
             }
+            q->pushEventsOnDevice(d_event, (cq == q) && on_device);
+            if (cq == q)  already_pushed = true;
         }
+    }
 
-        /*---------------------------------------------------------------------
-        * Inform our parent to push other events to the device if haven't done
-        * so already.  UserEvent's parent is NULL.
-        *--------------------------------------------------------------------*/
-        if (cq != NULL)
-        {
-            if (!already_pushed)  cq->pushEventsOnDevice(NULL, true);
-            clReleaseCommandQueue(desc(cq));
-        }
+    /*-------------------------------------------------------------------------
+    * Inform our parent to push other events to the device if haven't done
+    * so already.  UserEvent's parent is NULL.
+    *------------------------------------------------------------------------*/
+    if (cq != NULL)
+    {
+        if (!already_pushed)  cq->pushEventsOnDevice(NULL, on_device);
+
+        // From this point on, the event could be deleted
+        if (dequeued)  cq->releaseEvent(this);
+        clReleaseCommandQueue(desc(cq));
     }
-    else
-        setStatusHelper(status);
 }
 
 bool Event::addDependentEvent(Event *event)
 {
     pthread_mutex_lock(&p_state_mutex);
-    if (p_status == CL_COMPLETE)
+
+    // Completed or failed, the dependents have already been notified
+    if (p_status <= CL_COMPLETE)
     {
         pthread_mutex_unlock(&p_state_mutex);
         return false;
@@ -764,13 +1040,73 @@ bool Event::addDependentEvent(Event *event)
     return true;
 }
 
+bool Event::addWaitEvent(Event *event)
+{
+    // Locked, so that event cannot complete and remove itself before it is
+    // counted
+    pthread_mutex_lock(&p_state_mutex);
+
+    bool added = event->addDependentEvent(this);
+
+    if (added)
+        p_num_wait_events += 1;
+
+    pthread_mutex_unlock(&p_state_mutex);
+
+    return added;
+}
+
+/******************************************************************************
+* Waiting for the last reference of a recorded event
+******************************************************************************/
+void Event::waitUnreferenced()
+{
+    pthread_mutex_lock(&p_state_mutex);
+
+    while (references() > 1)
+        pthread_cond_wait(&p_state_change_cond, &p_state_mutex);
+
+    pthread_mutex_unlock(&p_state_mutex);
+}
+
+void Event::setRecorded()
+{
+    p_recorded = true;
+}
+
+bool Event::releaseReference()
+{
+    // Set before the event is shared, and we hold a reference
+    if (!p_recorded)
+        return dereference();
+
+    pthread_mutex_lock(&p_state_mutex);
+    bool last = dereference();
+    pthread_cond_broadcast(&p_state_change_cond);
+    pthread_mutex_unlock(&p_state_mutex);
+
+    return last;
+}
+
+void Event::rearm()
+{
+    pthread_mutex_lock(&p_state_mutex);
+
+    p_status = CL_QUEUED;
+    std::memset(&p_timing, 0, sizeof(p_timing));
+    p_num_wait_events = 0;
+    p_dependent_events.clear();
+
+    pthread_mutex_unlock(&p_state_mutex);
+}
+
 bool Event::removeWaitEvent(Event *event)
 {
     bool empty;
 
     pthread_mutex_lock(&p_state_mutex);
-    p_wait_events.remove(event);
-    empty = p_wait_events.empty();
+    p_num_wait_events -= 1;
+    empty = (p_num_wait_events == 0);
     pthread_mutex_unlock(&p_state_mutex);
 
     CommandQueue *q = (CommandQueue *) event->parent();
@@ -780,19 +1116,13 @@ bool Event::removeWaitEvent(Event *event)
 
 bool Event::waitEventsAllCompleted()
 {
-// YUAN TODO: p_wait_events is always shrinking, is lock necessary?
-//            it is a little bit faster without having to lock!!!
-#if 1
     bool empty;
 
     pthread_mutex_lock(&p_state_mutex);
-    empty = p_wait_events.empty();
+    empty = (p_num_wait_events == 0);
     pthread_mutex_unlock(&p_state_mutex);
 
     return empty;
-#else
-    return p_wait_events.empty();
-#endif
 }
 
 /******************************************************************************
@@ -856,6 +1186,16 @@ Event::Status Event::status() const
 ******************************************************************************/
 void Event::waitForStatus(Status status)
 {
+    // Poll a little first, short commands complete sooner than we would be
+    // woken up
+    volatile Status *current = &p_status;
+
+    if (spin_until([=]() { Status s = *current; return s == status || s <= 0; }))
+    {
+        __sync_synchronize();
+        return;
+    }
+
     pthread_mutex_lock(&p_state_mutex);
 
     while (p_status != status && p_status > 0)
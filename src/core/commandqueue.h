@@ -58,12 +58,35 @@ namespace Coal
 class Context;
 class DeviceInterface;
 class Event;
+class CommandGraph;
+
+/**
+ * \brief Number of slots of the submission ring of a command queue
+ *
+ * Must be a power of two.
+ */
+#define COMMAND_QUEUE_RING_SIZE 256
 
 /**
  * \brief Command queue
  *
  * This class holds a list of events that will be pushed on a given device.
  *
+ * Events are submitted through a ring of \c COMMAND_QUEUE_RING_SIZE slots,
+ * filled without lock by the threads enqueuing commands. A producer then
+ * only tries the lock of the queue: if another thread holds it, that thread
+ * moves the submissions to the list of events, \c p_events, and pushes them
+ * once it has released it (see \c pushPending()), so that enqueuing never
+ * waits for the lock. An event leaves this list when it completes, using
+ * the position it was given in it, so that the list only holds events still
+ * to run and the head of an in-order queue is the next event to push.
+ *
+ * Out-of-order queues keep a list of ready events, \c p_ready, instead of
+ * scanning \c p_events. Each event counts the events it waits for, and knows
+ * the events waiting for it, so that an event completing only visits these
+ * and the ones it leaves without dependencies become ready. Barriers turn
+ * into dependencies when they are moved to \c p_events.
+ *
  * More details are given on the \ref events page.
  */
 class CommandQueue : public _cl_command_queue, public Object
@@ -82,6 +105,35 @@ class CommandQueue : public _cl_command_queue, public Object
          */
         cl_int queueEvent(Event *event);
 
+        /**
+         * \brief Reset the device-specific data of the events of a
+         *        \c Coal::CommandGraph before they are queued again
+         * \param events events to reset
+         * \param count number of events
+         * \return \c CL_SUCCESS if success, otherwise an error code
+         */
+        cl_int resetEvents(Event **events, size_t count);
+
+        /**
+         * \brief Queue again the events of a \c Coal::CommandGraph
+         *
+         * The events have been reset with \c resetEvents(), then re-armed.
+         *
+         * \param events events to queue, in order
+         * \param count number of events
+         */
+        void replayEvents(Event **events, size_t count);
+
+        /**
+         * \brief Record the next queued events in \p graph
+         *
+         * Until \c endGraph(), \c queueEvent() gives the events to \p graph
+         * instead of running them.
+         */
+        void beginGraph(CommandGraph *graph);
+        CommandGraph *endGraph();   /*!< \brief Stop recording, return the graph given to \c beginGraph(), 0 if none */
+        bool recording() const;     /*!< \brief Is a \c Coal::CommandGraph being recorded */
+
         /**
          * \brief Information about the command queue
          * \copydetails Coal::DeviceInterface::info
@@ -118,13 +170,11 @@ class CommandQueue : public _cl_command_queue, public Object
          * \ref events .
          *
          * It is called by \c Coal::Event::setStatus() when an event is
-         * completed, or by \c queueEvent(). Its purpose is to explore the list
-         * of queued events (\c p_events) and to call
+         * completed, or by \c queueEvent(). Its purpose is to call
          * \c Coal::DeviceInterface::pushEvent() for each event meeting its push
          * conditions.
          *
-         * \param ready_event is know to be pushable, push events in the
-         * queue till this point, skip the events after this one.
+         * \param ready_event has just seen its last dependency complete.
          *
          * \param one_event_completed_on_device can be used to differentiate
          * whether this function is called by worker thread when an event is
@@ -138,25 +188,35 @@ class CommandQueue : public _cl_command_queue, public Object
          * must be completed before any other can be pushed. This ensures
          * in-order execution.
          *
-         * If this property is enable, more complex heuristics are used.
+         * If this property is enabled, the events of the ready list
+         * \c p_ready are pushed. An event is ready when all its dependencies
+         * are met:
          *
-         * The event list \c p_events is explored from top to bottom. At each
-         * loop iteration, checks are performed to see if the event can be pushed.
+         * - The events of its wait list are completed
+         * - For a \c Coal::BarrierEvent, all the events queued before it are
+         *   completed
+         * - The last \c Coal::BarrierEvent or \c Coal::WaitForEventsEvent
+         *   queued before it is completed
          *
-         * - When a \c Coal::BarrierEvent is encountered, no more events can be
-         *   pushed, except if the \c Coal::BarrierEvent is the first in the list,
-         *   as that means there are no other events that can be pushed, so the
-         *   barrier can go away
-         * - All events that are already pushed or finished are skipped
-         * - The wait list of the event is then explored to ensure that all its
-         *   dependencies are met.
-         * - Finally, if the events passes all the tests, it is either pushed on
-         *   the device, or simply set to \c Coal::Event::Complete if it's a
-         *   dummy event (see \c Coal::Event::isInstantaneous()).
+         * In both cases, a ready event is either pushed on the device, or
+         * simply set to \c Coal::Event::Complete if it's a dummy event (see
+         * \c Coal::Event::isInstantaneous()).
          */
         void pushEventsOnDevice(Event *ready_event = NULL,
                                 bool one_event_completed_on_device = false);
 
+        /**
+         * \brief Remove a completed or failed event from the queue
+         *
+         * Called by \c Coal::Event::setStatus(). The reference the queue holds
+         * on \p event is not dropped, the caller has to call
+         * \c releaseEvent() once done with it.
+         *
+         * \param event event of this queue
+         * \return true if \p event was in the queue and has been removed
+         */
+        bool removeEvent(Event *event);
+
         /**
          * \brief Push an event onto p_release_event list
          *
@@ -165,14 +225,12 @@ class CommandQueue : public _cl_command_queue, public Object
         void releaseEvent(Event *e);
 
         /**
-         * \brief Remove from the event list completed events
+         * \brief Delete the command queue if it has been released
          *
-         * This function is called periodically to clean the event list from
-         * completed events.
-         *
-         * It is needed to do that out of \c pushEventsOnDevice() as deleting
-         * event may \c dereference() this command queue, and also delete it. It
-         * would produce crashes.
+         * Completed events leave the event list as soon as they complete, see
+         * \c removeEvent(). Their release may have dropped the last
+         * reference to this command queue, it is deleted here, out of
+         * \c pushEventsOnDevice().
          */
         void cleanEvents();
 
@@ -214,17 +272,82 @@ class CommandQueue : public _cl_command_queue, public Object
                        bool include_completed_events = true);
 
     private:
+        /**
+         * \brief Hand a prepared event over to the queue
+         * \param event event whose device data is set
+         * \param push push the events of the queue, see \c pushPending()
+         */
+        void submitEvent(Event *event, bool push);
+
+        /**
+         * \brief Queue \p event in the submission ring
+         * \return false if the ring is full
+         */
+        bool submit(Event *event);
+
+        /**
+         * \brief Move the events of the submission ring to \c p_events
+         *
+         * Called with \c p_event_list_mutex locked. Stops at the first slot
+         * still being filled, its producer sets \c p_submit_pending once
+         * done, so that the next \c pushPending() moves it.
+         */
+        void drainSubmissions();
+
+        /**
+         * \brief Body of \c pushEventsOnDevice()
+         *
+         * Called with \c p_event_list_mutex locked, returns with it unlocked.
+         */
+        void pushLocked(Event *ready_event, bool one_event_completed_on_device);
+
+        /**
+         * \brief Push the submissions flagged while the lock was held
+         *
+         * Called without the lock. Takes it only if it is free, a thread
+         * holding it calls this function again once it has released it.
+         */
+        void pushPending();
+
+        void unlockEvents();            /*!< \brief Unlock \c p_event_list_mutex, then \c pushPending() */
+
+        void appendEvent(Event *event); /*!< \brief Add \p event at the end of \c p_events, locked */
+        void markReady(Event *event);   /*!< \brief Add \p event to \c p_ready if its dependencies are met, locked */
+        void pushToDevice(Event *event, bool do_profile); /*!< \brief Submit \p event to the device, locked */
+
+        /**
+         * \brief Complete a dummy event
+         *
+         * Called with \c p_event_list_mutex locked, returns with it unlocked.
+         */
+        void completeInstantaneous(Event *event, bool do_profile);
+
+        /**
+         * \brief Slot of the submission ring
+         */
+        struct Submission
+        {
+            volatile unsigned int seq;  /*!< \brief Ticket the slot is ready for, see \c submit() */
+            Event *event;
+        };
+
         DeviceInterface *p_device;
-        cl_int p_num_events_in_queue;
+        volatile cl_int p_num_events_in_queue;  /*!< \brief Events in the ring or in \c p_events */
         cl_int p_num_events_on_device;
-        cl_int p_num_events_completed;
         cl_command_queue_properties p_properties;
 
+        Submission p_ring[COMMAND_QUEUE_RING_SIZE];
+        volatile unsigned int p_ring_head;      /*!< \brief Next ticket taken by \c submit() */
+        unsigned int p_ring_tail;               /*!< \brief Next ticket moved to \c p_events, locked */
+        volatile int p_submit_pending;          /*!< \brief A submission waits for \c pushPending() */
+
         std::list<Event *> p_events;
+        std::list<Event *> p_ready;     /*!< \brief Events of an out-of-order queue ready to be pushed */
+        Event *p_fence;                 /*!< \brief Last barrier of an out-of-order queue still in \c p_events */
+        CommandGraph *p_recording;      /*!< \brief Graph recording the queued events, if any, locked */
         std::list<Event *> p_released_events;
         pthread_mutex_t p_event_list_mutex;
         pthread_cond_t p_event_list_cond;
-        bool p_flushed;
 };
 
 /**
@@ -330,6 +453,16 @@ class Event : public _cl_event, public Object
         void freeDeviceData();      /*!< \brief Call \c Coal::DeviceInterface::freeEventDeviceData() */
         virtual ~Event();           /*!< \brief Destructor */
 
+        /**
+         * \brief Allocate an event
+         *
+         * An event is created by each enqueue and destroyed once completed
+         * and released. Events are taken from the free lists of
+         * \c pool_alloc(), so that these do not go through malloc.
+         */
+        static void *operator new(size_t size);
+        static void operator delete(void *ptr, size_t size); /*!< \brief Give back an event to the free lists */
+
         /**
          * \brief Type of the event
          * \return type of the event
@@ -346,6 +479,17 @@ class Event : public _cl_event, public Object
          */
         bool isInstantaneous() const;
 
+        /**
+         * \brief Make the event dummy
+         *
+         * Called by a device finding in \c Coal::DeviceInterface::initEventDeviceData()
+         * that the event has nothing left to do, for instance a map or a
+         * read whose data are already in place. The command queue then
+         * completes the event once its dependencies are met, without
+         * pushing it on the device.
+         */
+        void setInstantaneous();
+
         /**
          * \brief Set the event status
          * 
@@ -439,10 +583,10 @@ class Event : public _cl_event, public Object
         bool addDependentEvent(Event *event);
 
         /**
-         * \brief Remove event from p_wait_events, which should be waited on
-         * before current event can start. When p_wait_events becomes empty,
+         * \brief Count out one of the events which should be waited on
+         * before current event can start. When none is left,
          * return true to indicate that current event is ready to be pushed.
-         * \param event the event to be removed from p_wait_events
+         * \param event the event which has completed
          */
         bool removeWaitEvent(Event *event);
 
@@ -452,6 +596,64 @@ class Event : public _cl_event, public Object
          */
         bool waitEventsAllCompleted();
 
+        /**
+         * \brief Make current event wait on \p event too
+         *
+         * Used by out-of-order command queues to turn barriers into
+         * dependencies.
+         *
+         * \param event the event to wait on
+         * \return false if \p event is already complete
+         */
+        bool addWaitEvent(Event *event);
+
+        /**
+         * \brief Make a completed event of a \c Coal::CommandGraph run again
+         *
+         * Sets the status back to \c CL_QUEUED and forgets the timings, the
+         * dependencies and the dependent events of the previous run.
+         */
+        void rearm();
+
+        /**
+         * \brief Wait for the caller to hold the only reference on the event
+         *
+         * The command queue and the dependent events drop their references
+         * once done with the event, after it completed. Used by
+         * \c Coal::CommandGraph before re-arming its events, which must be
+         * recorded, see \c releaseReference().
+         */
+        void waitUnreferenced();
+
+        void setRecorded();     /*!< \brief The event belongs to a \c Coal::CommandGraph */
+
+        /**
+         * \brief Drop a reference, for \c clReleaseEvent()
+         *
+         * The references of a recorded event are dropped under its lock, so
+         * that \c waitUnreferenced() returns once the thread dropping the
+         * last but one is done with the event.
+         *
+         * \return true if it was the last reference
+         */
+        bool releaseReference();
+
+        /**
+         * \brief Bookkeeping of the event in its command queue
+         *
+         * Only used by \c Coal::CommandQueue, under its lock, so that it
+         * removes the event without looking for it.
+         */
+        struct QueueLink
+        {
+            bool queued;                            /*!< \brief The event is in the event list of its queue */
+            bool ready;                             /*!< \brief The event is in the ready list of its queue */
+            std::list<Event *>::iterator pos;       /*!< \brief Position in the event list, if queued */
+            std::list<Event *>::iterator ready_pos; /*!< \brief Position in the ready list, if ready */
+        };
+
+        QueueLink &queueLink() { return p_queue_link; } /*!< \brief Bookkeeping of the queue */
+
     private:
         /**
          * \brief Helper function for setStatus()
@@ -459,20 +661,35 @@ class Event : public _cl_event, public Object
          */
         int setStatusHelper(Status status);
 
+        /**
+         * \brief Body of \c setStatus() for completed and failed events
+         *
+         * Leaves the queue and notifies the dependent events. The dependents
+         * of a failed event are terminated with its status, transitively.
+         *
+         * \param status new status
+         * \param on_device the event was pushed to the device of its queue
+         */
+        void finish(Status status, bool on_device);
+
     private:
         pthread_cond_t p_state_change_cond;
         pthread_mutex_t p_state_mutex;
 
         Status p_status;
+        bool p_recorded;
         void *p_device_data;
+        bool p_instantaneous;
         std::multimap<Status, CallbackData> p_callbacks;
 
         cl_uint p_timing[Max];
 
-        // p_wait_events: I should wait after these events complete
+        // p_num_wait_events: I should wait after these events complete
         // p_dependent_events: when I complete, I should notify these events
-        std::list<const Event *>   p_wait_events;
+        cl_uint p_num_wait_events;
         std::vector<Event *> p_dependent_events;
+
+        QueueLink p_queue_link;
 };
 
 }
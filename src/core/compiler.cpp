@@ -33,22 +33,32 @@
 
 #include "compiler.h"
 #include "deviceinterface.h"
+#include "config.h"
+#include "util.h"
 
 #include <cstring>
 #include <cstdio>
+#include <cstdlib>
+#include <set>
 #include <string>
 #include <sstream>
 #include <iostream>
 #include <clang/Frontend/CompilerInvocation.h>
+#include <clang/Frontend/FrontendActions.h>
 #include <clang/Frontend/TextDiagnosticPrinter.h>
 #include <clang/Frontend/LangStandard.h>
 #include <clang/Basic/Diagnostic.h>
 #include <clang/CodeGen/CodeGenAction.h>
+#include <llvm/ADT/SmallString.h>
 #include <llvm/ADT/SmallVector.h>
 #include <llvm/Support/Host.h>
+#include <llvm/Support/MD5.h>
 #include <llvm/Support/MemoryBuffer.h>
 #include <llvm/IR/Module.h>
 #include <llvm/IR/LLVMContext.h>
+#include <fstream>
+#include <pthread.h>
+#include <unistd.h>
 #include <sys/stat.h>
 
 std::string get_ocl_dsp();
@@ -66,8 +76,76 @@ Compiler::~Compiler()
 
 }
 
+/******************************************************************************
+* Flags accepted by compile(), besides -I and -D
+******************************************************************************/
+enum BuildFlag
+{
+    FlagSinglePrecisionConstant, FlagOptDisable, FlagMadEnable,
+    FlagUnsafeMathOptimizations, FlagFiniteMathOnly, FlagFastRelaxedMath,
+    FlagDenormsAreZero, FlagStrictAliasing, FlagNoSignedZeros, FlagNoWarnings,
+    FlagWerror, FlagStd, FlagKernelArgInfo, FlagUnknown
+};
+
+static const struct
+{
+    const char *name;
+    BuildFlag   flag;
+} build_flags[] =
+{
+    { "-cl-single-precision-constant", FlagSinglePrecisionConstant },
+    { "-cl-opt-disable",               FlagOptDisable },
+    { "-cl-mad-enable",                FlagMadEnable },
+    { "-cl-unsafe-math-optimizations", FlagUnsafeMathOptimizations },
+    { "-cl-finite-math-only",          FlagFiniteMathOnly },
+    { "-cl-fast-relaxed-math",         FlagFastRelaxedMath },
+    { "-cl-denorms-are-zero",          FlagDenormsAreZero },
+    { "-cl-strict-aliasing",           FlagStrictAliasing },
+    { "-cl-no-signed-zeros",           FlagNoSignedZeros },
+    { "-w",                            FlagNoWarnings },
+    { "-Werror",                       FlagWerror },
+    { "-cl-std=CL1.1",                 FlagStd },
+    { "-cl-std=CL1.2",                 FlagStd },
+    { "-cl-kernel-arg-info",           FlagKernelArgInfo },
+    { 0,                               FlagUnknown }
+};
+
+static BuildFlag build_flag(const std::string &token)
+{
+    int i = 0;
+
+    while (build_flags[i].name && token != build_flags[i].name) ++i;
+
+    return build_flags[i].flag;
+}
+
+bool Compiler::validOptions(const std::string &options)
+{
+    std::istringstream options_stream(options);
+    std::string token;
+
+    while (options_stream >> token)
+    {
+        // -I and -D take the next token when not followed by their value
+        if (token == "-I" || token == "-D")
+        {
+            options_stream >> token;
+            continue;
+        }
+
+        if (token.compare(0, 2, "-I") == 0 || token.compare(0, 2, "-D") == 0)
+            continue;
+
+        if (build_flag(token) == FlagUnknown)
+            return false;
+    }
+
+    return true;
+}
+
 int Compiler::compile(const std::string &options,
-                           llvm::MemoryBuffer *source)
+                           llvm::MemoryBuffer *source,
+                           llvm::LLVMContext &context)
 {
     /* Set options */
     p_options = options;
@@ -110,9 +188,8 @@ int Compiler::compile(const std::string &options,
     header_opts.UseStandardSystemIncludes = false;
     header_opts.UseStandardCXXIncludes = false;
 
-    // Set preprocessor options
+    // Set preprocessor options, the includes may be replaced by a PCH below
     prep_opts.RetainRemappedFileBuffers = true;
-    //prep_opts.ImplicitPCHInclude = "/usr/share/ti/opencl/clc.h";
     prep_opts.Includes.push_back("clc.h");
     prep_opts.Includes.push_back(p_device->builtinsHeader());
 
@@ -157,6 +234,10 @@ int Compiler::compile(const std::string &options,
 #endif
     header_opts.AddPath(header_path, clang::frontend::Angled, false, false);
 
+    // The headers of the library come first, the user ones follow
+    size_t lib_paths = header_opts.UserEntries.size();
+    size_t user_macros = prep_opts.Macros.size();
+
 
     while (options_stream >> token)
     {
@@ -194,72 +275,59 @@ int Compiler::compile(const std::string &options,
 	{
 	   prep_opts.addMacroDef(token.substr(2));
 	}
-        else if (token == "-cl-single-precision-constant")
-        {
-            lang_opts.SinglePrecisionConstants = true;
-        }
-        else if (token == "-cl-opt-disable")
-        {
-            p_optimize = false;
-            codegen_opts.OptimizationLevel = 0;
-        }
-        else if (token == "-cl-mad-enable")
+        else switch (build_flag(token))
         {
-            codegen_opts.LessPreciseFPMAD = true;
-        }
-        else if (token == "-cl-unsafe-math-optimizations")
-        {
-            codegen_opts.UnsafeFPMath = true;
-        }
-        else if (token == "-cl-finite-math-only")
-        {
-            codegen_opts.NoInfsFPMath = true;
-            codegen_opts.NoNaNsFPMath = true;
-        }
-        else if (token == "-cl-fast-relaxed-math")
-        {
-            codegen_opts.UnsafeFPMath = true;
-            codegen_opts.NoInfsFPMath = true;
-            codegen_opts.NoNaNsFPMath = true;
-            lang_opts.FastRelaxedMath = true;
-        }
-        else if (token == "-cl-denorms-are-zero")
-        {
-            //noop: there seems to be no corresponding clang option.
-        }
-        else if (token == "-cl-strict-aliasing")
-        {
-            codegen_opts.StructPathTBAA = false; // inverse of -fno-strict-aliasing
-        }
-        else if (token == "-cl-no-signed-zeros")
-        {
-            codegen_opts.NoSignedZeros = true;
-        }
-        else if (token == "-w")
-        {
-            diag_opts.IgnoreWarnings = true;
-        }
-        else if (token == "-Werror")
-        {
-            Werror = true;
-        }
-        else if (token == "-cl-std=CL1.1")
-        {
-        }
-        else if (token == "-cl-std=CL1.2")
-        {
-        }
-        else if (token == "-cl-kernel-arg-info")
-        {
-            // required by clGetKernelArgInfo() v1.2 API
-            codegen_opts.EmitOpenCLArgMetadata = true;
-        }
-        else
-        {
-            return CL_INVALID_BUILD_OPTIONS;
+            case FlagSinglePrecisionConstant:
+                lang_opts.SinglePrecisionConstants = true;
+                break;
+            case FlagOptDisable:
+                p_optimize = false;
+                codegen_opts.OptimizationLevel = 0;
+                break;
+            case FlagMadEnable:
+                codegen_opts.LessPreciseFPMAD = true;
+                break;
+            case FlagUnsafeMathOptimizations:
+                codegen_opts.UnsafeFPMath = true;
+                break;
+            case FlagFiniteMathOnly:
+                codegen_opts.NoInfsFPMath = true;
+                codegen_opts.NoNaNsFPMath = true;
+                break;
+            case FlagFastRelaxedMath:
+                codegen_opts.UnsafeFPMath = true;
+                codegen_opts.NoInfsFPMath = true;
+                codegen_opts.NoNaNsFPMath = true;
+                lang_opts.FastRelaxedMath = true;
+                break;
+            case FlagDenormsAreZero:
+                //noop: there seems to be no corresponding clang option.
+                break;
+            case FlagStrictAliasing:
+                codegen_opts.StructPathTBAA = false; // inverse of -fno-strict-aliasing
+                break;
+            case FlagNoSignedZeros:
+                codegen_opts.NoSignedZeros = true;
+                break;
+            case FlagNoWarnings:
+                diag_opts.IgnoreWarnings = true;
+                break;
+            case FlagWerror:
+                Werror = true;
+                break;
+            case FlagStd:
+                break;
+            case FlagKernelArgInfo:
+                // required by clGetKernelArgInfo() v1.2 API
+                codegen_opts.EmitOpenCLArgMetadata = true;
+                break;
+            default:
+                return CL_INVALID_BUILD_OPTIONS;
         }
     }
 
+    size_t num_user_macros = prep_opts.Macros.size() - user_macros;
+
     prep_opts.addMacroDef("__OPENCL_C_VERSION__=120");
 
     add_macrodefs_for_supported_opencl_extensions(prep_opts);  
@@ -268,6 +336,16 @@ int Compiler::compile(const std::string &options,
     //invocation.setLangDefaults(lang_opts,clang::IK_OpenCL);
     invocation.setLangDefaults(lang_opts,clang::IK_OpenCL, clang::LangStandard::lang_opencl12);
 
+    // Use the precompiled clc.h and built-ins header when there is one
+    std::string pch = precompiledHeader(lib_paths, user_macros,
+                                        num_user_macros);
+
+    if (!pch.empty())
+    {
+        prep_opts.ImplicitPCHInclude = pch;
+        prep_opts.Includes.clear();
+    }
+
     // Create the diagnostics engine
     p_log_printer = new clang::TextDiagnosticPrinter(p_log_stream, &diag_opts);
     p_compiler.createDiagnostics(p_log_printer);
@@ -297,7 +375,7 @@ int Compiler::compile(const std::string &options,
     //clock_gettime(CLOCK_MONOTONIC, &t0);
     // Compile
 
-    clang::CodeGenAction *Act = new clang::EmitLLVMOnlyAction(&llvm::getGlobalContext());
+    clang::CodeGenAction *Act = new clang::EmitLLVMOnlyAction(&context);
     if (!p_compiler.ExecuteAction(*Act))
     {
         // DEBUG
@@ -318,6 +396,196 @@ int Compiler::compile(const std::string &options,
     return false;
 }
 
+/******************************************************************************
+* Precompiled headers, one generation at a time per key
+******************************************************************************/
+static pthread_mutex_t pch_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pch_cond = PTHREAD_COND_INITIALIZER;
+static std::set<std::string> pch_generating;
+
+// Path, size and time of the file found for a quoted include in the first
+// num_paths include paths, empty if none
+static std::string header_stamp(const clang::HeaderSearchOptions &header_opts,
+                                size_t num_paths, const std::string &name)
+{
+    for (size_t i = 0; i < num_paths; ++i)
+    {
+        std::string path = header_opts.UserEntries[i].Path + "/" + name;
+        struct stat st;
+
+        if (stat(path.c_str(), &st) == 0)
+        {
+            std::ostringstream stamp;
+            stamp << path << ' ' << st.st_size << ' ' << st.st_mtime;
+            return stamp.str();
+        }
+    }
+
+    return std::string();
+}
+
+// Name of the macro of a -D or -U option
+static std::string macro_name(const std::string &macro)
+{
+    return macro.substr(0, macro.find('='));
+}
+
+std::string Compiler::precompiledHeader(size_t lib_paths, size_t user_macros,
+                                        size_t num_user_macros)
+{
+    clang::CompilerInvocation &invocation = p_compiler.getInvocation();
+    const clang::PreprocessorOptions &prep_opts =
+                                            invocation.getPreprocessorOpts();
+    const clang::HeaderSearchOptions &header_opts =
+                                            invocation.getHeaderSearchOpts();
+    const clang::LangOptions &lang_opts = *invocation.getLangOpts();
+    size_t end_user_macros = user_macros + num_user_macros;
+
+    /*-------------------------------------------------------------------------
+    * Everything the preprocessing of the headers depends on. The build date
+    * stands for the version of clang linked in this library. The options of
+    * the user are left out: the headers are found in the paths of the library
+    * before the user ones, and clang accepts a PCH built without the macros
+    * defined by the user. Only a user macro redefining one of the library
+    * would make it reject the PCH.
+    *------------------------------------------------------------------------*/
+    std::ostringstream key;
+    std::set<std::string> lib_macros;
+
+    key << COAL_VERSION "\n" LLVM_VERSION "\n" __DATE__ " " __TIME__ "\n"
+        << invocation.getTargetOpts().Triple << '\n'
+        << lang_opts.SinglePrecisionConstants << lang_opts.FastRelaxedMath
+        << lang_opts.FakeAddressSpaceMap << '\n';
+
+    for (size_t i = 0; i < prep_opts.Macros.size(); ++i)
+    {
+        if (i >= user_macros && i < end_user_macros)
+            continue;
+
+        key << (prep_opts.Macros[i].second ? "-U" : "-D")
+            << prep_opts.Macros[i].first << '\n';
+        lib_macros.insert(macro_name(prep_opts.Macros[i].first));
+    }
+
+    for (size_t i = user_macros; i < end_user_macros; ++i)
+        if (lib_macros.count(macro_name(prep_opts.Macros[i].first)))
+            return std::string();
+
+    for (size_t i = 0; i < prep_opts.Includes.size(); ++i)
+    {
+        std::string stamp = header_stamp(header_opts, lib_paths,
+                                         prep_opts.Includes[i]);
+
+        // Let the compilation report the missing header
+        if (stamp.empty())
+            return std::string();
+
+        key << stamp << '\n';
+    }
+
+    llvm::MD5 hash;
+    llvm::MD5::MD5Result result;
+    llvm::SmallString<32> digest;
+
+    hash.update(key.str());
+    hash.final(result);
+    llvm::MD5::stringifyResult(result, digest);
+
+    // Another user must not be able to plant headers in the directory
+    std::string dir = user_private_dir("pch");
+
+    if (dir.empty())
+        return std::string();
+
+    std::string base = dir + "/" + digest.str().str();
+    std::string header = base + ".h";
+    std::string pch = base + ".pch";
+    struct stat st;
+
+    /*-------------------------------------------------------------------------
+    * Compilations needing the PCH being generated wait for it, the others go
+    * on. Another process may generate the same one, each writes its own
+    * files and renames them once complete.
+    *------------------------------------------------------------------------*/
+    pthread_mutex_lock(&pch_mutex);
+
+    while (pch_generating.count(pch))
+        pthread_cond_wait(&pch_cond, &pch_mutex);
+
+    if (stat(pch.c_str(), &st) == 0)
+    {
+        pthread_mutex_unlock(&pch_mutex);
+        return pch;
+    }
+
+    pch_generating.insert(pch);
+    pthread_mutex_unlock(&pch_mutex);
+
+    std::ostringstream suffix;
+    suffix << "." << getpid() << ".tmp";
+
+    /*-------------------------------------------------------------------------
+    * The PCH is built from a header including the others. It is written
+    * once and never replaced, as the PCH records its time.
+    *------------------------------------------------------------------------*/
+    if (stat(header.c_str(), &st) != 0)
+    {
+        std::string tmp = header + suffix.str();
+        std::ofstream file(tmp.c_str());
+
+        for (size_t i = 0; i < prep_opts.Includes.size(); ++i)
+            file << "#include \"" << prep_opts.Includes[i] << "\"\n";
+
+        file.close();
+
+        // link() does not replace a header another process just wrote
+        if (file) link(tmp.c_str(), header.c_str());
+        remove(tmp.c_str());
+    }
+
+    /*-------------------------------------------------------------------------
+    * Same invocation without the user options, generating a PCH instead of
+    * LLVM IR.
+    *------------------------------------------------------------------------*/
+    clang::CompilerInstance compiler;
+    compiler.setInvocation(new clang::CompilerInvocation(invocation));
+
+    clang::FrontendOptions &frontend_opts = compiler.getFrontendOpts();
+    clang::PreprocessorOptions &pch_prep_opts = compiler.getPreprocessorOpts();
+    clang::HeaderSearchOptions &pch_header_opts = compiler.getHeaderSearchOpts();
+    std::string tmp = pch + suffix.str();
+
+    pch_prep_opts.Includes.clear();
+    pch_prep_opts.Macros.erase(pch_prep_opts.Macros.begin() + user_macros,
+                               pch_prep_opts.Macros.begin() + end_user_macros);
+    pch_header_opts.UserEntries.erase(
+                              pch_header_opts.UserEntries.begin() + lib_paths,
+                              pch_header_opts.UserEntries.end());
+    frontend_opts.ProgramAction = clang::frontend::GeneratePCH;
+    frontend_opts.OutputFile = tmp;
+    frontend_opts.DisableFree = false;
+    frontend_opts.Inputs.clear();
+    frontend_opts.Inputs.push_back(clang::FrontendInputFile(header,
+                                                            clang::IK_OpenCL));
+
+    compiler.createDiagnostics(new clang::IgnoringDiagConsumer());
+
+    clang::GeneratePCHAction action;
+
+    if (!compiler.ExecuteAction(action) || rename(tmp.c_str(), pch.c_str()))
+    {
+        remove(tmp.c_str());
+        pch.clear();
+    }
+
+    pthread_mutex_lock(&pch_mutex);
+    pch_generating.erase(base + ".pch");
+    pthread_cond_broadcast(&pch_cond);
+    pthread_mutex_unlock(&pch_mutex);
+
+    return pch;
+}
+
 // Query the device to get list of supported OpenCL extensions.  Standard
 // requires that each supported extension has a macro definition with the
 // same name as the extension
@@ -343,6 +611,28 @@ void Compiler::add_macrodefs_for_supported_opencl_extensions
     delete [] extensions;
 }
 
+void Compiler::reuse(const Compiler &compiler, llvm::Module *module)
+{
+    p_options = compiler.p_options;
+    p_log = compiler.p_log;
+    p_optimize = compiler.p_optimize;
+    p_module = module;
+}
+
+void Compiler::reuse(const std::string &options, const std::string &log)
+{
+    std::istringstream options_stream(options);
+    std::string token;
+
+    p_options = options;
+    p_log = log;
+    p_optimize = true;
+
+    while (options_stream >> token)
+        if (token == "-cl-opt-disable")
+            p_optimize = false;
+}
+
 const std::string &Compiler::log() const
 {
     return p_log;
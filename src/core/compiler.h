@@ -40,6 +40,7 @@
 
 namespace llvm
 {
+    class LLVMContext;
     class MemoryBuffer;
     class Module;
 }
@@ -74,12 +75,50 @@ class Compiler
          * \brief Compile \p source to produce a LLVM module
          * \param options options given to the compiler, described in the OpenCL spec
          * \param source source to be compiled
+         * \param context LLVM context in which the module is created
          * \return true if the compilation is successful, false otherwise
          * 2 if illegal options
          * \sa module()
          * \sa log()
          */
-        int compile(const std::string &options, llvm::MemoryBuffer *source);
+        int compile(const std::string &options, llvm::MemoryBuffer *source,
+                    llvm::LLVMContext &context);
+
+        /**
+         * \brief Check build options without compiling
+         *
+         * Used to report invalid options at once when the compilation is
+         * done in the background.
+         *
+         * \param options options given to the compiler
+         * \return true if \c compile() accepts them
+         */
+        static bool validOptions(const std::string &options);
+
+        /**
+         * \brief Take the result of a compilation done for another device
+         *
+         * The same source compiled with the same options for devices of the
+         * same type gives the same module, so that it is compiled once and
+         * this function gives its options, log and module to the compilers
+         * of the other devices.
+         *
+         * \param compiler compiler that did the compilation
+         * \param module copy of the module of \p compiler
+         */
+        void reuse(const Compiler &compiler, llvm::Module *module);
+
+        /**
+         * \brief Take the options and log of a build kept by the device
+         *
+         * Used when \c Coal::DeviceProgram::cachedBuild() gives back a
+         * previous build, so that the build info of the program is the one
+         * of that build.
+         *
+         * \param options options given to the build
+         * \param log build log
+         */
+        void reuse(const std::string &options, const std::string &log);
 
         /**
          * \brief Compilation log
@@ -131,6 +170,28 @@ class Compiler
         void add_macrodefs_for_supported_opencl_extensions
                               (clang::PreprocessorOptions &prep_opts);
 
+        /**
+         * \brief Precompiled header for the force-included headers
+         *
+         * \c clc.h and the built-ins header of the device are included by
+         * every compilation. They are precompiled on first use, as they
+         * depend on the target and language options chosen at run time, in
+         * the private directory of the user, see \c user_private_dir(). A
+         * PCH is generated without the \c -D and \c -I options of the user,
+         * once per target, language options, library macros and version of
+         * the headers, and is reused by all the compilations sharing them,
+         * in this process or later ones. Without such a directory, or when
+         * a user macro redefines one of the library, no PCH is used.
+         *
+         * \param lib_paths number of include paths of the library, before
+         *                  the ones of the user
+         * \param user_macros index of the first macro given by the user
+         * \param num_user_macros number of macros given by the user
+         * \return path of the precompiled header, empty if it cannot be used
+         */
+        std::string precompiledHeader(size_t lib_paths, size_t user_macros,
+                                      size_t num_user_macros);
+
 };
 
 }
@@ -185,6 +185,11 @@ Context::~Context()
         std::free((void *)p_d_devices);
 }
 
+BufferPool *Context::bufferPool()
+{
+    return &p_buffer_pool;
+}
+
 cl_int Context::info(cl_context_info param_name,
                      size_t param_value_size,
                      void *param_value,
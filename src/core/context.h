@@ -35,6 +35,7 @@
 
 #include "object.h"
 #include "icd.h"
+#include "bufferpool.h"
 
 #include <CL/cl.h>
 
@@ -94,6 +95,8 @@ class Context : public _cl_context, public Object
          */
         bool hasDevice(DeviceInterface *device) const;
 
+        BufferPool *bufferPool();   /*!< \brief Host memory of the buffers of this context */
+
     private:
         cl_context_properties *p_properties;
         void (CL_CALLBACK *p_pfn_notify)(const char *, const void *,
@@ -104,6 +107,7 @@ class Context : public _cl_context, public Object
         cl_device_id *p_d_devices;
         unsigned int p_num_devices, p_props_len;
         cl_platform_id p_platform;
+        BufferPool p_buffer_pool;
 };
 
 }
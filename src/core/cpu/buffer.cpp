@@ -34,6 +34,7 @@
 #include "device.h"
 
 #include "../memobject.h"
+#include "../context.h"
 
 #include <cstdlib>
 #include <cstring>
@@ -43,7 +44,7 @@ using namespace Coal;
 
 CPUBuffer::CPUBuffer(CPUDevice *device, MemObject *buffer, cl_int *rs)
 : DeviceBuffer(), p_device(device), p_buffer(buffer), p_data(0),
-  p_data_malloced(false)
+  p_data_size(0), p_pool(0), p_data_malloced(false)
 {
     if (buffer->type() == MemObject::SubBuffer)
     {
@@ -72,7 +73,7 @@ CPUBuffer::~CPUBuffer()
 {
     if (p_data_malloced)
     {
-        std::free((void *)p_data);
+        p_pool->release(p_data, p_data_size);
     }
 }
 
@@ -89,7 +90,6 @@ void *CPUBuffer::nativeGlobalPointer() const
 bool CPUBuffer::allocate()
 {
     size_t buf_size = p_buffer->size();
-    int    retval;
     void   *shared_ptr = p_buffer->shared_ptr();
 
     if (buf_size == 0)
@@ -99,11 +99,14 @@ bool CPUBuffer::allocate()
     if (!shared_ptr) {
         if (!p_data)
         {
-            // We don't use a host ptr, we need to allocate a buffer
-            retval = posix_memalign(&p_data, 128, buf_size);  // align for type double16 size.
-            if (retval)
+            // We don't use a host ptr, we need to allocate a buffer, from
+            // the memory recycled by the context
+            p_pool = ((Context *)p_buffer->parent())->bufferPool();
+            p_data = p_pool->alloc(buf_size);  // aligned for type double16 size.
+            if (!p_data)
                 return false;
 
+            p_data_size = buf_size;
             p_data_malloced = true;
 
             // Now set the shared data pointer, so we need not allocate again for this MemObject:
@@ -40,12 +40,13 @@ namespace Coal
 
 class CPUDevice;
 class MemObject;
+class BufferPool;
 
 /**
  * \brief CPU implementation of \c Coal::MemObject
  *
  * This class is responsible of the actual allocation of buffer objects, using
- * \c malloc() or by reusing a given \c host_ptr.
+ * the \c Coal::BufferPool of their context or by reusing a given \c host_ptr.
  */
 class CPUBuffer : public DeviceBuffer
 {
@@ -69,6 +70,8 @@ class CPUBuffer : public DeviceBuffer
         CPUDevice *p_device;
         MemObject *p_buffer;
         void *p_data;
+        size_t p_data_size;         /*!< \brief Size allocated from \c p_pool */
+        BufferPool *p_pool;         /*!< \brief Pool of the context \c p_data comes from, if \c p_data_malloced */
         bool p_data_malloced;
 };
 
@@ -159,6 +159,11 @@ size_t CPUKernelWorkGroup::getGlobalOffset(cl_uint dimindx) const
     return p_event->global_work_offset(dimindx);
 }
 
+const CPUWorkGroupContext *CPUKernelWorkGroup::getWorkGroupContext() const
+{
+    return &p_wg_context;
+}
+
 void CPUKernelWorkGroup::barrier(unsigned int flags)
 {
     p_had_barrier = true;
@@ -192,7 +197,7 @@ void CPUKernelWorkGroup::barrier(unsigned int flags)
             p_contexts = mmap(0, needed_size, PROT_EXEC | PROT_READ | PROT_WRITE, /* People say a stack must be executable */
                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
 
-            setWorkItemsData(p_contexts, contexts_size);
+            setWorkItemsData(p_contexts, needed_size);
         }
 
         // Now that we have a real main context, initialize it
@@ -299,6 +304,11 @@ static size_t get_global_offset(uint dimindx)
     return g_work_group->getGlobalOffset(dimindx);
 }
 
+static const CPUWorkGroupContext *get_work_group_context()
+{
+    return g_work_group->getWorkGroupContext();
+}
+
 static void barrier(unsigned int flags)
 {
     g_work_group->barrier(flags);
@@ -437,6 +447,8 @@ void *getBuiltin(const std::string &name)
         return (void *)&get_group_id;
     else if (name == "get_global_offset")
         return (void *)&get_global_offset;
+    else if (name == "__cpu_get_work_group_context")
+        return (void *)&get_work_group_context;
     else if (name == "barrier")
         return (void *)&barrier;
 
@@ -0,0 +1,379 @@
+/******************************************************************************
+ * Copyright (c) 2014, Texas Instruments Incorporated - http://www.ti.com/
+ *   All rights reserved.
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *       * Neither the name of Texas Instruments Incorporated nor the
+ *         names of its contributors may be used to endorse or promote products
+ *         derived from this software without specific prior written permission.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *   AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *   IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *   ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ *   LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *   CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *   SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *   INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *   CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *   ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ *   THE POSSIBILITY OF SUCH DAMAGE.
+ *****************************************************************************/
+/**
+ * \file cpu/cache.cpp
+ * \brief On-disk cache of the CPU programs
+ */
+#include "cache.h"
+
+#include <core/config.h>
+#include <core/util.h>
+
+#include <llvm/ADT/SmallString.h>
+#include <llvm/Bitcode/ReaderWriter.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Support/ErrorOr.h>
+#include <llvm/Support/Host.h>
+#include <llvm/Support/MD5.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <dirent.h>
+#include <unistd.h>
+#include <utime.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+using namespace Coal;
+
+#define CACHE_DEFAULT_MAX_MB 256
+
+CPUProgramCache *CPUProgramCache::p_instance = 0;
+pthread_once_t CPUProgramCache::p_instance_once = PTHREAD_ONCE_INIT;
+
+/******************************************************************************
+* instance
+******************************************************************************/
+CPUProgramCache *CPUProgramCache::instance()
+{
+    pthread_once(&p_instance_once, &createInstance);
+
+    return p_instance;
+}
+
+void CPUProgramCache::createInstance()
+{
+    if (getenv("TI_OCL_CACHE_KERNELS_OFF"))
+        return;
+
+    // Another user must not be able to plant programs in the cache
+    std::string dir = user_private_dir("cpu_cache");
+
+    if (dir.empty())
+        return;
+
+    p_instance = new CPUProgramCache(dir);
+}
+
+/******************************************************************************
+* Constructor
+******************************************************************************/
+CPUProgramCache::CPUProgramCache(const std::string &dir)
+: p_dir(dir), p_max_size(CACHE_DEFAULT_MAX_MB << 20)
+{
+    const char *max_mb = getenv("TI_OCL_CPU_CACHE_MAX_MB");
+
+    if (max_mb)
+        p_max_size = (uint64_t)strtoul(max_mb, 0, 10) << 20;
+
+    pthread_mutex_init(&p_mutex, 0);
+
+    /*-------------------------------------------------------------------------
+    * Anything changing the code generated from the same input. The build
+    * date stands for the version of stdlib and of the built-in headers.
+    *------------------------------------------------------------------------*/
+    p_salt = llvm::sys::getProcessTriple() + "\n" +
+             llvm::sys::getHostCPUName().str() + "\n" +
+             COAL_VERSION "\n" LLVM_VERSION "\n" __DATE__ " " __TIME__ "\n";
+}
+
+CPUProgramCache::~CPUProgramCache()
+{
+    pthread_mutex_destroy(&p_mutex);
+}
+
+/******************************************************************************
+* Keys
+******************************************************************************/
+std::string CPUProgramCache::digest(const std::string &data) const
+{
+    llvm::MD5 hash;
+    llvm::MD5::MD5Result result;
+    llvm::SmallString<32> str;
+
+    hash.update(p_salt);
+    hash.update(data);
+    hash.final(result);
+
+    llvm::MD5::stringifyResult(result, str);
+
+    return str.str();
+}
+
+/******************************************************************************
+* Whether a source includes a file, looking for # and include with nothing
+* but blanks in between, anywhere. Commented out directives are matched too,
+* which only costs the cache.
+******************************************************************************/
+static bool includesFiles(const std::string &source)
+{
+    for (size_t pos = source.find('#'); pos != std::string::npos;
+         pos = source.find('#', pos + 1))
+    {
+        size_t word = source.find_first_not_of(" \t", pos + 1);
+
+        if (word != std::string::npos &&
+            source.compare(word, 7, "include") == 0)
+            return true;
+    }
+
+    return false;
+}
+
+std::string CPUProgramCache::programKey(const std::string &source,
+                                        const std::string &options) const
+{
+    // The included files are not part of the key, they may have changed
+    if (includesFiles(source))
+        return std::string();
+
+    // The options come first, sized, so that no source can mimic them
+    std::ostringstream data;
+
+    data << options.size() << '\n' << options << source;
+
+    return digest(data.str());
+}
+
+std::string CPUProgramCache::moduleKey(const llvm::Module *module) const
+{
+    std::string bitcode;
+    llvm::raw_string_ostream ostream(bitcode);
+
+    llvm::WriteBitcodeToFile(module, ostream);
+    ostream.flush();
+
+    return digest(bitcode);
+}
+
+std::string CPUProgramCache::path(const std::string &key,
+                                  const char *ext) const
+{
+    return p_dir + "/" + key + ext;
+}
+
+/******************************************************************************
+* Files
+******************************************************************************/
+bool CPUProgramCache::readFile(const std::string &path,
+                               std::string &data) const
+{
+    std::ifstream file(path.c_str(), std::ios::in | std::ios::binary);
+
+    if (!file)
+        return false;
+
+    std::ostringstream contents;
+    contents << file.rdbuf();
+    data = contents.str();
+
+    if (data.empty())
+        return false;
+
+    // Recently used entries are evicted last
+    utime(path.c_str(), 0);
+
+    return true;
+}
+
+void CPUProgramCache::writeFile(const std::string &path, const char *data,
+                                size_t size) const
+{
+    // Written aside, then renamed: readers see the whole file or nothing
+    std::ostringstream tmp;
+    tmp << path << "." << getpid() << "." << pthread_self() << ".tmp";
+
+    std::ofstream file(tmp.str().c_str(), std::ios::out | std::ios::binary);
+
+    if (!file)
+        return;
+
+    file.write(data, size);
+    file.close();
+
+    if (!file || rename(tmp.str().c_str(), path.c_str()) != 0)
+    {
+        remove(tmp.str().c_str());
+        return;
+    }
+
+    evict();
+}
+
+/******************************************************************************
+* evict: remove the least recently used entries once the cache is bigger than
+* p_max_size. The temporary files of the writers are left alone.
+******************************************************************************/
+void CPUProgramCache::evict() const
+{
+    DIR *dir = opendir(p_dir.c_str());
+
+    if (!dir)
+        return;
+
+    std::vector<std::pair<time_t, std::string> > entries;
+    std::map<std::string, off_t> sizes;
+    uint64_t total = 0;
+    struct dirent *ent;
+
+    while ((ent = readdir(dir)) != 0)
+    {
+        std::string name(ent->d_name);
+        struct stat st;
+
+        if (name.size() < 4 || name.compare(name.size() - 4, 4, ".tmp") == 0)
+            continue;
+
+        std::string file = p_dir + "/" + name;
+
+        if (lstat(file.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+            continue;
+
+        entries.push_back(std::make_pair(st.st_mtime, file));
+        sizes[file] = st.st_size;
+        total += st.st_size;
+    }
+
+    closedir(dir);
+
+    if (total <= p_max_size)
+        return;
+
+    std::sort(entries.begin(), entries.end());
+
+    for (size_t i = 0; i < entries.size() && total > p_max_size; ++i)
+    {
+        // Another process may have evicted it already
+        if (remove(entries[i].second.c_str()) == 0)
+            total -= sizes[entries[i].second];
+    }
+}
+
+/******************************************************************************
+* Programs
+******************************************************************************/
+llvm::Module *CPUProgramCache::loadModule(const std::string &key,
+                                          llvm::LLVMContext &context,
+                                          std::string &log)
+{
+    std::string entry;
+
+    if (key.empty() || !readFile(path(key, ".bc"), entry))
+        return 0;
+
+    // The build log, sized, then the bitcode
+    size_t eol = entry.find('\n');
+    size_t log_size = strtoul(entry.c_str(), 0, 10);
+
+    if (eol == std::string::npos || log_size > entry.size() - eol - 1)
+        return 0;
+
+    std::string bitcode = entry.substr(eol + 1 + log_size);
+
+    std::unique_ptr<llvm::MemoryBuffer> buffer =
+        llvm::MemoryBuffer::getMemBuffer(bitcode, "<cache>", false);
+
+    llvm::ErrorOr<llvm::Module *> ModuleOrErr =
+        llvm::parseBitcodeFile(buffer->getMemBufferRef(), context);
+
+    if (!ModuleOrErr)
+        return 0;
+
+    log = entry.substr(eol + 1, log_size);
+
+    return ModuleOrErr.get();
+}
+
+void CPUProgramCache::storeModule(const std::string &key, llvm::Module *module,
+                                  const std::string &log)
+{
+    if (key.empty())
+        return;
+
+    std::ostringstream entry;
+    entry << log.size() << '\n' << log;
+
+    std::string bitcode = entry.str();
+    llvm::raw_string_ostream ostream(bitcode);
+
+    llvm::WriteBitcodeToFile(module, ostream);
+    ostream.flush();
+
+    writeFile(path(key, ".bc"), bitcode.data(), bitcode.size());
+}
+
+/******************************************************************************
+* Native objects, llvm::ObjectCache interface
+******************************************************************************/
+std::unique_ptr<llvm::MemoryBuffer>
+CPUProgramCache::getObject(const llvm::Module *module)
+{
+    std::string key = moduleKey(module);
+    std::string object;
+
+    if (readFile(path(key, ".o"), object))
+        return llvm::MemoryBuffer::getMemBufferCopy(object, key);
+
+    // Not cached, the JIT will compile the module and give us the object
+    pthread_mutex_lock(&p_mutex);
+    p_compiling[module] = key;
+    pthread_mutex_unlock(&p_mutex);
+
+    return std::unique_ptr<llvm::MemoryBuffer>();
+}
+
+void CPUProgramCache::notifyObjectCompiled(const llvm::Module *module,
+                                           llvm::MemoryBufferRef object)
+{
+    std::string key;
+
+    pthread_mutex_lock(&p_mutex);
+
+    std::map<const llvm::Module *, std::string>::iterator it =
+        p_compiling.find(module);
+
+    if (it != p_compiling.end())
+    {
+        key = it->second;
+        p_compiling.erase(it);
+    }
+
+    pthread_mutex_unlock(&p_mutex);
+
+    if (key.empty())
+        key = moduleKey(module);
+
+    writeFile(path(key, ".o"), object.getBufferStart(), object.getBufferSize());
+}
@@ -0,0 +1,149 @@
+/******************************************************************************
+ * Copyright (c) 2014, Texas Instruments Incorporated - http://www.ti.com/
+ *   All rights reserved.
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *       * Neither the name of Texas Instruments Incorporated nor the
+ *         names of its contributors may be used to endorse or promote products
+ *         derived from this software without specific prior written permission.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *   AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *   IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *   ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ *   LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *   CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *   SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *   INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *   CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *   ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ *   THE POSSIBILITY OF SUCH DAMAGE.
+ *****************************************************************************/
+/**
+ * \file cpu/cache.h
+ * \brief On-disk cache of the CPU programs
+ */
+#ifndef __CPU_CACHE_H__
+#define __CPU_CACHE_H__
+
+#include <llvm/ExecutionEngine/ObjectCache.h>
+
+#include <pthread.h>
+#include <stdint.h>
+#include <map>
+#include <string>
+
+namespace llvm
+{
+    class LLVMContext;
+    class Module;
+}
+
+namespace Coal
+{
+
+/**
+ * \brief On-disk cache of the CPU programs
+ *
+ * The cache is content-addressed: an entry is a file named after the MD5
+ * digest of everything it was built from, salted with the host triple and
+ * CPU and the versions of this library and of LLVM. It holds:
+ *
+ * - the linked and optimized bitcode of the programs, keyed by their source
+ *   and build options, so that a program built again is neither compiled,
+ *   linked with \b stdlib nor optimized (see \c Coal::CPUProgram::cachedBuild()).
+ * - the native objects generated by the JIT, keyed by the bitcode of the
+ *   module compiled, kernel stubs included. The cache is set as the
+ *   \c llvm::ObjectCache of the JIT of every \c Coal::CPUProgram.
+ *
+ * Programs including files are not cached, as the files are not part of the
+ * key. The entry of a program keeps its build log, given back on a hit.
+ *
+ * Entries are written to a temporary file first, then renamed, so that
+ * processes sharing the cache never read partial entries. Once the cache is
+ * bigger than \c TI_OCL_CPU_CACHE_MAX_MB megabytes, 256 by default, the least
+ * recently used entries are removed. The cache lives in the private directory
+ * of the user, see \c user_private_dir(), and is disabled, as the DSP one,
+ * when \c TI_OCL_CACHE_KERNELS_OFF is set or when there is no such directory.
+ */
+class CPUProgramCache : public llvm::ObjectCache
+{
+    public:
+        /**
+         * \brief The cache of this process
+         * \return the cache, 0 if caching is disabled
+         */
+        static CPUProgramCache *instance();
+
+        /**
+         * \brief Key of a program built from source
+         * \param source source of the program
+         * \param options build options
+         * \return the digest naming the entry of the program, empty if the
+         *         program cannot be cached
+         */
+        std::string programKey(const std::string &source,
+                               const std::string &options) const;
+
+        /**
+         * \brief Load a cached program
+         * \param key key of the program, see \c programKey()
+         * \param context context in which to create the module
+         * \param log set to the build log of the program
+         * \return the module, 0 if the program is not cached
+         */
+        llvm::Module *loadModule(const std::string &key,
+                                 llvm::LLVMContext &context,
+                                 std::string &log);
+
+        /**
+         * \brief Store a linked and optimized program
+         * \param key key of the program, see \c programKey()
+         * \param module module to store
+         * \param log build log of the program
+         */
+        void storeModule(const std::string &key, llvm::Module *module,
+                         const std::string &log);
+
+        void notifyObjectCompiled(const llvm::Module *module,
+                                  llvm::MemoryBufferRef object);
+        std::unique_ptr<llvm::MemoryBuffer> getObject(const llvm::Module *module);
+
+    private:
+        CPUProgramCache(const std::string &dir);
+        ~CPUProgramCache();
+
+        std::string digest(const std::string &data) const;
+        std::string moduleKey(const llvm::Module *module) const;
+        std::string path(const std::string &key, const char *ext) const;
+        bool readFile(const std::string &path, std::string &data) const;
+        void writeFile(const std::string &path, const char *data,
+                       size_t size) const;
+        void evict() const;
+
+        static void createInstance();
+
+        std::string p_dir;
+        std::string p_salt;
+
+        // Size of the entries above which the oldest are evicted
+        uint64_t p_max_size;
+
+        // Keys of the modules being compiled, from getObject() to
+        // notifyObjectCompiled()
+        std::map<const llvm::Module *, std::string> p_compiling;
+        pthread_mutex_t p_mutex;
+
+        static CPUProgramCache *p_instance;
+        static pthread_once_t p_instance_once;
+};
+
+}
+
+#endif
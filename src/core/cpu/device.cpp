@@ -35,8 +35,10 @@
 #include "buffer.h"
 #include "kernel.h"
 #include "program.h"
+#include "transfer.h"
 #include "worker.h"
 #include "builtins.h"
+#include "CL/cl_ext.h"
 
 #include <core/config.h>
 #include "../propertylist.h"
@@ -47,9 +49,12 @@
 #include "../program.h"
 #include "../util.h"
 
+#include <cerrno>
 #include <cstring>
 #include <cstdlib>
 #include <unistd.h>
+#include <sys/ipc.h>
+#include <sys/sem.h>
 
 #include <iostream>
 #include <fstream>
@@ -66,9 +71,116 @@ using namespace Coal;
 #define ONE_GIGABYTE (1024 * ONE_MEGABYTE)
 #define HALF_GIGABYTE (512 * ONE_MEGABYTE)
 
+/*
+ * CPUCoreBudget
+ */
+CPUCoreBudget *CPUCoreBudget::p_instance = 0;
+pthread_once_t CPUCoreBudget::p_instance_once = PTHREAD_ONCE_INIT;
+
+CPUCoreBudget *CPUCoreBudget::instance()
+{
+    pthread_once(&p_instance_once, &createInstance);
+
+    return p_instance;
+}
+
+void CPUCoreBudget::createInstance()
+{
+    const char *budget = getenv("TI_OCL_CPU_CORE_BUDGET");
+
+    if (!budget)
+        return;
+
+    int cores = atoi(budget);
+
+    if (cores <= 0)
+        cores = sysconf(_SC_NPROCESSORS_ONLN);
+
+    // The semaphore is named after the private directory of the user, only
+    // the processes of the user share it
+    std::string key_dir = user_private_dir("core_budget");
+
+    if (key_dir.empty())
+        return;
+
+    key_t key = ftok(key_dir.c_str(), 'C');
+
+    if (key == -1)
+        return;
+
+    // The first process sets the budget, the free cores then its size. The
+    // cores are 0 until then, so that the other processes wait in acquire().
+    int semid = semget(key, 2, IPC_CREAT | IPC_EXCL | 0600);
+
+    if (semid >= 0)
+    {
+        semctl(semid, 0, SETVAL, cores);
+        semctl(semid, 1, SETVAL, cores);
+    }
+    else if (errno == EEXIST)
+    {
+        semid = semget(key, 2, 0600);
+
+        int size = (semid < 0 ? 0 : semctl(semid, 1, GETVAL));
+
+        // Another size is set if no core is taken: all of them are taken at
+        // once, without waiting, so that no process can take one meanwhile
+        if (size > 0 && size != cores)
+        {
+            struct sembuf op;
+
+            op.sem_num = 0;
+            op.sem_op = -size;
+            op.sem_flg = IPC_NOWAIT;
+
+            if (semop(semid, &op, 1) == 0)
+            {
+                semctl(semid, 1, SETVAL, cores);
+                semctl(semid, 0, SETVAL, cores);
+            }
+        }
+    }
+
+    if (semid < 0)
+        return;
+
+    p_instance = new CPUCoreBudget(semid);
+}
+
+CPUCoreBudget::CPUCoreBudget(int semid)
+: p_semid(semid)
+{
+}
+
+void CPUCoreBudget::acquire()
+{
+    struct sembuf op;
+
+    op.sem_num = 0;
+    op.sem_op = -1;
+    op.sem_flg = SEM_UNDO;
+
+    while (semop(p_semid, &op, 1) == -1 && errno == EINTR)
+        ;
+}
+
+void CPUCoreBudget::release()
+{
+    struct sembuf op;
+
+    op.sem_num = 0;
+    op.sem_op = 1;
+    op.sem_flg = SEM_UNDO;
+
+    semop(p_semid, &op, 1);
+}
+
+/*
+ * CPUDevice
+ */
 CPUDevice::CPUDevice(DeviceInterface *parent_device, unsigned int cores)
-: DeviceInterface(), p_num_events(0), p_workers(0), p_stop(false),
-  p_initialized(false)
+: DeviceInterface(), p_workers(0), p_queues(0), p_num_pending(0),
+  p_num_idle(0), p_next_queue(0), p_stop(false), p_initialized(false)
 {
     // If this is a root device, then the number of cores is that of the system...
     p_parent_device = parent_device;
@@ -129,15 +241,19 @@ void CPUDevice::init()
     if (p_initialized) return;
 
     // Initialize the locking machinery
-    pthread_cond_init(&p_events_cond, 0);
-    pthread_mutex_init(&p_events_mutex, 0);
+    pthread_cond_init(&p_idle_cond, 0);
+    pthread_mutex_init(&p_idle_mutex, 0);
+
+    // One task deque per worker
+    p_queues = new CPUWorkQueue[numCPUs()];
 
     // Create worker threads
     p_workers = (pthread_t *)std::malloc(numCPUs() * sizeof(pthread_t));
 
     for (unsigned int i=0; i<numCPUs(); ++i)
     {
-        pthread_create(&p_workers[i], 0, &worker, this);
+        p_queues[i].init(this, i);
+        pthread_create(&p_workers[i], 0, &worker, &p_queues[i]);
     }
 
     p_initialized = true;
@@ -149,12 +265,12 @@ CPUDevice::~CPUDevice()
         return;
 
     // Terminate the workers and wait for them
-    pthread_mutex_lock(&p_events_mutex);
+    pthread_mutex_lock(&p_idle_mutex);
 
     p_stop = true;
 
-    pthread_cond_broadcast(&p_events_cond);
-    pthread_mutex_unlock(&p_events_mutex);
+    pthread_cond_broadcast(&p_idle_cond);
+    pthread_mutex_unlock(&p_idle_mutex);
 
     for (unsigned int i=0; i<numCPUs(); ++i)
     {
@@ -163,8 +279,9 @@ CPUDevice::~CPUDevice()
 
     // Free allocated memory
     std::free((void *)p_workers);
-    pthread_mutex_destroy(&p_events_mutex);
-    pthread_cond_destroy(&p_events_cond);
+    delete[] p_queues;
+    pthread_mutex_destroy(&p_idle_mutex);
+    pthread_cond_destroy(&p_idle_cond);
 }
 
 DeviceBuffer *CPUDevice::createDeviceBuffer(MemObject *buffer, cl_int *rs)
@@ -196,6 +313,9 @@ cl_int CPUDevice::initEventDeviceData(Event *event)
             data += e->offset();
 
             e->setPtr((void *)data);
+
+            // The buffer is in host memory, the pointer is all it takes
+            e->setInstantaneous();
             break;
         }
         case Event::MapImage:
@@ -216,12 +336,15 @@ cl_int CPUDevice::initEventDeviceData(Event *event)
             e->setPtr((void *)data);
             e->setRowPitch(image->row_pitch());
             e->setSlicePitch(image->slice_pitch());
+            e->setInstantaneous();
             break;
         }
         case Event::UnmapMemObject:
             // Nothing do to
+            event->setInstantaneous();
             break;
 
+
         case Event::NDRangeKernel:
         case Event::TaskKernel:
         {
@@ -233,13 +356,36 @@ cl_int CPUDevice::initEventDeviceData(Event *event)
             if (!prog->initJIT())
                 return CL_INVALID_PROGRAM_EXECUTABLE;
 
-            // Set device-specific data
+            // Set device-specific data, with the arguments as they are now
             CPUKernelEvent *cpu_e = new CPUKernelEvent(this, e);
+            cl_int rs = cpu_e->marshalArgs((CPUKernel *)e->deviceKernel());
+
+            if (rs != CL_SUCCESS)
+            {
+                delete cpu_e;
+                return rs;
+            }
+
             e->setDeviceData((void *)cpu_e);
 
             break;
         }
         default:
+            // Buffer, rectangular and image transfers, split among workers
+            if (CPUTransferEvent::isTransfer(event))
+            {
+                size_t bytes;
+
+                // Reads and writes of the buffer data in place
+                if (CPUTransferEvent::inPlace(event, this, bytes))
+                {
+                    zeroCopied(bytes);
+                    event->setInstantaneous();
+                    break;
+                }
+
+                event->setDeviceData((void *)CPUTransferEvent::create(event));
+            }
             break;
     }
 
@@ -257,71 +403,210 @@ void CPUDevice::freeEventDeviceData(Event *event)
 
             if (cpu_e)
                 delete cpu_e;
+
+            break;
         }
         default:
+            if (CPUTransferEvent::isTransfer(event))
+            {
+                CPUTransferEvent *cpu_e = (CPUTransferEvent *)event->deviceData();
+
+                if (cpu_e)
+                    delete cpu_e;
+            }
             break;
     }
 }
 
-void CPUDevice::pushEvent(Event *event)
+cl_int CPUDevice::resetEventDeviceData(Event *event)
 {
-    // Add an event in the list
-    pthread_mutex_lock(&p_events_mutex);
-
-    p_events.push_back(event);
-    p_num_events++;                 // Way faster than STL list::size() !
+    switch (event->type())
+    {
+        case Event::NDRangeKernel:
+        case Event::TaskKernel:
+        {
+            // Keep the kernel arguments marshalled when recording
+            CPUKernelEvent *cpu_e = (CPUKernelEvent *)event->deviceData();
 
-    pthread_cond_broadcast(&p_events_cond);
-    pthread_mutex_unlock(&p_events_mutex);
-}
+            cpu_e->reset();
+            return CL_SUCCESS;
+        }
+        default:
+            if (CPUTransferEvent::isTransfer(event))
+            {
+                CPUTransferEvent *cpu_e = (CPUTransferEvent *)event->deviceData();
 
-Event *CPUDevice::getEvent(bool &stop)
-{
-    // Return the first event in the list, if any. Remove it if it is a
-    // single-shot event.
-    pthread_mutex_lock(&p_events_mutex);
+                // Nothing to copy, see initEventDeviceData()
+                if (!cpu_e)
+                    return initEventDeviceData(event);
 
-    while (p_num_events == 0 && !p_stop)
-        pthread_cond_wait(&p_events_cond, &p_events_mutex);
+                cpu_e->reset();
+                return CL_SUCCESS;
+            }
 
-    if (p_stop)
-    {
-        pthread_mutex_unlock(&p_events_mutex);
-        stop = true;
-        return 0;
+            // Nothing allocated, only pointers to compute again
+            return initEventDeviceData(event);
     }
+}
 
-    Event *event = p_events.front();
-
-    // If the run of this event will finish it, remove it from the list
-    bool last_slot = true;
+void CPUDevice::pushEvent(Event *event)
+{
+    unsigned int num_tasks = 1;
 
+    // Let every worker take part in a kernel run, as long as there are
+    // enough work-groups
     if (event->type() == Event::NDRangeKernel ||
         event->type() == Event::TaskKernel)
     {
         CPUKernelEvent *ke = (CPUKernelEvent *)event->deviceData();
-        last_slot = ke->reserve();
+        num_tasks = ke->prepareTasks(numCPUs());
+    }
+    else if (CPUTransferEvent::isTransfer(event))
+    {
+        // Large transfers are split among the workers with nothing else to
+        // do, the one running the task and the sleeping ones
+        CPUTransferEvent *te = (CPUTransferEvent *)event->deviceData();
+        unsigned int num_idle = p_num_idle;
+
+        if (num_idle >= numCPUs())
+            num_idle = numCPUs() - 1;
+
+        num_tasks = te->prepareTasks(1 + num_idle);
     }
 
-    if (last_slot)
+    // Account for the tasks before they become visible, so that a worker
+    // popping them never sees p_num_pending wrap around.
+    __sync_add_and_fetch(&p_num_pending, num_tasks);
+
+    unsigned int first = __sync_fetch_and_add(&p_next_queue, num_tasks);
+
+    for (unsigned int i=0; i<num_tasks; ++i)
+        p_queues[(first + i) % numCPUs()].push(event);
+
+    // Wake up the sleeping workers, if any. The __sync above is a full
+    // barrier, pairing with the one in getTask().
+    if (p_num_idle)
     {
-        p_num_events--;
-        p_events.pop_front();
+        pthread_mutex_lock(&p_idle_mutex);
+        pthread_cond_broadcast(&p_idle_cond);
+        pthread_mutex_unlock(&p_idle_mutex);
     }
+}
+
+Event *CPUDevice::getTask(unsigned int worker)
+{
+    CPUWorkQueue &own = p_queues[worker];
+    Event *task;
+
+    while (!p_stop)
+    {
+        // Own work first, most recently pushed task
+        task = own.pop();
+
+        // Then try to steal from the other workers, nearest first
+        for (unsigned int i=1; i<numCPUs() && !task; ++i)
+            task = p_queues[(worker + i) % numCPUs()].steal();
 
-    pthread_mutex_unlock(&p_events_mutex);
+        if (task)
+        {
+            __sync_sub_and_fetch(&p_num_pending, 1);
+            return task;
+        }
+
+        // Nothing to do on the whole device, sleep until pushEvent()
+        pthread_mutex_lock(&p_idle_mutex);
+        __sync_add_and_fetch(&p_num_idle, 1);
 
-    return event;
+        while (p_num_pending == 0 && !p_stop)
+            pthread_cond_wait(&p_idle_cond, &p_idle_mutex);
+
+        __sync_sub_and_fetch(&p_num_idle, 1);
+        pthread_mutex_unlock(&p_idle_mutex);
+    }
+
+    return 0;
 }
 
 /******************************************************************************
 * Device's decision about whether CommandQueue should push more events over
-* This number could be tuned (e.g. using ooo example).  Note that p_num_events
-* are in device's queue, but not yet executed.
+* This number could be tuned (e.g. using ooo example).  Note that
+* p_num_pending counts the tasks in the workers' deques, not yet executed.
 ******************************************************************************/
 bool CPUDevice::gotEnoughToWorkOn()
 {
-    return p_num_events > 0;
+    return p_num_pending > 0;
+}
+
+/*
+ * CPUWorkQueue
+ */
+CPUWorkQueue::CPUWorkQueue()
+: p_device(0), p_index(0), p_size(0)
+{
+    pthread_mutex_init(&p_mutex, 0);
+}
+
+CPUWorkQueue::~CPUWorkQueue()
+{
+    pthread_mutex_destroy(&p_mutex);
+}
+
+void CPUWorkQueue::init(CPUDevice *device, unsigned int index)
+{
+    p_device = device;
+    p_index = index;
+}
+
+void CPUWorkQueue::push(Event *task)
+{
+    pthread_mutex_lock(&p_mutex);
+
+    p_tasks.push_back(task);
+    p_size++;
+
+    pthread_mutex_unlock(&p_mutex);
+}
+
+Event *CPUWorkQueue::pop()
+{
+    Event *task = 0;
+
+    if (p_size == 0)
+        return 0;
+
+    pthread_mutex_lock(&p_mutex);
+
+    if (!p_tasks.empty())
+    {
+        task = p_tasks.back();
+        p_tasks.pop_back();
+        p_size--;
+    }
+
+    pthread_mutex_unlock(&p_mutex);
+
+    return task;
+}
+
+Event *CPUWorkQueue::steal()
+{
+    Event *task = 0;
+
+    if (p_size == 0)
+        return 0;
+
+    pthread_mutex_lock(&p_mutex);
+
+    if (!p_tasks.empty())
+    {
+        task = p_tasks.front();
+        p_tasks.pop_front();
+        p_size--;
+    }
+
+    pthread_mutex_unlock(&p_mutex);
+
+    return task;
 }
 
 cl_int CPUDevice::createSubDevices(
@@ -780,6 +1065,9 @@ cl_int CPUDevice::info(cl_device_info param_name,
         case CL_DEVICE_REFERENCE_COUNT:
             SIMPLE_ASSIGN(cl_uint, references());
             break;
+        case CL_DEVICE_ZERO_COPY_BYTES_TI:
+            SIMPLE_ASSIGN(cl_ulong, zeroCopiedBytes());
+            break;
 
         default:
             return CL_INVALID_VALUE;
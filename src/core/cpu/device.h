@@ -36,7 +36,7 @@
 #include "../deviceinterface.h"
 
 #include <pthread.h>
-#include <list>
+#include <deque>
 #include <string>
 
 //TODO: #define MAX_PARTITION_PROPS (2)
@@ -49,6 +49,87 @@ class MemObject;
 class Event;
 class Program;
 class Kernel;
+class CPUDevice;
+
+/**
+ * \brief Task deque of a CPU worker thread
+ *
+ * Each worker owns one of these. A task is an event to run, kernel events
+ * being queued once per worker taking part in their run (see
+ * \c Coal::CPUKernelEvent::prepareTasks()). The owner takes tasks from the
+ * back while idle workers steal from the front, so owner and thieves only
+ * contend on the deque lock of one worker, never on a device-wide one.
+ */
+class CPUWorkQueue
+{
+    public:
+        CPUWorkQueue();
+        ~CPUWorkQueue();
+
+        /**
+         * \brief Attach the queue to its worker
+         * \param device device the worker belongs to
+         * \param index index of the worker in \p device
+         */
+        void init(CPUDevice *device, unsigned int index);
+
+        CPUDevice *device() const { return p_device; } /*!< \brief Device of the owning worker */
+        unsigned int index() const { return p_index; } /*!< \brief Index of the owning worker */
+
+        void push(Event *task);         /*!< \brief Append a task at the back */
+        Event *pop();                   /*!< \brief Take the last task, called by the owner, 0 if empty */
+        Event *steal();                 /*!< \brief Take the first task, called by the other workers, 0 if empty */
+
+    private:
+        CPUDevice *p_device;
+        unsigned int p_index;
+        std::deque<Event *> p_tasks;
+        volatile size_t p_size;     /*!< \brief Tasks queued, read without lock as a hint */
+        pthread_mutex_t p_mutex;
+};
+
+/**
+ * \brief Number of CPU cores shared by cooperating processes
+ *
+ * By default, each process runs one worker thread per core of its CPU
+ * devices, so that processes running kernels at the same time overload the
+ * cores. When \c TI_OCL_CPU_CORE_BUDGET is set, the workers of all the
+ * processes setting it take a core from a budget, a System V semaphore,
+ * before running a task and give it back once done. At most that many tasks
+ * then run at once on the machine. The variable gives the size of the
+ * budget, the number of cores if it is empty or 0.
+ *
+ * The semaphore is private to the user, named after its directory given by
+ * \c user_private_dir(). It outlives the processes: the first process
+ * creating it sets the budget, and a process starting with another size
+ * replaces it only if no core is taken. Otherwise the running processes keep
+ * the size they agreed on. \c ipcrm removes the semaphore.
+ *
+ * The semaphore operations are undone by the kernel when a process exits, so
+ * that a process killed while running a task does not leak its cores.
+ */
+class CPUCoreBudget
+{
+    public:
+        /**
+         * \brief The budget shared by this process
+         * \return the budget, 0 if \c TI_OCL_CPU_CORE_BUDGET is not set
+         */
+        static CPUCoreBudget *instance();
+
+        void acquire();     /*!< \brief Take a core, waiting for one if needed */
+        void release();     /*!< \brief Give back a core taken by \c acquire() */
+
+    private:
+        CPUCoreBudget(int semid);
+
+        static void createInstance();
+
+        int p_semid;
+
+        static CPUCoreBudget *p_instance;
+        static pthread_once_t p_instance_once;
+};
 
 /**
  * \brief CPU device
@@ -89,11 +170,23 @@ class CPUDevice : public DeviceInterface
 
         cl_int initEventDeviceData(Event *event);
         void freeEventDeviceData(Event *event);
+        cl_int resetEventDeviceData(Event *event);
 
         void pushEvent(Event *event);
-        Event *getEvent(bool &stop);
         bool gotEnoughToWorkOn();
 
+        /**
+         * \brief Get the next task to run
+         *
+         * Called by the worker \p worker. It first looks in its own deque,
+         * then tries to steal from the other workers and sleeps only when
+         * no work is left on the device.
+         *
+         * \param worker index of the calling worker
+         * \return the event to run, 0 if the worker has to stop
+         */
+        Event *getTask(unsigned int worker);
+
         cl_int createSubDevices(
                    const cl_device_partition_property * properties,
                    cl_uint                              num_devices,
@@ -110,15 +203,19 @@ class CPUDevice : public DeviceInterface
         std::string builtinsHeader(void) const { return "cpu.h"; }
 
     private:
-        unsigned int p_cores, p_num_events;
+        unsigned int p_cores;
         float       p_cpu_mhz;
         std::string p_device_name;
         pthread_t *p_workers;
-
-        std::list<Event *> p_events;
-        pthread_cond_t p_events_cond;
-        pthread_mutex_t p_events_mutex;
-        bool p_stop, p_initialized;
+        CPUWorkQueue *p_queues;
+
+        volatile size_t p_num_pending;      /*!< \brief Tasks queued but not yet taken */
+        volatile unsigned int p_num_idle;   /*!< \brief Workers sleeping on p_idle_cond */
+        unsigned int p_next_queue;          /*!< \brief Round-robin cursor used by pushEvent() */
+        pthread_cond_t p_idle_cond;
+        pthread_mutex_t p_idle_mutex;
+        volatile bool p_stop;
+        bool p_initialized;
 
         DeviceInterface *p_parent_device;
         cl_device_partition_property p_partition_properties[MAX_PARTITION_PROPS];
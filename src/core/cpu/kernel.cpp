@@ -35,11 +35,13 @@
 #include "buffer.h"
 #include "program.h"
 #include "builtins.h"
+#include "wga.h"
 
 #include "../kernel.h"
 #include "../memobject.h"
 #include "../events.h"
 #include "../program.h"
+#include "../util.h"
 
 #include <llvm/IR/Function.h>
 #include <llvm/IR/Constants.h>
@@ -51,28 +53,34 @@
 #include <cstdlib>
 #include <cstring>
 #include <iostream>
+#include <new>
 #include <sys/mman.h>
 
 using namespace Coal;
 
 CPUKernel::CPUKernel(CPUDevice *device, Kernel *kernel, llvm::Function *function)
 : DeviceKernel(), p_device(device), p_kernel(kernel), p_function(function),
-  p_call_function(0)
+  p_call_function(0), p_call_function_addr(0), p_private_size(0)
 {
     pthread_mutex_init(&p_call_function_mutex, 0);
 
-	const char *fn_name;
+    // Kernels turned into work-group functions by CPUWorkGroupAggregation
+    // run all their work-items in a single call
+    p_work_item_loops = function->getAttributes().hasAttribute(
+                            llvm::AttributeSet::FunctionIndex,
+                            CPU_WG_FUNCTION_ATTR);
 
-    // If we can reuse the same function between work groups, do it
-/* tag out for now     if (p_call_function)
-    {
-        llvm::Function *rs = p_call_function;
-        pthread_mutex_unlock(&p_call_function_mutex);
+    // Slots of their values living across barriers, given by the workers
+    llvm::Attribute private_size = function->getAttributes().getAttribute(
+                                       llvm::AttributeSet::FunctionIndex,
+                                       CPU_WG_PRIVATE_ATTR);
 
-        return rs;
-    } */
+    if (private_size.isStringAttribute())
+        p_private_size = std::strtoul(
+                             private_size.getValueAsString().str().c_str(), 0, 10);
 
-    /* Create a stub function in the form of
+    /* Create, once for all the runs of this kernel, a stub function in the
+     * form of
      *
      * void stub(void *args) {
      *     kernel(*(int *)((char *)args + 0),
@@ -90,13 +98,7 @@ CPUKernel::CPUKernel(CPUDevice *device, Kernel *kernel, llvm::Function *function
      *     );
      * }
      */
-	fn_name = kernel->p_name.c_str();
-    Program *p = (Program *)kernel->parent();
-    CPUProgram *prog = (CPUProgram *)(p->deviceDependentProgram(device));
-	//llvm::Function *t_function = prog->jit()->FindFunctionNamed(fn_name);
-
-	char * s_name = (char *) malloc(strlen(fn_name)+6);
-	sprintf(s_name,"_stub%s",fn_name);
+    std::string s_name = "_stub" + kernel->p_name;
 
     llvm::FunctionType *kernel_function_type = function->getFunctionType();
     llvm::FunctionType *stub_function_type = llvm::FunctionType::get(
@@ -174,9 +176,8 @@ CPUKernel::CPUKernel(CPUDevice *device, Kernel *kernel, llvm::Function *function
         function->getContext(),
         basic_block);
 
-    // Retain the function if it can be reused
+    // The stub is shared by all the runs of this kernel
     p_call_function = stub_function;
-
 }
 
 CPUKernel::~CPUKernel()
@@ -268,6 +269,16 @@ Kernel *CPUKernel::kernel() const
     return p_kernel;
 }
 
+bool CPUKernel::hasWorkItemLoops() const
+{
+    return p_work_item_loops;
+}
+
+size_t CPUKernel::privateSize() const
+{
+    return p_private_size;
+}
+
 CPUDevice *CPUKernel::device() const
 {
     return p_device;
@@ -304,139 +315,42 @@ size_t CPUKernel::typeOffset(size_t &offset, size_t type_len)
 
 llvm::Function *CPUKernel::callFunction()
 {
-	const char *fn_name;
-    pthread_mutex_lock(&p_call_function_mutex);
-
-    // If we can reuse the same function between work groups, do it
-    if (p_call_function)
-    {
-        llvm::Function *rs = p_call_function;
-        pthread_mutex_unlock(&p_call_function_mutex);
-
-        return rs;
-    } 
-
-    /* Create a stub function in the form of
-     *
-     * void stub(void *args) {
-     *     kernel(*(int *)((char *)args + 0),
-     *            *(float **)((char *)args + sizeof(int)),
-     *            *(sampler_t *)((char *)args + sizeof(int) + sizeof(float *)));
-     * }
-     *
-     * In LLVM, it is exprimed in the form of :
-     *
-     * @stub(i8* args) {
-     *     kernel(
-     *         load(i32* bitcast(i8* getelementptr(i8* args, i64 0), i32*)),
-     *         load(float** bitcast(i8* getelementptr(i8* args, i64 4), float**)),
-     *         ...
-     *     );
-     * }
-     */
-	fn_name = kernel()->p_name.c_str();
-    Program *p = (Program *)kernel()->parent();
-    CPUProgram *prog = (CPUProgram *)(p->deviceDependentProgram(device()));
-	llvm::Function *t_function = prog->jit()->FindFunctionNamed(fn_name);
-
-
-    llvm::FunctionType *kernel_function_type = p_function->getFunctionType();
-    llvm::FunctionType *stub_function_type = llvm::FunctionType::get(
-        p_function->getReturnType(),
-        llvm::Type::getInt8PtrTy(
-            p_function->getContext()),
-        false);
-    llvm::Function *stub_function = llvm::Function::Create(
-        stub_function_type,
-        llvm::Function::InternalLinkage,
-        "stub",
-        p_function->getParent());
+    return p_call_function;
+}
 
-    // Insert a basic block
-    llvm::BasicBlock *basic_block = llvm::BasicBlock::Create(
-        p_function->getContext(),
-        "",
-        stub_function);
+CPUKernel::Entry CPUKernel::callFunctionAddress()
+{
+    // Resolved only once, the program is finalized by the first run of one
+    // of its kernels
+    if (p_call_function_addr)
+        return p_call_function_addr;
 
-    // Create the function arguments
-    llvm::Argument &stub_arg = stub_function->getArgumentList().front();
-    llvm::SmallVector<llvm::Value *, 8> args;
-    size_t args_offset = 0;
+    pthread_mutex_lock(&p_call_function_mutex);
 
-    for (unsigned int i=0; i<kernel_function_type->getNumParams(); ++i)
+    if (!p_call_function_addr)
     {
-        llvm::Type *param_type = kernel_function_type->getParamType(i);
-        llvm::Type *param_type_ptr = param_type->getPointerTo(); // We'll use pointers to the value
-        const Kernel::Arg *arg = p_kernel->arg(i);
-
-        // Calculate the size of the arg
-        size_t arg_size = arg->valueSize() * arg->vecDim();
-
-        // Get where to place this argument
-        size_t arg_offset = typeOffset(args_offset, arg_size);
-
-        // %1 = getelementptr(args, $arg_offset);
-        llvm::Value *getelementptr = llvm::GetElementPtrInst::CreateInBounds(
-            &stub_arg,
-            llvm::ConstantInt::get(stub_function->getContext(),
-                                   llvm::APInt(64, arg_offset)),
-            "",
-            basic_block);
-
-        // %2 = bitcast(%1, $param_type_ptr)
-        llvm::Value *bitcast = new llvm::BitCastInst(
-            getelementptr,
-            param_type_ptr,
-            "",
-            basic_block);
-
-        // %3 = load(%2)
-        llvm::Value *load = new llvm::LoadInst(
-            bitcast,
-            "",
-            false,
-            arg_size,   // We ensure that an argument is always aligned on its size, it enables things like fast movaps
-            basic_block);
-
-        // We have the value, send it to the function
-        args.push_back(load);
+        Program *p = (Program *)p_kernel->parent();
+        CPUProgram *prog = (CPUProgram *)(p->deviceDependentProgram(p_device));
+
+        // Code generation uses the LLVM context of the program
+        p->lockContexts();
+        p_call_function_addr = (Entry)prog->jit()->getFunctionAddress(
+                                   p_call_function->getName().str());
+        p->unlockContexts();
     }
 
-    // Create the call instruction
-    llvm::CallInst *call_inst = llvm::CallInst::Create(
-        t_function,
-        args,
-        "",
-        basic_block);
-    call_inst->setCallingConv(p_function->getCallingConv());
-    call_inst->setTailCall();
-
-    // Create a return instruction to end the stub
-    llvm::ReturnInst::Create(
-        p_function->getContext(),
-        basic_block);
-
-    // Retain the function if it can be reused
-    p_call_function = stub_function;
-
     pthread_mutex_unlock(&p_call_function_mutex);
 
-    return stub_function;
+    return p_call_function_addr;
 }
 
 /*
  * CPUKernelEvent
  */
 CPUKernelEvent::CPUKernelEvent(CPUDevice *device, KernelEvent *event)
-: p_device(device), p_event(event), p_current_wg(0), p_finished_wg(0),
-  p_kernel_args(0)
+: p_device(device), p_event(event), p_num_workers(1), p_next_wg(0), p_tasks(0),
+  p_started(0), p_failed(0), p_args(0), p_args_size(0)
 {
-    // Mutex
-    pthread_mutex_init(&p_mutex, 0);
-
-    // Set current work group to (0, 0, ..., 0)
-    std::memset(p_current_work_group, 0, event->work_dim() * sizeof(size_t));
-
     // Populate p_max_work_groups
     p_num_wg = 1;
 
@@ -451,136 +365,131 @@ CPUKernelEvent::CPUKernelEvent(CPUDevice *device, KernelEvent *event)
 
 CPUKernelEvent::~CPUKernelEvent()
 {
-    pthread_mutex_destroy(&p_mutex);
-
-    if (p_kernel_args)
-        std::free(p_kernel_args);
+    if (p_args)
+        std::free(p_args);
 }
 
-bool CPUKernelEvent::reserve()
+void *CPUKernelEvent::operator new(size_t size)
 {
-    // Lock, this will be unlocked in takeInstance()
-    pthread_mutex_lock(&p_mutex);
+    void *ptr = pool_alloc(size);
 
-    // Last work group if current == max - 1
-    return (p_current_wg == p_num_wg - 1);
+    if (!ptr)
+        throw std::bad_alloc();
+
+    return ptr;
 }
 
-bool CPUKernelEvent::finished()
+void CPUKernelEvent::operator delete(void *ptr, size_t size)
 {
-    bool rs;
-
-    pthread_mutex_lock(&p_mutex);
-
-    rs = (p_finished_wg == p_num_wg);
-
-    pthread_mutex_unlock(&p_mutex);
+    pool_free(ptr, size);
+}
 
-    return rs;
+size_t CPUKernelEvent::numWorkGroups() const
+{
+    return p_num_wg;
 }
 
-void CPUKernelEvent::workGroupFinished()
+unsigned int CPUKernelEvent::prepareTasks(unsigned int num_workers)
 {
-    pthread_mutex_lock(&p_mutex);
+    p_num_workers = num_workers;
+    p_tasks = (p_num_wg < num_workers ? p_num_wg : num_workers);
 
-    p_finished_wg++;
+    return p_tasks;
+}
 
-    pthread_mutex_unlock(&p_mutex);
+bool CPUKernelEvent::start()
+{
+    return __sync_bool_compare_and_swap(&p_started, 0, 1);
 }
 
-CPUKernelWorkGroup *CPUKernelEvent::takeInstance()
+bool CPUKernelEvent::claimWorkGroups(size_t &begin, size_t &end)
 {
-    CPUKernelWorkGroup *wg = new CPUKernelWorkGroup((CPUKernel *)p_event->deviceKernel(),
-                                                    p_event,
-                                                    this,
-                                                    p_current_work_group);
+    size_t next = p_next_wg;
 
-    // Increment current work group
-    incVec(p_event->work_dim(), p_current_work_group, p_max_work_groups);
-    p_current_wg += 1;
+    if (next >= p_num_wg)
+        return false;
 
-    // Release event
-    pthread_mutex_unlock(&p_mutex);
+    // Guided chunk: half of the fair share of what is left
+    size_t chunk = (p_num_wg - next) / (2 * p_num_workers);
 
-    return wg;
-}
+    if (chunk == 0)
+        chunk = 1;
 
-void *CPUKernelEvent::kernelArgs() const
-{
-    return p_kernel_args;
-}
+    begin = __sync_fetch_and_add(&p_next_wg, chunk);
 
-void CPUKernelEvent::cacheKernelArgs(void *args)
-{
-    p_kernel_args = args;
-}
+    if (begin >= p_num_wg)
+        return false;
 
-/*
- * CPUKernelWorkGroup
- */
-CPUKernelWorkGroup::CPUKernelWorkGroup(CPUKernel *kernel, KernelEvent *event,
-                                       CPUKernelEvent *cpu_event,
-                                       const size_t *work_group_index)
-: p_kernel(kernel), p_cpu_event(cpu_event), p_event(event),
-  p_work_dim(event->work_dim()), p_contexts(0), p_stack_size(8192 /* TODO */),
-  p_had_barrier(false)
-{
+    end = begin + chunk;
 
-    // Set index
-    std::memcpy(p_index, work_group_index, p_work_dim * sizeof(size_t));
+    if (end > p_num_wg)
+        end = p_num_wg;
 
-    // Set maxs and global id
-    p_num_work_items = 1;
+    return true;
+}
 
-    for (unsigned int i=0; i<p_work_dim; ++i)
+void CPUKernelEvent::workGroupIndex(size_t wg, size_t *index) const
+{
+    // Linear index to (x, y, z), x varying fastest
+    for (cl_uint i=0; i<p_event->work_dim(); ++i)
     {
-        p_max_local_id[i] = event->local_work_size(i) - 1; // 0..n-1, not 1..n
-        p_num_work_items *= event->local_work_size(i);
-
-        // Set global id
-        p_global_id_start_offset[i] = (p_index[i] * event->local_work_size(i))
-                         + event->global_work_offset(i);
+        index[i] = wg % (p_max_work_groups[i] + 1);
+        wg /= p_max_work_groups[i] + 1;
     }
 }
 
-CPUKernelWorkGroup::~CPUKernelWorkGroup()
+bool CPUKernelEvent::taskFinished(bool success)
 {
-    p_cpu_event->workGroupFinished();
+    if (!success)
+        __sync_lock_test_and_set(&p_failed, 1);
+
+    return (__sync_sub_and_fetch(&p_tasks, 1) == 0);
 }
 
-void *CPUKernelWorkGroup::callArgs(std::vector<void *> &locals_to_free)
+bool CPUKernelEvent::failed() const
 {
-    if (p_cpu_event->kernelArgs() && !p_kernel->kernel()->hasLocals())
-    {
-        // We have cached the args and can reuse them
-        return p_cpu_event->kernelArgs();
-    }
+    return p_failed;
+}
 
-    // We need to create them from scratch
-    void *rs;
+void CPUKernelEvent::reset()
+{
+    p_num_workers = 1;
+    p_next_wg = 0;
+    p_tasks = 0;
+    p_started = 0;
+    p_failed = 0;
+}
 
+cl_int CPUKernelEvent::marshalArgs(CPUKernel *kernel)
+{
+    Kernel *k = kernel->kernel();
     size_t args_size = 0;
 
-    for (unsigned int i=0; i<p_kernel->kernel()->numArgs(); ++i)
+    for (unsigned int i=0; i<k->numArgs(); ++i)
     {
-        const Kernel::Arg *arg = p_kernel->kernel()->arg(i);
+        const Kernel::Arg *arg = k->arg(i);
         CPUKernel::typeOffset(args_size, arg->valueSize() * arg->vecDim());
     }
 
-    int retval = posix_memalign(&rs, 128, args_size);  // align for type double16 size.
-    if (retval || !rs)
-        return NULL;
+    // align for type double16 size.
+    if (args_size && (posix_memalign(&p_args, 128, args_size) || !p_args))
+    {
+        p_args = 0;
+        return CL_OUT_OF_HOST_MEMORY;
+    }
+
+    p_args_size = args_size;
 
     size_t arg_offset = 0;
 
-    for (unsigned int i=0; i<p_kernel->kernel()->numArgs(); ++i)
+    for (unsigned int i=0; i<k->numArgs(); ++i)
     {
-        const Kernel::Arg *arg = p_kernel->kernel()->arg(i);
+        const Kernel::Arg *arg = k->arg(i);
         size_t size = arg->valueSize() * arg->vecDim();
         size_t offset = CPUKernel::typeOffset(arg_offset, size);
 
         // Where to place the argument
-        unsigned char *target = (unsigned char *)rs;
+        unsigned char *target = (unsigned char *)p_args;
         target += offset;
 
         // We may have to perform some changes in the values (buffers, etc)
@@ -590,12 +499,14 @@ void *CPUKernelWorkGroup::callArgs(std::vector<void *> &locals_to_free)
             {
                 if (arg->file() == Kernel::Arg::Local)
                 {
-                    // Alloc a buffer and pass it to the kernel
-                    // align for type double16 size.
-		    void *local_buffer = NULL;
-                    int retval = posix_memalign(&local_buffer, 128, arg->allocAtKernelRuntime());
-                    locals_to_free.push_back(local_buffer);
-                    *(void **)target = local_buffer;
+                    // Each worker gives it a buffer, see workerArgs()
+                    LocalArg local;
+
+                    local.offset = offset;
+                    local.size = arg->allocAtKernelRuntime();
+                    p_local_args.push_back(local);
+
+                    *(void **)target = NULL;
                 }
                 else
                 {
@@ -610,13 +521,12 @@ void *CPUKernelWorkGroup::callArgs(std::vector<void *> &locals_to_free)
                     {
                         // Get the CPU buffer, allocate it and get its pointer
                         CPUBuffer *cpubuf =
-                            (CPUBuffer *)buffer->deviceBuffer(p_kernel->device());
-                        void *buf_ptr = 0;
+                            (CPUBuffer *)buffer->deviceBuffer(kernel->device());
 
-                        buffer->allocate(p_kernel->device());
-                        buf_ptr = cpubuf->data();
+                        if (!buffer->allocate(kernel->device()))
+                            return CL_MEM_OBJECT_ALLOCATION_FAILURE;
 
-                        *(void **)target = buf_ptr;
+                        *(void **)target = cpubuf->data();
                     }
                 }
 
@@ -627,7 +537,9 @@ void *CPUKernelWorkGroup::callArgs(std::vector<void *> &locals_to_free)
             {
                 // We need to ensure the image is allocated
                 Image2D *image = *(Image2D **)arg->data();
-                image->allocate(p_kernel->device());
+
+                if (!image->allocate(kernel->device()))
+                    return CL_MEM_OBJECT_ALLOCATION_FAILURE;
 
                 // Fall through to the memcpy
             }
@@ -638,47 +550,193 @@ void *CPUKernelWorkGroup::callArgs(std::vector<void *> &locals_to_free)
         }
     }
 
-    // Cache the arguments if we can do so
-    if (!p_kernel->kernel()->hasLocals())
-        p_cpu_event->cacheKernelArgs(rs);
+    return CL_SUCCESS;
+}
 
-    return rs;
+void *CPUKernelEvent::args() const
+{
+    return p_args;
+}
+
+size_t CPUKernelEvent::argsSize() const
+{
+    return p_args_size;
+}
+
+const std::vector<CPUKernelEvent::LocalArg> &CPUKernelEvent::localArgs() const
+{
+    return p_local_args;
+}
+
+/*
+ * CPUKernelWorkGroup
+ */
+CPUKernelWorkGroup::CPUKernelWorkGroup()
+: p_kernel(0), p_cpu_event(0), p_event(0), p_work_dim(0),
+  p_kernel_func_addr(0), p_args(0), p_arena(0), p_arena_size(0), p_contexts(0),
+  p_stack_size(8192 /* TODO */), p_num_work_items(0), p_had_barrier(false)
+{
+}
+
+CPUKernelWorkGroup::~CPUKernelWorkGroup()
+{
+    if (p_arena)
+        std::free(p_arena);
 }
 
-bool CPUKernelWorkGroup::run()
+bool CPUKernelWorkGroup::begin(CPUKernel *kernel, KernelEvent *event,
+                               CPUKernelEvent *cpu_event)
 {
-    // Get the kernel function to call
-    std::vector<void *> locals_to_free;
-    llvm::Function *kernel_func = p_kernel->callFunction();
+    p_kernel = kernel;
+    p_event = event;
+    p_cpu_event = cpu_event;
+    p_work_dim = event->work_dim();
+    p_args = 0;
+
+    // Set maxs, they are the same for every work-group of the event
+    p_num_work_items = 1;
+
+    for (unsigned int i=0; i<p_work_dim; ++i)
+    {
+        p_max_local_id[i] = event->local_work_size(i) - 1; // 0..n-1, not 1..n
+        p_num_work_items *= event->local_work_size(i);
+    }
+
+    // Work-group information read by the work-group functions, the event
+    // already has the default values for the unused dimensions
+    p_wg_context.work_dim = p_work_dim;
+
+    for (unsigned int i=0; i<MAX_WORK_DIMS; ++i)
+    {
+        p_wg_context.global_size[i] = event->global_work_size(i);
+        p_wg_context.local_size[i] = event->local_work_size(i);
+        p_wg_context.num_groups[i] = event->global_work_size(i) /
+                                     event->local_work_size(i);
+        p_wg_context.global_offset[i] = event->global_work_offset(i);
+        p_wg_context.group_id[i] = 0;
+        p_wg_context.global_first[i] = 0;
+    }
+
+    p_wg_context.private_data = 0;
 
 #if 0  // Let's see the stub's IR:
-    kernel_func->dump();
+    p_kernel->callFunction()->dump();
 #endif
 
-    if (!kernel_func)
-        return false;
+    // Get the native stub to call, resolved once per kernel
+    p_kernel_func_addr = p_kernel->callFunctionAddress();
+
+    // Get the arguments. The __local buffers are shared by the work-groups
+    // this worker runs, one after the other.
+    p_args = workerArgs();
+
+    return (p_kernel_func_addr != 0 && (p_args || !p_cpu_event->argsSize()) &&
+            (p_wg_context.private_data || !p_kernel->privateSize()));
+}
+
+void CPUKernelWorkGroup::end()
+{
+    // The arguments belong to the event or to the arena, kept for the next run
+    p_args = 0;
+    p_kernel = 0;
+}
+
+// Round a size up to the double16 alignment of the arguments
+static inline size_t alignArena(size_t size)
+{
+    return (size + 127) & ~(size_t)127;
+}
+
+void *CPUKernelWorkGroup::workerArgs()
+{
+    const std::vector<CPUKernelEvent::LocalArg> &locals =
+        p_cpu_event->localArgs();
+
+    // Without __local arguments, all the workers share the arguments
+    size_t args_size = locals.empty() ? 0 :
+                       alignArena(p_cpu_event->argsSize());
+    size_t size = args_size;
+
+    for (size_t i=0; i<locals.size(); ++i)
+        size += alignArena(locals[i].size);
+
+    // Private slots of the work-items, see CPUWorkGroupAggregation
+    size_t private_offset = size;
+    size_t private_size = p_kernel->privateSize() * p_num_work_items;
+
+    size += private_size;
+
+    if (size > p_arena_size)
+    {
+        if (p_arena)
+            std::free(p_arena);
+
+        p_arena_size = 0;
+
+        if (posix_memalign(&p_arena, CPU_WG_PRIVATE_ALIGN, size) || !p_arena)
+        {
+            p_arena = 0;
+            return 0;
+        }
+
+        p_arena_size = size;
+    }
+
+    unsigned char *arena = (unsigned char *)p_arena;
+
+    if (private_size)
+        p_wg_context.private_data = (size_t)(arena + private_offset);
+
+    if (locals.empty())
+        return p_cpu_event->args();
 
-    Program *p = (Program *)p_kernel->kernel()->parent();
-    CPUProgram *prog = (CPUProgram *)(p->deviceDependentProgram(p_kernel->device()));
+    // Copy the arguments and point the __local ones to the buffers following
+    // them
+    unsigned char *local_buffer = arena + args_size;
 
-    // Make object usable for execution:  (only applies to MCJIT):
-    prog->jit()->finalizeObject();
+    std::memcpy(arena, p_cpu_event->args(), p_cpu_event->argsSize());
+
+    for (size_t i=0; i<locals.size(); ++i)
+    {
+        *(void **)(arena + locals[i].offset) = local_buffer;
+        local_buffer += alignArena(locals[i].size);
+    }
+
+    return p_arena;
+}
+
+bool CPUKernelWorkGroup::run(const size_t *work_group_index)
+{
+    // Set index and global id
+    std::memcpy(p_index, work_group_index, p_work_dim * sizeof(size_t));
 
-    std::string kname = kernel_func->getName().str();
-    p_kernel_func_addr =(void(*)(void *)) prog->jit()->getFunctionAddress(kname);
+    for (unsigned int i=0; i<p_work_dim; ++i)
+    {
+        p_global_id_start_offset[i] = (p_index[i] * p_event->local_work_size(i))
+                         + p_event->global_work_offset(i);
 
-    // Get the arguments
-    p_args = callArgs(locals_to_free);
+        p_wg_context.group_id[i] = p_index[i];
+        p_wg_context.global_first[i] = p_global_id_start_offset[i];
+    }
 
     // Tell the builtins this thread will run a kernel work group
     setThreadLocalWorkGroup(this);
 
     // Initialize the dummy context used by the builtins before a call to barrier()
+    p_contexts = 0;
+    p_had_barrier = false;
     p_current_work_item = 0;
     p_current_context = &p_dummy_context;
 
     std::memset(p_dummy_context.local_id, 0, p_work_dim * sizeof(size_t));
 
+    // Work-group function: it loops over the work-items itself
+    if (p_kernel->hasWorkItemLoops())
+    {
+        p_kernel_func_addr(p_args);
+        return true;
+    }
+
     do
     {
         // Simply call the "call function", it and the builtins will do the rest
@@ -702,17 +760,11 @@ bool CPUKernelWorkGroup::run()
             Context *ctx = getContextAddr(i);
             swapcontext(&main_context->context, &ctx->context);
         }
-    }
 
-    // Free the allocated locals
-    if (p_kernel->kernel()->hasLocals())
-    {
-        for (size_t i=0; i<locals_to_free.size(); ++i)
-        {
-            std::free(locals_to_free[i]);
-        }
-
-        std::free(p_args);
+        // The stacks are reused by the next work-group run by this thread,
+        // their contexts must be initialized again.
+        for (unsigned int i=0; i<p_num_work_items; ++i)
+            getContextAddr(i)->initialized = 0;
     }
 
     return true;
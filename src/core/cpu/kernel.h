@@ -94,6 +94,21 @@ class CPUKernel : public DeviceKernel
         llvm::Function *function() const;   /*!< \brief \c llvm::Function representing the kernel but <strong>not to be run</strong> */
         llvm::Function *callFunction();     /*!< \brief stub function used to run the kernel, see \ref llvm */
 
+        typedef void (*Entry)(void *);      /*!< \brief Native stub, taking the arguments built by \c Coal::CPUKernelEvent::marshalArgs() */
+
+        /**
+         * \brief Native address of the stub function
+         *
+         * The stub is compiled by the JIT of the program when a kernel of
+         * the program is first run. Its address is then resolved only once
+         * and kept, so that running a kernel does not query the JIT.
+         *
+         * \return address of \c callFunction(), 0 if it cannot be compiled
+         */
+        Entry callFunctionAddress();
+        bool hasWorkItemLoops() const;      /*!< \brief The kernel is a work-group function, running all the work-items of a work-group in one call */
+        size_t privateSize() const;         /*!< \brief Bytes of the private slots of a work-item of a work-group function, see \c CPU_WG_PRIVATE_ATTR */
+
         /**
          * \brief Calculate where to place a value in an array
          *
@@ -133,11 +148,35 @@ class CPUKernel : public DeviceKernel
         CPUDevice *p_device;
         Kernel *p_kernel;
         llvm::Function *p_function, *p_call_function;
+        Entry volatile p_call_function_addr;
         pthread_mutex_t p_call_function_mutex;
+        bool p_work_item_loops;
+        size_t p_private_size;
 };
 
 class CPUKernelEvent;
 
+/**
+ * \brief Work-group information read by the work-group functions
+ *
+ * \c llvm::CPUWorkGroupAggregation replaces the built-ins returning values
+ * constant in a work-group by loads from this structure, whose address the
+ * kernel gets once when it is called. All the fields are \c size_t, so that
+ * the kernel addresses them as an array. Dimensions above the work dimension
+ * of the kernel run hold the values the built-ins return for them.
+ */
+struct CPUWorkGroupContext
+{
+    size_t work_dim;
+    size_t global_size[MAX_WORK_DIMS];
+    size_t local_size[MAX_WORK_DIMS];
+    size_t num_groups[MAX_WORK_DIMS];
+    size_t group_id[MAX_WORK_DIMS];
+    size_t global_offset[MAX_WORK_DIMS];
+    size_t global_first[MAX_WORK_DIMS];  /*!< \brief Global id of the first work-item of the group */
+    size_t private_data;                 /*!< \brief Address of the private slots of the work-items, see \c CPU_WG_PRIVATE_ATTR */
+};
+
 /**
  * \brief CPU kernel work-group
  *
@@ -152,45 +191,60 @@ class CPUKernelWorkGroup
     public:
         /**
          * \brief Constructor
+         *
+         * Each worker thread owns a single work-group object, reused for all
+         * the work-groups it runs. It is bound to a kernel run by \c begin().
+         */
+        CPUKernelWorkGroup();
+        ~CPUKernelWorkGroup();
+
+        /**
+         * \brief Prepare to run work-groups of \p event
+         *
+         * Resolves the stub function and gets the arguments, once for all
+         * the work-groups run until \c end().
+         *
          * \param kernel kernel to run
          * \param event event containing information about the kernel run
          * \param cpu_event CPU-specific information and cache about \p event
-         * \param work_group_index index of this work-group in the kernel
+         * \return true if success, false in case of an error
          */
-        CPUKernelWorkGroup(CPUKernel *kernel, KernelEvent *event,
-                           CPUKernelEvent *cpu_event,
-                           const size_t *work_group_index);
-        ~CPUKernelWorkGroup();
+        bool begin(CPUKernel *kernel, KernelEvent *event,
+                   CPUKernelEvent *cpu_event);
 
         /**
-         * \brief Build a structure of arguments
+         * \brief Release the resources acquired by \c begin()
+         */
+        void end();
+
+        /**
+         * \brief Arguments of the work-groups run by this worker
          *
-         * As C doesn't support calling functions with variable arguments
-         * unknown at the compilation, this function builds the list of
-         * arguments in memory. This array will then be passed to a LLVM stub
-         * function reading it and passing its values to the actuel kernel.
+         * The arguments packed by \c Coal::CPUKernelEvent::marshalArgs() are
+         * used as they are, unless the kernel takes \c __local arguments.
+         * The block is then copied at the start of the arena of the worker,
+         * followed by the \c __local buffers the copy points to. The private
+         * slots of the work-items of a work-group function come last. The
+         * arena only grows, it is kept from one kernel run to the next.
          *
          * \see \ref llvm
-         * \param locals_to_free if this kernel takes \c __local arguments, they
-         *                       must be \c malloc()'ed for every work-group.
-         *                       They are placed in this vector to be
-         *                       \c free()'ed at the end of \c run().
-         * \return address of a memory location containing the arguments
+         * \return address of the arguments, 0 if the arena cannot grow
          */
-        void *callArgs(std::vector<void *> &locals_to_free);
+        void *workerArgs();
 
         /**
-         * \brief Run the work-group
+         * \brief Run a work-group
          *
          * This function is the core of CPU-acceleration. It runs the work-items
          * of this work-group given the correct arguments.
          *
          * \see \ref llvm
          * \see \ref barrier
-         * \see callArgs()
+         * \see workerArgs()
+         * \param work_group_index index of the work-group in the kernel
          * \return true if success, false in case of an error
          */
-        bool run();
+        bool run(const size_t *work_group_index);
 
         /**
          * \name Native implementation of built-in OpenCL C functions
@@ -204,6 +258,7 @@ class CPUKernelWorkGroup
         size_t getNumGroups(cl_uint dimindx) const;
         size_t getGroupID(cl_uint dimindx) const;
         size_t getGlobalOffset(cl_uint dimindx) const;
+        const CPUWorkGroupContext *getWorkGroupContext() const; /*!< \brief Information about the running work-group, see \c Coal::CPUWorkGroupContext */
 
         void barrier(unsigned int flags);
 
@@ -261,10 +316,15 @@ class CPUKernelWorkGroup
                p_max_local_id[MAX_WORK_DIMS],
                p_global_id_start_offset[MAX_WORK_DIMS];
 
-        void (*p_kernel_func_addr)(void *);
+        CPUWorkGroupContext p_wg_context;
+
+        CPUKernel::Entry p_kernel_func_addr;
         void *p_args;
+        void *p_arena;          /*!< \brief Copy of the arguments, \c __local buffers and private slots of this worker */
+        size_t p_arena_size;
 
-        // Machinery to have barrier() working
+        // Machinery to have barrier() working, used by the kernels whose
+        // barriers could not be turned into loops by CPUWorkGroupAggregation
         struct Context
         {
             size_t local_id[MAX_WORK_DIMS];
@@ -288,6 +348,11 @@ class CPUKernelWorkGroup
  * This class put in a \c Coal::KernelEvent device-data field
  * (see \c Coal::Event::setDeviceData()) is responsible for dispatching the
  * \c Coal::CPUKernelWorkGroup objects between the CPU worker threads.
+ *
+ * The work-groups are identified by a linear index. One task per
+ * participating worker is queued (see \c Coal::CPUWorkQueue), and the
+ * workers running these tasks claim ranges of indices from a shared atomic
+ * counter. No lock is taken and nothing is allocated per work-group.
  */
 class CPUKernelEvent
 {
@@ -301,23 +366,104 @@ class CPUKernelEvent
         CPUKernelEvent(CPUDevice *device, KernelEvent *event);
         ~CPUKernelEvent();
 
-        bool reserve();  /*!< \brief The next Work Group that will execute will be the last. Locks the event */
-        bool finished(); /*!< \brief All the work groups have finished */
-        CPUKernelWorkGroup *takeInstance(); /*!< \brief Must be called exactly one time after reserve(). Unlocks the event */
+        static void *operator new(size_t size);                /*!< \brief Allocate from \c pool_alloc(), like \c Coal::Event */
+        static void operator delete(void *ptr, size_t size);   /*!< \brief Give back to the free lists */
+
+        size_t numWorkGroups() const;       /*!< \brief Number of work-groups of the kernel run */
+
+        /**
+         * \brief Decide how many workers take part in the run
+         *
+         * Called once, when the event is pushed on the device. Each of the
+         * returned number of tasks lets one worker claim work-groups until
+         * none is left.
+         *
+         * \param num_workers number of workers of the device
+         * \return number of tasks to queue
+         */
+        unsigned int prepareTasks(unsigned int num_workers);
+
+        /**
+         * \brief Mark the event as started
+         * \return true only for the first worker calling it, which is then
+         *         responsible for setting the event status to \c CL_RUNNING
+         */
+        bool start();
+
+        /**
+         * \brief Claim a contiguous range of work-groups
+         *
+         * The range is taken with a single atomic fetch-and-add. Its size is
+         * guided: a fraction of the work-groups left, shrinking down to one
+         * work-group as the kernel drains, so that the workers finish at
+         * about the same time.
+         *
+         * \param begin first linear work-group index claimed
+         * \param end one past the last index claimed
+         * \return false if no work-group is left
+         */
+        bool claimWorkGroups(size_t &begin, size_t &end);
+
+        /**
+         * \brief Convert a linear work-group index to a work-group index
+         *
+         * Linear indices enumerate the work-groups with the first dimension
+         * varying fastest, the same order as \c incVec().
+         */
+        void workGroupIndex(size_t wg, size_t *index) const;
+
+        /**
+         * \brief A task has just finished claiming work-groups
+         * \param success false if one of its work-groups failed to run
+         * \return true if it was the last task, the caller then completes
+         *         the event
+         */
+        bool taskFinished(bool success);
+        bool failed() const;                /*!< \brief A work-group failed to run */
+        void reset();                       /*!< \brief Forget a completed run, for the event to be queued again */
 
-        void *kernelArgs() const;           /*!< \brief Return the cached kernel arguments */
-        void cacheKernelArgs(void *args);   /*!< \brief Cache pre-built kernel arguments */
+        /**
+         * \brief Build the arguments of the kernel
+         *
+         * As C doesn't support calling functions with variable arguments
+         * unknown at the compilation, the arguments are placed in memory, at
+         * the offsets given by \c CPUKernel::typeOffset(). This block is
+         * passed to a LLVM stub function reading it and passing its values to
+         * the actual kernel.
+         *
+         * Called once, when the event is queued, so that the kernel runs with
+         * the arguments set at that time. The buffers and images are
+         * allocated and their addresses stored. The block is then shared by
+         * all the work-groups.
+         *
+         * \param kernel kernel run by the event
+         * \return \c CL_SUCCESS if success, otherwise an error code
+         */
+        cl_int marshalArgs(CPUKernel *kernel);
 
-        void workGroupFinished();           /*!< \brief A work-group has just finished */
+        /**
+         * \brief \c __local argument of a kernel
+         */
+        struct LocalArg
+        {
+            size_t offset;      /*!< \brief Offset of the pointer to the buffer in \c args() */
+            size_t size;        /*!< \brief Size of the buffer */
+        };
+
+        void *args() const;         /*!< \brief Arguments built by \c marshalArgs() */
+        size_t argsSize() const;    /*!< \brief Size of \c args() */
+        const std::vector<LocalArg> &localArgs() const; /*!< \brief \c __local arguments, to be given a buffer by each worker */
 
     private:
         CPUDevice *p_device;
         KernelEvent *p_event;
-        size_t p_current_work_group[MAX_WORK_DIMS],
-               p_max_work_groups[MAX_WORK_DIMS];
-        size_t p_current_wg, p_finished_wg, p_num_wg;
-        pthread_mutex_t p_mutex;
-        void *p_kernel_args;
+        size_t p_max_work_groups[MAX_WORK_DIMS];
+        size_t p_num_wg, p_num_workers;
+        volatile size_t p_next_wg;
+        volatile unsigned int p_tasks, p_started, p_failed;
+        void *p_args;
+        size_t p_args_size;
+        std::vector<LocalArg> p_local_args;
 };
 
 }
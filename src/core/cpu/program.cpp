@@ -34,14 +34,19 @@
 #include "device.h"
 #include "kernel.h"
 #include "builtins.h"
+#include "cache.h"
+#include "wga.h"
 
 #include "../program.h"
 
 #include <llvm/PassManager.h>
 #include <llvm/Analysis/Passes.h>
+#include <llvm/IR/LLVMContext.h>
 #include <llvm/IR/Verifier.h>
 #include <llvm/Transforms/Scalar.h>
 #include <llvm/Transforms/IPO.h>
+#include <llvm/Transforms/Vectorize.h>
+#include <llvm/Transforms/Utils/UnifyFunctionExitNodes.h>
 #include <llvm/ExecutionEngine/ExecutionEngine.h>
 #include <llvm/ExecutionEngine/MCJIT.h>
 #include <llvm/ExecutionEngine/SectionMemoryManager.h>
@@ -132,16 +137,62 @@ void CPUProgram::createOptimizationPasses(llvm::PassManager *manager,
         manager->add(llvm::createJumpThreadingPass());
         manager->add(llvm::createCFGSimplificationPass());
     }
+
+    /*
+     * Turn the kernels into work-group functions looping over their
+     * work-items, then let LLVM optimize these loops.
+     */
+    manager->add(llvm::createUnifyFunctionExitNodesPass());
+    manager->add(llvm::createCPUWorkGroupAggregationPass());
+
+    if (optimize)
+    {
+        manager->add(llvm::createLICMPass());
+        manager->add(llvm::createLoopVectorizePass());
+        manager->add(llvm::createSLPVectorizerPass());
+        manager->add(llvm::createInstructionCombiningPass());
+        manager->add(llvm::createCFGSimplificationPass());
+    }
 }
 
 bool CPUProgram::build(llvm::Module *module, std::string *binary_str)
 {
+    // A rebuild drops the JIT of the previous module, and that module
+    if (p_jit && p_module != module)
+    {
+        delete p_jit;
+        p_jit = 0;
+    }
+
     // Nothing to build
     p_module = module;
 
     return true;
 }
 
+llvm::Module *CPUProgram::cachedBuild(const std::string &source,
+                                      const std::string &options,
+                                      llvm::LLVMContext &context,
+                                      std::string &log)
+{
+    CPUProgramCache *cache = CPUProgramCache::instance();
+
+    if (!cache)
+        return 0;
+
+    return cache->loadModule(cache->programKey(source, options), context, log);
+}
+
+void CPUProgram::cacheBuild(const std::string &source,
+                            const std::string &options, llvm::Module *module,
+                            const std::string &log)
+{
+    CPUProgramCache *cache = CPUProgramCache::instance();
+
+    if (cache && module)
+        cache->storeModule(cache->programKey(source, options), module, log);
+}
+
 bool CPUProgram::initJIT()
 {
     if (p_jit)
@@ -164,6 +215,12 @@ bool CPUProgram::initJIT()
         return false;
     }
 
+    // Reuse the native code of the modules already compiled
+    CPUProgramCache *cache = CPUProgramCache::instance();
+
+    if (cache)
+        p_jit->setObjectCache(cache);
+
     return true;
 }
 
@@ -71,6 +71,12 @@ class CPUProgram : public DeviceProgram
         void createOptimizationPasses(llvm::PassManager *manager,
                                       bool optimize, bool hasBarrier=false);
         bool build(llvm::Module *module, std::string *binary_str);
+        llvm::Module *cachedBuild(const std::string &source,
+                                  const std::string &options,
+                                  llvm::LLVMContext &context,
+                                  std::string &log);
+        void cacheBuild(const std::string &source, const std::string &options,
+                        llvm::Module *module, const std::string &log);
 
         /**
          * \brief Initialize an LLVM JIT
@@ -83,6 +89,8 @@ class CPUProgram : public DeviceProgram
          *   the host by declaring \c libc functions and calling them.
          * - All the unknown function names are passed to \c getBuiltin() to
          *   get native built-in implementations.
+         * - The native code is taken from \c Coal::CPUProgramCache, when
+         *   the same module was compiled before.
          *
          * \return true if success, false otherwise
          */
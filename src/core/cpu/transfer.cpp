@@ -0,0 +1,584 @@
+/******************************************************************************
+ * Copyright (c) 2014, Texas Instruments Incorporated - http://www.ti.com/
+ *   All rights reserved.
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *       * Neither the name of Texas Instruments Incorporated nor the
+ *         names of its contributors may be used to endorse or promote products
+ *         derived from this software without specific prior written permission.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *   AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *   IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *   ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ *   LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *   CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *   SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *   INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *   CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *   ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ *   THE POSSIBILITY OF SUCH DAMAGE.
+ *****************************************************************************/
+/**
+ * \file cpu/transfer.cpp
+ * \brief Buffer copies and fills of the CPU device
+ */
+#include "transfer.h"
+#include "device.h"
+#include "buffer.h"
+
+#include "../events.h"
+#include "../memobject.h"
+#include "../util.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <pthread.h>
+#include <stdint.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+using namespace Coal;
+
+/**
+ * \brief Size of the widened fill pattern, a multiple of all pattern sizes
+ */
+#define CPU_FILL_BLOCK 128
+
+/******************************************************************************
+* Size from which the transfers use non-temporal stores, by default about the
+* size of the last-level cache. TI_OCL_CPU_NT_THRESHOLD sets it in bytes.
+******************************************************************************/
+static size_t         nt_threshold      = 8 * 1024 * 1024;
+static pthread_once_t nt_threshold_once = PTHREAD_ONCE_INIT;
+
+static void read_nt_threshold()
+{
+    const char *value = getenv("TI_OCL_CPU_NT_THRESHOLD");
+
+    if (value)
+        nt_threshold = strtoul(value, NULL, 10);
+}
+
+/*
+ * CPUTransferEvent
+ */
+CPUTransferEvent::CPUTransferEvent(size_t count, size_t unit_size)
+: p_count(count), p_next_chunk(0), p_tasks(0), p_started(0)
+{
+    // Whole units of about CPU_TRANSFER_CHUNK bytes
+    if (unit_size == 0)
+        unit_size = 1;
+
+    p_chunk = (unit_size < CPU_TRANSFER_CHUNK ? CPU_TRANSFER_CHUNK / unit_size : 1);
+    p_num_chunks = (count + p_chunk - 1) / p_chunk;
+    p_bytes = count * unit_size;
+
+    pthread_once(&nt_threshold_once, read_nt_threshold);
+}
+
+void *CPUTransferEvent::operator new(size_t size)
+{
+    void *ptr = pool_alloc(size);
+
+    if (!ptr)
+        throw std::bad_alloc();
+
+    return ptr;
+}
+
+void CPUTransferEvent::operator delete(void *ptr, size_t size)
+{
+    pool_free(ptr, size);
+}
+
+CPUTransferEvent *CPUTransferEvent::create(Event *event)
+{
+    switch (event->type())
+    {
+        case Event::ReadBuffer:
+        case Event::WriteBuffer:
+            return new CPUTransferEvent(((ReadWriteBufferEvent *)event)->cb());
+
+        case Event::CopyBuffer:
+            return new CPUTransferEvent(((CopyBufferEvent *)event)->cb());
+
+        case Event::FillBuffer:
+            return new CPUTransferEvent(((FillBufferEvent *)event)->size());
+
+        case Event::ReadBufferRect:
+        case Event::WriteBufferRect:
+        case Event::CopyBufferRect:
+        case Event::ReadImage:
+        case Event::WriteImage:
+        case Event::CopyImage:
+        case Event::CopyBufferToImage:
+        case Event::CopyImageToBuffer:
+        {
+            CPURectCopy rect((ReadWriteCopyBufferRectEvent *)event);
+
+            return new CPUTransferEvent(rect.units(), rect.unitSize());
+        }
+        default:
+            return 0;
+    }
+}
+
+bool CPUTransferEvent::isTransfer(Event *event)
+{
+    switch (event->type())
+    {
+        case Event::ReadBuffer:
+        case Event::WriteBuffer:
+        case Event::CopyBuffer:
+        case Event::FillBuffer:
+        case Event::ReadBufferRect:
+        case Event::WriteBufferRect:
+        case Event::CopyBufferRect:
+        case Event::ReadImage:
+        case Event::WriteImage:
+        case Event::CopyImage:
+        case Event::CopyBufferToImage:
+        case Event::CopyImageToBuffer:
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+unsigned int CPUTransferEvent::prepareTasks(unsigned int num_workers)
+{
+    if (num_workers == 0)
+        num_workers = 1;
+
+    // An empty transfer still needs a task to complete it
+    p_tasks = (p_num_chunks < num_workers ? p_num_chunks : num_workers);
+
+    if (p_tasks == 0)
+        p_tasks = 1;
+
+    return p_tasks;
+}
+
+bool CPUTransferEvent::start()
+{
+    return __sync_bool_compare_and_swap(&p_started, 0, 1);
+}
+
+bool CPUTransferEvent::claimRange(size_t &begin, size_t &end)
+{
+    if (p_next_chunk >= p_num_chunks)
+        return false;
+
+    size_t chunk = __sync_fetch_and_add(&p_next_chunk, 1);
+
+    if (chunk >= p_num_chunks)
+        return false;
+
+    begin = chunk * p_chunk;
+    end = begin + p_chunk;
+
+    if (end > p_count)
+        end = p_count;
+
+    return true;
+}
+
+bool CPUTransferEvent::taskFinished()
+{
+    return (__sync_sub_and_fetch(&p_tasks, 1) == 0);
+}
+
+bool CPUTransferEvent::nonTemporal() const
+{
+    return (p_bytes >= nt_threshold);
+}
+
+void CPUTransferEvent::reset()
+{
+    p_next_chunk = 0;
+    p_tasks = 0;
+    p_started = 0;
+}
+
+bool CPUTransferEvent::inPlace(Event *event, CPUDevice *device, size_t &bytes)
+{
+    switch (event->type())
+    {
+        case Event::ReadBuffer:
+        case Event::WriteBuffer:
+        {
+            ReadWriteBufferEvent *e = (ReadWriteBufferEvent *)event;
+            CPUBuffer *buf = (CPUBuffer *)e->buffer()->deviceBuffer(device);
+
+            if (!buf->allocated() ||
+                (char *)buf->data() + e->offset() != (char *)e->ptr())
+                return false;
+
+            bytes = e->cb();
+            return true;
+        }
+        case Event::ReadBufferRect:
+        case Event::WriteBufferRect:
+        case Event::ReadImage:
+        case Event::WriteImage:
+        {
+            ReadWriteCopyBufferRectEvent *e = (ReadWriteCopyBufferRectEvent *)event;
+            CPUBuffer *buf = (CPUBuffer *)e->source()->deviceBuffer(device);
+
+            if (!buf->allocated())
+                return false;
+
+            CPURectCopy rect(e);
+
+            rect.bind(device);
+
+            if (!rect.inPlace())
+                return false;
+
+            bytes = rect.units() * rect.unitSize();
+            return true;
+        }
+        default:
+            return false;
+    }
+}
+
+/*
+ * Copies and fills
+ */
+void Coal::transferCopy(void *dst, const void *src, size_t size,
+                        bool non_temporal)
+{
+#ifdef __SSE2__
+    if (non_temporal && size >= 4 * sizeof(__m128i))
+    {
+        unsigned char *d = (unsigned char *)dst;
+        const unsigned char *s = (const unsigned char *)src;
+
+        // Streaming stores need an aligned destination
+        size_t head = (-(uintptr_t)d) & (sizeof(__m128i) - 1);
+
+        std::memcpy(d, s, head);
+        d += head;
+        s += head;
+        size -= head;
+
+        for (; size >= 4 * sizeof(__m128i); size -= 4 * sizeof(__m128i))
+        {
+            __m128i a = _mm_loadu_si128((const __m128i *)s);
+            __m128i b = _mm_loadu_si128((const __m128i *)s + 1);
+            __m128i c = _mm_loadu_si128((const __m128i *)s + 2);
+            __m128i e = _mm_loadu_si128((const __m128i *)s + 3);
+
+            _mm_stream_si128((__m128i *)d, a);
+            _mm_stream_si128((__m128i *)d + 1, b);
+            _mm_stream_si128((__m128i *)d + 2, c);
+            _mm_stream_si128((__m128i *)d + 3, e);
+
+            d += 4 * sizeof(__m128i);
+            s += 4 * sizeof(__m128i);
+        }
+
+        // Order the streaming stores before the completion of the event
+        _mm_sfence();
+
+        std::memcpy(d, s, size);
+        return;
+    }
+#endif
+
+    std::memcpy(dst, src, size);
+}
+
+void Coal::transferFill(void *dst, size_t size, const void *pattern,
+                        size_t pattern_size, size_t phase, bool non_temporal)
+{
+    unsigned char *d = (unsigned char *)dst;
+    const unsigned char *p = (const unsigned char *)pattern;
+
+    if (pattern_size == 0)
+        return;
+
+    // Not a size OpenCL allows, store the pattern byte by byte
+    if (CPU_FILL_BLOCK % pattern_size)
+    {
+        for (size_t i=0; i<size; ++i)
+            d[i] = p[(phase + i) % pattern_size];
+
+        return;
+    }
+
+    // Bytes up to an aligned destination
+    size_t head = (-(uintptr_t)d) & 15;
+
+    if (head > size)
+        head = size;
+
+    for (size_t i=0; i<head; ++i)
+        d[i] = p[(phase + i) % pattern_size];
+
+    d += head;
+    size -= head;
+    phase += head;
+
+    // Widen the pattern, starting where the aligned destination is in it
+    unsigned char block[CPU_FILL_BLOCK] __attribute__((aligned(16)));
+
+    for (size_t i=0; i<CPU_FILL_BLOCK; ++i)
+        block[i] = p[(phase + i) % pattern_size];
+
+#ifdef __SSE2__
+    const __m128i *v = (const __m128i *)block;
+    __m128i v0 = _mm_load_si128(v),     v1 = _mm_load_si128(v + 1),
+            v2 = _mm_load_si128(v + 2), v3 = _mm_load_si128(v + 3),
+            v4 = _mm_load_si128(v + 4), v5 = _mm_load_si128(v + 5),
+            v6 = _mm_load_si128(v + 6), v7 = _mm_load_si128(v + 7);
+
+    if (non_temporal)
+    {
+        for (; size >= CPU_FILL_BLOCK; size -= CPU_FILL_BLOCK)
+        {
+            __m128i *o = (__m128i *)d;
+
+            _mm_stream_si128(o,     v0); _mm_stream_si128(o + 1, v1);
+            _mm_stream_si128(o + 2, v2); _mm_stream_si128(o + 3, v3);
+            _mm_stream_si128(o + 4, v4); _mm_stream_si128(o + 5, v5);
+            _mm_stream_si128(o + 6, v6); _mm_stream_si128(o + 7, v7);
+            d += CPU_FILL_BLOCK;
+        }
+
+        _mm_sfence();
+    }
+    else
+    {
+        for (; size >= CPU_FILL_BLOCK; size -= CPU_FILL_BLOCK)
+        {
+            __m128i *o = (__m128i *)d;
+
+            _mm_store_si128(o,     v0); _mm_store_si128(o + 1, v1);
+            _mm_store_si128(o + 2, v2); _mm_store_si128(o + 3, v3);
+            _mm_store_si128(o + 4, v4); _mm_store_si128(o + 5, v5);
+            _mm_store_si128(o + 6, v6); _mm_store_si128(o + 7, v7);
+            d += CPU_FILL_BLOCK;
+        }
+    }
+#else
+    // The compiler turns these fixed-size copies into vector stores
+    (void)non_temporal;
+
+    for (; size >= CPU_FILL_BLOCK; size -= CPU_FILL_BLOCK)
+    {
+        std::memcpy(d, block, CPU_FILL_BLOCK);
+        d += CPU_FILL_BLOCK;
+    }
+#endif
+
+    // The tail starts a new block, so at the same place in the pattern
+    std::memcpy(d, block, size);
+}
+
+/*
+ * CPURectCopy
+ */
+CPURectCopy::CPURectCopy(ReadWriteCopyBufferRectEvent *event)
+: p_event(event), p_src(0), p_dst(0)
+{
+    p_row_size = event->region(0);
+    p_rows = event->region(1);
+    p_slices = event->region(2);
+
+    // The source of the event is always the buffer or image, the data are
+    // written in it by the write events
+    if (event->type() == Event::WriteBufferRect ||
+        event->type() == Event::WriteImage)
+    {
+        p_src_row_pitch = event->dst_row_pitch();
+        p_src_slice_pitch = event->dst_slice_pitch();
+        p_dst_row_pitch = event->src_row_pitch();
+        p_dst_slice_pitch = event->src_slice_pitch();
+    }
+    else
+    {
+        p_src_row_pitch = event->src_row_pitch();
+        p_src_slice_pitch = event->src_slice_pitch();
+        p_dst_row_pitch = event->dst_row_pitch();
+        p_dst_slice_pitch = event->dst_slice_pitch();
+    }
+
+    size_t slice_size = p_row_size * p_rows;
+    bool rows_contiguous = (p_rows == 1 ||
+                            (p_src_row_pitch == p_row_size &&
+                             p_dst_row_pitch == p_row_size));
+    bool slices_contiguous = (p_slices == 1 ||
+                              (p_src_slice_pitch == slice_size &&
+                               p_dst_slice_pitch == slice_size));
+
+    if (rows_contiguous && slices_contiguous)
+        p_layout = Linear;
+    else if (rows_contiguous)
+        p_layout = Slices;
+    else
+        p_layout = Rows;
+}
+
+void CPURectCopy::bind(CPUDevice *device)
+{
+    ReadWriteCopyBufferRectEvent *e = p_event;
+    Event::Type t = e->type();
+    CPUBuffer *src_buf = (CPUBuffer *)e->source()->deviceBuffer(device);
+    unsigned char *src = (unsigned char *)src_buf->data();
+    unsigned char *dst;
+
+    switch (t)
+    {
+        case Event::CopyBufferRect:
+        case Event::CopyImage:
+        case Event::CopyImageToBuffer:
+        case Event::CopyBufferToImage:
+        {
+            CopyBufferRectEvent *cbre = (CopyBufferRectEvent *)e;
+            CPUBuffer *dst_buf =
+                (CPUBuffer *)cbre->destination()->deviceBuffer(device);
+
+            dst = (unsigned char *)dst_buf->data();
+            break;
+        }
+        default:
+        {
+            // dst = host memory location
+            ReadWriteBufferRectEvent *rwbre = (ReadWriteBufferRectEvent *)e;
+
+            dst = (unsigned char *)rwbre->ptr();
+        }
+    }
+
+    // First byte of the region on both sides
+    src += e->src_origin(0) + e->src_origin(1) * e->src_row_pitch() +
+           e->src_origin(2) * e->src_slice_pitch();
+    dst += e->dst_origin(0) + e->dst_origin(1) * e->dst_row_pitch() +
+           e->dst_origin(2) * e->dst_slice_pitch();
+
+    // Copying and image to a buffer may need to add an offset to the buffer
+    // address (its rectangular origin is always (0, 0, 0)).
+    if (t == Event::CopyBufferToImage)
+        src += ((CopyBufferToImageEvent *)e)->offset();
+    else if (t == Event::CopyImageToBuffer)
+        dst += ((CopyImageToBufferEvent *)e)->offset();
+
+    if (t == Event::WriteBufferRect || t == Event::WriteImage)
+    {
+        p_src = dst;
+        p_dst = src;
+    }
+    else
+    {
+        p_src = src;
+        p_dst = dst;
+    }
+}
+
+size_t CPURectCopy::units() const
+{
+    switch (p_layout)
+    {
+        case Linear: return p_row_size * p_rows * p_slices;
+        case Slices: return p_slices;
+        default:     return p_rows * p_slices;
+    }
+}
+
+size_t CPURectCopy::unitSize() const
+{
+    switch (p_layout)
+    {
+        case Linear: return 1;
+        case Slices: return p_row_size * p_rows;
+        default:     return p_row_size;
+    }
+}
+
+bool CPURectCopy::inPlace() const
+{
+    return (p_src == p_dst &&
+            p_src_row_pitch == p_dst_row_pitch &&
+            p_src_slice_pitch == p_dst_slice_pitch);
+}
+
+/**
+ * \brief Copy \p rows rows of \p N bytes, the copies inlined as moves
+ */
+template<size_t N>
+static void copyRows(unsigned char *dst, size_t dst_pitch,
+                     const unsigned char *src, size_t src_pitch, size_t rows)
+{
+    for (size_t i=0; i<rows; ++i, dst += dst_pitch, src += src_pitch)
+        std::memcpy(dst, src, N);
+}
+
+static void copyRows(unsigned char *dst, size_t dst_pitch,
+                     const unsigned char *src, size_t src_pitch,
+                     size_t row_size, size_t rows, bool non_temporal)
+{
+    switch (row_size)
+    {
+        case 4:  copyRows<4>(dst, dst_pitch, src, src_pitch, rows); return;
+        case 8:  copyRows<8>(dst, dst_pitch, src, src_pitch, rows); return;
+        case 16: copyRows<16>(dst, dst_pitch, src, src_pitch, rows); return;
+        case 32: copyRows<32>(dst, dst_pitch, src, src_pitch, rows); return;
+        case 48: copyRows<48>(dst, dst_pitch, src, src_pitch, rows); return;
+        case 64: copyRows<64>(dst, dst_pitch, src, src_pitch, rows); return;
+        default: break;
+    }
+
+    for (size_t i=0; i<rows; ++i, dst += dst_pitch, src += src_pitch)
+        transferCopy(dst, src, row_size, non_temporal);
+}
+
+void CPURectCopy::copy(size_t begin, size_t end, bool non_temporal) const
+{
+    switch (p_layout)
+    {
+        case Linear:
+            transferCopy(p_dst + begin, p_src + begin, end - begin,
+                         non_temporal);
+            break;
+
+        case Slices:
+            for (size_t z=begin; z<end; ++z)
+                transferCopy(p_dst + z * p_dst_slice_pitch,
+                             p_src + z * p_src_slice_pitch,
+                             p_row_size * p_rows, non_temporal);
+            break;
+
+        case Rows:
+            // The rows of each slice in one go
+            while (begin < end)
+            {
+                size_t z = begin / p_rows;
+                size_t y = begin % p_rows;
+                size_t n = p_rows - y;
+
+                if (n > end - begin)
+                    n = end - begin;
+
+                copyRows(p_dst + z * p_dst_slice_pitch + y * p_dst_row_pitch,
+                         p_dst_row_pitch,
+                         p_src + z * p_src_slice_pitch + y * p_src_row_pitch,
+                         p_src_row_pitch, p_row_size, n, non_temporal);
+
+                begin += n;
+            }
+            break;
+    }
+}
@@ -0,0 +1,224 @@
+/******************************************************************************
+ * Copyright (c) 2014, Texas Instruments Incorporated - http://www.ti.com/
+ *   All rights reserved.
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *       * Neither the name of Texas Instruments Incorporated nor the
+ *         names of its contributors may be used to endorse or promote products
+ *         derived from this software without specific prior written permission.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *   AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *   IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *   ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ *   LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *   CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *   SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *   INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *   CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *   ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ *   THE POSSIBILITY OF SUCH DAMAGE.
+ *****************************************************************************/
+/**
+ * \file cpu/transfer.h
+ * \brief Buffer copies and fills of the CPU device
+ */
+#ifndef __CPU_TRANSFER_H__
+#define __CPU_TRANSFER_H__
+
+#include <cstddef>
+
+/**
+ * \brief Bytes of a transfer claimed at once by a worker
+ */
+#define CPU_TRANSFER_CHUNK (512 * 1024)
+
+namespace Coal
+{
+
+class CPUDevice;
+class Event;
+class ReadWriteCopyBufferRectEvent;
+
+/**
+ * \brief CPU-specific information about a buffer transfer event
+ *
+ * Put in the device-data field of the \c Coal::ReadWriteBufferEvent,
+ * \c Coal::CopyBufferEvent, \c Coal::FillBufferEvent and
+ * \c Coal::ReadWriteCopyBufferRectEvent objects. Like \c Coal::CPUKernelEvent
+ * for work-groups, it lets several workers run the transfer: each of the
+ * tasks queued claims chunks of about \c CPU_TRANSFER_CHUNK bytes from a
+ * shared atomic counter until none is left. A transfer is made of units,
+ * bytes for the buffers and rows or slices for the rectangular copies (see
+ * \c Coal::CPURectCopy), never split between two chunks. Only the workers
+ * idle when the event is pushed take part, so that a transfer does not queue
+ * tasks behind running kernels.
+ */
+class CPUTransferEvent
+{
+    public:
+        /**
+         * \brief Constructor
+         * \param count number of units transferred
+         * \param unit_size size of a unit in bytes
+         */
+        CPUTransferEvent(size_t count, size_t unit_size = 1);
+
+        static void *operator new(size_t size);                /*!< \brief Allocate from \c pool_alloc(), like \c Coal::Event */
+        static void operator delete(void *ptr, size_t size);   /*!< \brief Give back to the free lists */
+
+        /**
+         * \brief Create the transfer information of \p event
+         * \return the information, 0 if \p event is not a transfer
+         */
+        static CPUTransferEvent *create(Event *event);
+        static bool isTransfer(Event *event);   /*!< \brief \p event has a \c Coal::CPUTransferEvent as device data */
+
+        /**
+         * \brief Find whether a read or a write has nothing to copy
+         *
+         * This is the case when the host memory given to the event is the
+         * data of the buffer itself, as with \c CL_MEM_USE_HOST_PTR buffers
+         * read or written in place.
+         *
+         * \param event transfer event
+         * \param device device running \p event
+         * \param bytes size of the copy avoided, set if true is returned
+         * \return true if \p event has nothing to do
+         */
+        static bool inPlace(Event *event, CPUDevice *device, size_t &bytes);
+
+        /**
+         * \brief Decide how many workers take part in the transfer
+         * \param num_workers number of workers available for it
+         * \return number of tasks to queue
+         */
+        unsigned int prepareTasks(unsigned int num_workers);
+
+        /**
+         * \brief Mark the event as started
+         * \return true only for the first worker calling it
+         */
+        bool start();
+
+        /**
+         * \brief Claim the next chunk of the transfer
+         * \param begin index of the first unit claimed
+         * \param end index one past the last unit claimed
+         * \return false if nothing is left
+         */
+        bool claimRange(size_t &begin, size_t &end);
+
+        /**
+         * \brief A task has just finished claiming chunks
+         * \return true if it was the last task, the caller then completes
+         *         the event
+         */
+        bool taskFinished();
+
+        bool nonTemporal() const;   /*!< \brief The transfer is large enough to bypass the caches, see \c transferCopy() */
+        void reset();               /*!< \brief Forget a completed run, for the event to be queued again */
+
+    private:
+        size_t p_count, p_chunk, p_num_chunks, p_bytes;
+        volatile size_t p_next_chunk;
+        volatile unsigned int p_tasks, p_started;
+};
+
+/**
+ * \brief Rectangular copy of the CPU device
+ *
+ * Copies a region of rows between two strided memory areas, for the
+ * \c Coal::ReadWriteCopyBufferRectEvent events, images included. The region
+ * is split into units a worker copies at once:
+ *
+ * - when the rows and the slices of the region are contiguous on both
+ *   sides, the region is one linear area, copied as a buffer;
+ * - when only the rows are contiguous, a unit is a slice, copied with one
+ *   \c memcpy();
+ * - otherwise, a unit is a row. Rows of the usual pixel and tile sizes,
+ *   4 to 64 bytes, are copied by loops specialized for their size, without
+ *   a \c memcpy() call per row.
+ */
+class CPURectCopy
+{
+    public:
+        /**
+         * \brief Find the layout of the region of \p event
+         *
+         * The pointers to the data are not set, \c units() and
+         * \c unitSize() can be called when the event is queued.
+         */
+        CPURectCopy(ReadWriteCopyBufferRectEvent *event);
+
+        /**
+         * \brief Get the addresses of the data copied by the event
+         * \param device device on which the event runs
+         */
+        void bind(CPUDevice *device);
+
+        size_t units() const;       /*!< \brief Number of units of the region */
+        size_t unitSize() const;    /*!< \brief Size of a unit in bytes */
+        bool inPlace() const;       /*!< \brief Source and destination are the same memory, after \c bind() */
+
+        /**
+         * \brief Copy units of the region
+         * \param begin first unit to copy
+         * \param end one past the last unit to copy
+         * \param non_temporal use streaming stores, see \c transferCopy()
+         */
+        void copy(size_t begin, size_t end, bool non_temporal) const;
+
+    private:
+        enum Layout
+        {
+            Linear,     /*!< \brief Units are bytes of one contiguous area */
+            Slices,     /*!< \brief Units are slices of contiguous rows */
+            Rows        /*!< \brief Units are rows */
+        };
+
+        ReadWriteCopyBufferRectEvent *p_event;
+        Layout p_layout;
+        const unsigned char *p_src;
+        unsigned char *p_dst;
+        size_t p_row_size, p_rows, p_slices;
+        size_t p_src_row_pitch, p_src_slice_pitch,
+               p_dst_row_pitch, p_dst_slice_pitch;
+};
+
+/**
+ * \brief Copy \p size bytes from \p src to \p dst
+ *
+ * With \p non_temporal, the destination is written with streaming stores
+ * when the host supports them, so that a large copy does not evict the data
+ * the kernels work on from the caches. Otherwise, this is a \c memcpy().
+ */
+void transferCopy(void *dst, const void *src, size_t size, bool non_temporal);
+
+/**
+ * \brief Fill \p size bytes at \p dst with a repeated pattern
+ *
+ * The pattern is widened once to a block of 128 bytes, a multiple of all the
+ * pattern sizes OpenCL allows, which is then stored with vector stores.
+ *
+ * \param dst first byte to write
+ * \param size number of bytes to write
+ * \param pattern pattern to repeat
+ * \param pattern_size size of \p pattern in bytes
+ * \param phase offset of \p dst from the start of the fill, so that a chunk
+ *              of a fill goes on with the pattern where the previous one
+ *              stopped
+ * \param non_temporal use streaming stores, see \c transferCopy()
+ */
+void transferFill(void *dst, size_t size, const void *pattern,
+                  size_t pattern_size, size_t phase, bool non_temporal);
+
+}
+
+#endif
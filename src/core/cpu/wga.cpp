@@ -0,0 +1,836 @@
+/******************************************************************************
+ * Copyright (c) 2014, Texas Instruments Incorporated - http://www.ti.com/
+ *   All rights reserved.
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *       * Neither the name of Texas Instruments Incorporated nor the
+ *         names of its contributors may be used to endorse or promote products
+ *         derived from this software without specific prior written permission.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *   AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *   IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *   ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ *   LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *   CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *   SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *   INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *   CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *   ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ *   THE POSSIBILITY OF SUCH DAMAGE.
+ *****************************************************************************/
+/**
+ * \file cpu/wga.cpp
+ * \brief Work-group aggregation for the CPU device
+ */
+#include "wga.h"
+#include "kernel.h"
+
+#include <llvm/IR/Function.h>
+#include <llvm/IR/Module.h>
+#include <llvm/IR/BasicBlock.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/InstIterator.h>
+#include <llvm/IR/DataLayout.h>
+#include <llvm/IR/Dominators.h>
+#include <llvm/IR/Metadata.h>
+#include <llvm/Analysis/LoopInfo.h>
+#include <llvm/Transforms/Utils/BasicBlockUtils.h>
+#include <llvm/Transforms/Utils/Local.h>
+#include <llvm/Transforms/Utils/UnifyFunctionExitNodes.h>
+#include <llvm/ADT/StringExtras.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <set>
+#include <string>
+
+namespace llvm
+{
+
+/******************************************************************************
+* Built-ins whose value does not change during a work-group, read from the
+* Coal::CPUWorkGroupContext of the group, and their value for dimensions
+* above the last one.
+******************************************************************************/
+static const struct
+{
+    const char *name;
+    size_t      field;
+    uint64_t    outOfRange;
+} context_builtins[] =
+{
+    { "get_global_size",   offsetof(Coal::CPUWorkGroupContext, global_size),   1 },
+    { "get_local_size",    offsetof(Coal::CPUWorkGroupContext, local_size),    1 },
+    { "get_num_groups",    offsetof(Coal::CPUWorkGroupContext, num_groups),    1 },
+    { "get_group_id",      offsetof(Coal::CPUWorkGroupContext, group_id),      0 },
+    { "get_global_offset", offsetof(Coal::CPUWorkGroupContext, global_offset), 0 },
+    { 0, 0, 0 }
+};
+
+/******************************************************************************
+* Order barriers, all on the dominator chain of the exit, by dominance
+******************************************************************************/
+namespace
+{
+struct DominanceOrder
+{
+    DominanceOrder(DominatorTree &DT) : DT(DT) {}
+
+    bool operator()(CallInst *a, CallInst *b) const
+    {
+        return a != b && DT.dominates(a, b);
+    }
+
+    DominatorTree &DT;
+};
+
+/******************************************************************************
+* Alignment of the slots of a private variable, at most the one of the worker
+* arena. Each slot is padded to a multiple of it.
+******************************************************************************/
+unsigned int slotAlignment(const DataLayout &DL, AllocaInst *alloca)
+{
+    unsigned int align = std::max(alloca->getAlignment(),
+                           DL.getPrefTypeAlignment(alloca->getAllocatedType()));
+
+    return std::min(align, (unsigned int)CPU_WG_PRIVATE_ALIGN);
+}
+
+uint64_t slotSize(const DataLayout &DL, AllocaInst *alloca)
+{
+    uint64_t elems = cast<ConstantInt>(alloca->getArraySize())->getZExtValue();
+    uint64_t size  = DL.getTypeAllocSize(alloca->getAllocatedType()) * elems;
+    uint64_t align = slotAlignment(DL, alloca);
+
+    return (size + align - 1) / align * align;
+}
+
+/******************************************************************************
+* Order private variables by decreasing slot alignment
+******************************************************************************/
+struct AlignmentOrder
+{
+    AlignmentOrder(const DataLayout &DL) : DL(DL) {}
+
+    bool operator()(AllocaInst *a, AllocaInst *b) const
+    {
+        return slotAlignment(DL, a) > slotAlignment(DL, b);
+    }
+
+    const DataLayout &DL;
+};
+}
+
+/******************************************************************************
+* createCPUWorkGroupAggregationPass
+******************************************************************************/
+Pass *createCPUWorkGroupAggregationPass()
+{
+    return new CPUWorkGroupAggregation();
+}
+
+/******************************************************************************
+* Constructor
+******************************************************************************/
+CPUWorkGroupAggregation::CPUWorkGroupAggregation()
+    : FunctionPass(ID), Context(0), NumWorkItems(0)
+{
+    for (unsigned int i = 0; i < MAX_WORK_DIMS; ++i) LocalSize[i] = 0;
+}
+
+/******************************************************************************
+* getAnalysisUsage(AnalysisUsage &Info) const
+******************************************************************************/
+void CPUWorkGroupAggregation::getAnalysisUsage(AnalysisUsage &Info) const
+{
+    /*-------------------------------------------------------------------------
+    * All returns must go through a single exit node, the work-item loops are
+    * closed there. The dominator tree and the loops tell which barriers can
+    * be turned into region boundaries.
+    *------------------------------------------------------------------------*/
+    Info.addRequired<UnifyFunctionExitNodes>();
+    Info.addRequired<DominatorTreeWrapperPass>();
+    Info.addRequired<LoopInfo>();
+}
+
+/******************************************************************************
+* isKernel: is F listed in the opencl.kernels metadata
+******************************************************************************/
+bool CPUWorkGroupAggregation::isKernel(Function &F)
+{
+    NamedMDNode *kernels = F.getParent()->getNamedMetadata("opencl.kernels");
+
+    if (!kernels) return false;
+
+    for (unsigned int i = 0; i < kernels->getNumOperands(); ++i)
+    {
+        ValueAsMetadata *md =
+            dyn_cast_or_null<ValueAsMetadata>(kernels->getOperand(i)->getOperand(0));
+
+        if (md && md->getValue() == &F) return true;
+    }
+
+    return false;
+}
+
+/******************************************************************************
+* canAggregate: the work-item loops can be put around the whole body of F.
+* The barriers of F are returned in the order they are reached.
+******************************************************************************/
+bool CPUWorkGroupAggregation::canAggregate(Function &F, Type *sizeType,
+                                           std::vector<CallInst *> &barriers)
+{
+    /*-------------------------------------------------------------------------
+    * A kernel called by another one is run per work-item by its caller
+    *------------------------------------------------------------------------*/
+    if (!F.use_empty()) return false;
+
+    BasicBlock *exit = 0;
+
+    for (Function::iterator B = F.begin(), E = F.end(); B != E; ++B)
+        if (isa<ReturnInst>(B->getTerminator()))
+        {
+            if (exit) return false;
+            exit = &*B;
+        }
+
+    if (!exit) return false;
+
+    DominatorTree &DT = getAnalysis<DominatorTreeWrapperPass>().getDomTree();
+    LoopInfo      &LI = getAnalysis<LoopInfo>();
+
+    for (inst_iterator I = inst_begin(&F), E = inst_end(&F); I != E; ++I)
+    {
+        /*---------------------------------------------------------------------
+        * Private variables get slots of a known size in the worker arena,
+        * see privatizeAllocas().
+        *--------------------------------------------------------------------*/
+        AllocaInst *alloca = dyn_cast<AllocaInst>(&*I);
+        if (alloca && !alloca->isStaticAlloca()) return false;
+
+        CallInst *call = dyn_cast<CallInst>(&*I);
+        if (!call) continue;
+
+        Function *callee = call->getCalledFunction();
+
+        /*---------------------------------------------------------------------
+        * Indirect calls and calls to functions not inlined may query the
+        * work-item ids or call barrier() behind our back.
+        *--------------------------------------------------------------------*/
+        if (!callee || !callee->isDeclaration()) return false;
+
+        std::string name(callee->getName());
+
+        /*---------------------------------------------------------------------
+        * A barrier in a loop or under a condition cannot be a boundary
+        * between two regions.
+        *--------------------------------------------------------------------*/
+        if (name == "barrier")
+        {
+            BasicBlock *bb = call->getParent();
+
+            if (LI.getLoopFor(bb) || !DT.dominates(bb, exit)) return false;
+
+            barriers.push_back(call);
+        }
+
+        if ((name == "get_local_id" || name == "get_global_id") &&
+            call->getType() != sizeType)
+            return false;
+    }
+
+    std::sort(barriers.begin(), barriers.end(), DominanceOrder(DT));
+
+    return true;
+}
+
+/******************************************************************************
+* findExitBlock: the block holding the unique return, split so that it holds
+* nothing else.
+******************************************************************************/
+BasicBlock* CPUWorkGroupAggregation::findExitBlock(Function &F)
+{
+    BasicBlock *exit = 0;
+
+    for (Function::iterator B = F.begin(), E = F.end(); B != E; ++B)
+        if (isa<ReturnInst>(B->getTerminator()))
+        {
+            exit = &*B;
+            break;
+        }
+
+    Instruction *ret = exit->getTerminator();
+
+    if (ret != &exit->front())
+        exit = SplitBlock(exit, ret, this);
+
+    return exit;
+}
+
+/******************************************************************************
+* addLoop: wrap everything between pre and post in a loop over the local ids
+* of one dimension. pre ends with an unconditional branch into the region and
+* post holds only a terminator, reached from the region only. As the loops
+* are added inner first, the previous loop is wrapped as a whole.
+*
+*   pre:     ...                         pre:     ...
+*            br body                              br top
+*                                        top:     %id = phi [0, pre],
+*   body:    ...                 =>                         [%inc, latch]
+*                                                 br body
+*   post:    ret void                    body:    ...
+*                                        latch:   %inc = add %id, 1
+*                                                 %c = icmp ult %inc, %size
+*                                                 br %c, top, post
+*                                        post:    ret void
+*
+* On return, post is the new block following the loop.
+******************************************************************************/
+PHINode* CPUWorkGroupAggregation::addLoop(BasicBlock *pre, BasicBlock *&post,
+                                          Value *localSize)
+{
+    Type        *sizeType = localSize->getType();
+    BasicBlock  *top      = SplitBlock(pre, pre->getTerminator(), this);
+    BasicBlock  *latch    = post;
+                 post     = SplitBlock(latch, &latch->front(), this);
+
+    top->setName(".wi.top");
+    latch->setName(".wi.latch");
+
+    /*-------------------------------------------------------------------------
+    * Work-groups have at least one work-item in each dimension, the loop is
+    * tested at its bottom only.
+    *------------------------------------------------------------------------*/
+    PHINode *phi = PHINode::Create(sizeType, 2, "local_id", &top->front());
+    phi->addIncoming(ConstantInt::get(sizeType, 0), pre);
+
+    Instruction *branch = latch->getTerminator();
+    Instruction *inc    = BinaryOperator::Create(Instruction::Add, phi,
+                                  ConstantInt::get(sizeType, 1), "", branch);
+    Instruction *cmp    = new ICmpInst(branch, ICmpInst::ICMP_ULT, inc,
+                                       localSize);
+
+    ReplaceInstWithInst(branch, BranchInst::Create(top, post, cmp));
+
+    phi->addIncoming(inc, latch);
+
+    return phi;
+}
+
+/******************************************************************************
+* useBlock: block in which the value of a use is needed
+******************************************************************************/
+BasicBlock* CPUWorkGroupAggregation::useBlock(Use &use)
+{
+    if (PHINode *phi = dyn_cast<PHINode>(use.getUser()))
+        return phi->getIncomingBlock(use);
+
+    return cast<Instruction>(use.getUser())->getParent();
+}
+
+/******************************************************************************
+* getLinearId: (z * ly + y) * lx + x in a region, computed at the top of its
+* innermost loop.
+******************************************************************************/
+Value* CPUWorkGroupAggregation::getLinearId(unsigned int region)
+{
+    Region &R = Regions[region];
+
+    if (R.LinearId) return R.LinearId;
+
+    Instruction *inspt = R.LocalId[0]->getParent()->getFirstNonPHI();
+    Value       *id    = R.LocalId[MAX_WORK_DIMS - 1];
+
+    for (int dim = MAX_WORK_DIMS - 2; dim >= 0; --dim)
+    {
+        id = BinaryOperator::Create(Instruction::Mul, id, LocalSize[dim],
+                                    "", inspt);
+        id = BinaryOperator::Create(Instruction::Add, id, R.LocalId[dim],
+                                    "", inspt);
+    }
+
+    R.LinearId = id;
+    return id;
+}
+
+/******************************************************************************
+* getNumWorkItems: number of work-items in the group, computed on entry
+******************************************************************************/
+Value* CPUWorkGroupAggregation::getNumWorkItems(Function &F)
+{
+    if (NumWorkItems) return NumWorkItems;
+
+    Instruction *inspt = F.getEntryBlock().getTerminator();
+    Value       *count = LocalSize[0];
+
+    for (unsigned int dim = 1; dim < MAX_WORK_DIMS; ++dim)
+        count = BinaryOperator::Create(Instruction::Mul, count, LocalSize[dim],
+                                       "", inspt);
+
+    NumWorkItems = count;
+    return count;
+}
+
+/******************************************************************************
+* demoteCrossRegionValues: values defined in a region and used in another one
+* go through memory, privatizeAllocas() then gives them a slot per work-item.
+******************************************************************************/
+void CPUWorkGroupAggregation::demoteCrossRegionValues(Function &F)
+{
+    std::vector<Instruction *> demote;
+
+    for (std::map<BasicBlock *, unsigned int>::iterator B = RegionOf.begin(),
+         E = RegionOf.end(); B != E; ++B)
+    {
+        for (BasicBlock::iterator I = B->first->begin(), IE = B->first->end();
+             I != IE; ++I)
+        {
+            for (Value::use_iterator U = I->use_begin(), UE = I->use_end();
+                 U != UE; ++U)
+            {
+                std::map<BasicBlock *, unsigned int>::iterator R =
+                    RegionOf.find(useBlock(*U));
+
+                if (R == RegionOf.end() || R->second != B->second)
+                {
+                    demote.push_back(&*I);
+                    break;
+                }
+            }
+        }
+    }
+
+    for (size_t i = 0; i < demote.size(); ++i)
+        DemoteRegToStack(*demote[i]);
+}
+
+/******************************************************************************
+* usedAcrossRegions: the memory of alloca is accessed in more than one region,
+* directly or through pointers derived from it. An address stored to memory,
+* as the demoted values are, may be loaded back in any region.
+******************************************************************************/
+bool CPUWorkGroupAggregation::usedAcrossRegions(AllocaInst *alloca)
+{
+    std::vector<Value *> worklist(1, alloca);
+    std::set<Value *>    derived;
+    int                  region = -1;
+
+    while (!worklist.empty())
+    {
+        Value *value = worklist.back();
+        worklist.pop_back();
+
+        for (Value::use_iterator U = value->use_begin(),
+             UE = value->use_end(); U != UE; ++U)
+        {
+            Instruction *user       = cast<Instruction>(U->getUser());
+            int          use_region = RegionOf[useBlock(*U)];
+
+            if (region != -1 && region != use_region) return true;
+
+            region = use_region;
+
+            if (StoreInst *store = dyn_cast<StoreInst>(user))
+            {
+                if (store->getValueOperand() == value) return true;
+            }
+            else if (isa<PtrToIntInst>(user))
+                return true;
+            else if (isa<GetElementPtrInst>(user) || isa<CastInst>(user) ||
+                     isa<PHINode>(user) || isa<SelectInst>(user))
+            {
+                if (derived.insert(user).second) worklist.push_back(user);
+            }
+        }
+    }
+
+    return false;
+}
+
+/******************************************************************************
+* privatizeAllocas: private variables used in more than one region are
+* replaced by arrays with one element per work-item. The arrays are taken
+* from the worker arena given by the runtime, the stack of the worker would
+* overflow with large work-groups. They follow each other by decreasing
+* alignment, so that n work-items times the slot size of each keeps the next
+* one aligned. The size of the slots of a work-item is recorded in the
+* CPU_WG_PRIVATE_ATTR attribute of F.
+******************************************************************************/
+void CPUWorkGroupAggregation::privatizeAllocas(Function &F)
+{
+    BasicBlock *entry = &F.getEntryBlock();
+    DataLayout  DL(F.getParent());
+    std::vector<AllocaInst *> allocas;
+
+    for (BasicBlock::iterator I = entry->begin(), E = entry->end(); I != E; ++I)
+    {
+        AllocaInst *alloca = dyn_cast<AllocaInst>(I);
+
+        if (alloca && usedAcrossRegions(alloca)) allocas.push_back(alloca);
+    }
+
+    if (allocas.empty()) return;
+
+    std::stable_sort(allocas.begin(), allocas.end(), AlignmentOrder(DL));
+
+    Instruction *inspt  = entry->getTerminator();
+    Value       *count  = getNumWorkItems(F);
+    Type        *i8ptr  = Type::getInt8PtrTy(F.getContext());
+    Value       *base   = new IntToPtrInst(loadContext(F,
+                           offsetof(Coal::CPUWorkGroupContext, private_data), 0),
+                           i8ptr, "wg_private", inspt);
+    uint64_t     offset = 0;
+
+    for (size_t i = 0; i < allocas.size(); ++i)
+    {
+        AllocaInst *alloca = allocas[i];
+        uint64_t    elems  =
+                    cast<ConstantInt>(alloca->getArraySize())->getZExtValue();
+
+        Value *start = BinaryOperator::Create(Instruction::Mul, count,
+                           ConstantInt::get(count->getType(), offset), "", inspt);
+        start        = GetElementPtrInst::CreateInBounds(base, start, "", inspt);
+
+        Instruction *array = new BitCastInst(start, alloca->getType(), "", inspt);
+        array->takeName(alloca);
+
+        offset += slotSize(DL, alloca);
+
+        std::vector<Use *> uses;
+
+        for (Value::use_iterator U = alloca->use_begin(),
+             UE = alloca->use_end(); U != UE; ++U)
+            uses.push_back(&*U);
+
+        for (size_t u = 0; u < uses.size(); ++u)
+        {
+            BasicBlock  *bb    = useBlock(*uses[u]);
+            Instruction *user  = cast<Instruction>(uses[u]->getUser());
+            Value       *index = getLinearId(RegionOf[bb]);
+
+            if (isa<PHINode>(user)) user = bb->getTerminator();
+
+            if (elems != 1)
+                index = BinaryOperator::Create(Instruction::Mul, index,
+                            ConstantInt::get(index->getType(), elems), "", user);
+
+            uses[u]->set(GetElementPtrInst::CreateInBounds(array, index,
+                                                           "", user));
+        }
+
+        alloca->eraseFromParent();
+    }
+
+    F.addFnAttr(CPU_WG_PRIVATE_ATTR, utostr(offset));
+}
+
+/******************************************************************************
+* loadContext: field of the work-group context for dimension dim, loaded once
+* in the entry block.
+******************************************************************************/
+Value* CPUWorkGroupAggregation::loadContext(Function &F, size_t field,
+                                            unsigned int dim)
+{
+    size_t index = field / sizeof(size_t) + dim;
+    std::map<size_t, Value *>::iterator it = ContextLoads.find(index);
+
+    if (it != ContextLoads.end()) return it->second;
+
+    Instruction *inspt = F.getEntryBlock().getTerminator();
+    Type        *type  = Context->getType()->getPointerElementType();
+    Value       *addr  = GetElementPtrInst::CreateInBounds(Context,
+                                 ConstantInt::get(type, index), "", inspt);
+    Value       *value = new LoadInst(addr, "", inspt);
+
+    ContextLoads[index] = value;
+    return value;
+}
+
+/******************************************************************************
+* selectDim: values[arg] for a call taking a dimension, outOfRange above the
+* last dimension.
+******************************************************************************/
+Value* CPUWorkGroupAggregation::selectDim(CallInst *call, Value **values,
+                                          Value *outOfRange)
+{
+    Value *arg = call->getArgOperand(0);
+
+    if (ConstantInt *constInt = dyn_cast<ConstantInt>(arg))
+    {
+        uint64_t dim = constInt->getZExtValue();
+
+        if (dim < MAX_WORK_DIMS) return values[dim];
+        return outOfRange;
+    }
+
+    /*-------------------------------------------------------------------------
+    * Not a constant: (arg > 2) ? out : (arg == 2) ? z : (arg == 1) ? y : x
+    *------------------------------------------------------------------------*/
+    Type  *argType = arg->getType();
+    Value *isY  = new ICmpInst(call, ICmpInst::ICMP_EQ, arg,
+                               ConstantInt::get(argType, 1));
+    Value *val  = SelectInst::Create(isY, values[1], values[0], "", call);
+    Value *isZ  = new ICmpInst(call, ICmpInst::ICMP_EQ, arg,
+                               ConstantInt::get(argType, 2));
+    val         = SelectInst::Create(isZ, values[2], val, "", call);
+    Value *isOut= new ICmpInst(call, ICmpInst::ICMP_UGT, arg,
+                               ConstantInt::get(argType, 2));
+
+    return SelectInst::Create(isOut, outOfRange, val, "", call);
+}
+
+/******************************************************************************
+* rewriteWorkItemFunctions: get_local_id and get_global_id become the
+* induction variables of the loops of their region.
+******************************************************************************/
+void CPUWorkGroupAggregation::rewriteWorkItemFunctions(Function &F)
+{
+    std::vector<CallInst *> wi_calls;
+
+    for (inst_iterator I = inst_begin(&F), E = inst_end(&F); I != E; ++I)
+    {
+        CallInst *call = dyn_cast<CallInst>(&*I);
+        if (!call || !call->getCalledFunction()) continue;
+
+        std::string name(call->getCalledFunction()->getName());
+        if (name != "get_local_id" && name != "get_global_id") continue;
+
+        wi_calls.push_back(call);
+    }
+
+    for (size_t i = 0; i < wi_calls.size(); ++i)
+    {
+        CallInst   *call   = wi_calls[i];
+        std::string name(call->getCalledFunction()->getName());
+        Region     &region = Regions[RegionOf[call->getParent()]];
+        Value      *zero   = ConstantInt::get(call->getType(), 0);
+        Value      *ids[MAX_WORK_DIMS];
+
+        for (unsigned int dim = 0; dim < MAX_WORK_DIMS; ++dim)
+            ids[dim] = region.LocalId[dim];
+
+        Value *id = selectDim(call, ids, zero);
+
+        /*---------------------------------------------------------------------
+        * Global id: local id + global id of the first work-item of the group
+        *--------------------------------------------------------------------*/
+        if (name == "get_global_id")
+        {
+            Value *firsts[MAX_WORK_DIMS];
+
+            for (unsigned int dim = 0; dim < MAX_WORK_DIMS; ++dim)
+                firsts[dim] = loadContext(F,
+                        offsetof(Coal::CPUWorkGroupContext, global_first), dim);
+
+            Value *first = selectDim(call, firsts, zero);
+
+            id = BinaryOperator::Create(Instruction::Add, first, id, "", call);
+        }
+
+        call->replaceAllUsesWith(id);
+        call->eraseFromParent();
+    }
+}
+
+/******************************************************************************
+* rewriteWorkGroupFunctions: the built-ins constant in a work-group become
+* loads from its context.
+******************************************************************************/
+void CPUWorkGroupAggregation::rewriteWorkGroupFunctions(Function &F)
+{
+    Type *sizeType = Context->getType()->getPointerElementType();
+    std::vector<CallInst *> wg_calls;
+
+    for (inst_iterator I = inst_begin(&F), E = inst_end(&F); I != E; ++I)
+    {
+        CallInst *call = dyn_cast<CallInst>(&*I);
+        if (call && call->getCalledFunction()) wg_calls.push_back(call);
+    }
+
+    for (size_t i = 0; i < wg_calls.size(); ++i)
+    {
+        CallInst   *call  = wg_calls[i];
+        Type       *type  = call->getType();
+        std::string name(call->getCalledFunction()->getName());
+        Value      *value = 0;
+
+        if (name == "get_work_dim" && type->isIntegerTy())
+        {
+            value = loadContext(F, offsetof(Coal::CPUWorkGroupContext,
+                                            work_dim), 0);
+            value = CastInst::CreateIntegerCast(value, type, false, "", call);
+        }
+
+        for (unsigned int b = 0; !value && context_builtins[b].name; ++b)
+        {
+            if (name != context_builtins[b].name || type != sizeType ||
+                call->getNumArgOperands() != 1)
+                continue;
+
+            Value *values[MAX_WORK_DIMS];
+
+            for (unsigned int dim = 0; dim < MAX_WORK_DIMS; ++dim)
+                values[dim] = loadContext(F, context_builtins[b].field, dim);
+
+            value = selectDim(call, values,
+                          ConstantInt::get(type, context_builtins[b].outOfRange));
+        }
+
+        if (!value) continue;
+
+        call->replaceAllUsesWith(value);
+        call->eraseFromParent();
+    }
+}
+
+/******************************************************************************
+* runOnFunction(Function &F)
+******************************************************************************/
+bool CPUWorkGroupAggregation::runOnFunction(Function &F)
+{
+    if (F.isDeclaration() || !isKernel(F)) return false;
+
+    Module      *M        = F.getParent();
+    LLVMContext &ctx      = F.getContext();
+    Type        *sizeType = DataLayout(M).getIntPtrType(ctx);
+
+    std::vector<CallInst *> barriers;
+
+    if (!canAggregate(F, sizeType, barriers)) return false;
+
+    /*-------------------------------------------------------------------------
+    * The work-group context is given by the runtime, bail out if the program
+    * declares its accessor with an unexpected type.
+    *------------------------------------------------------------------------*/
+    FunctionType *ft = FunctionType::get(sizeType->getPointerTo(), false);
+    Function *f_context = dyn_cast<Function>(
+              M->getOrInsertFunction("__cpu_get_work_group_context", ft));
+
+    if (!f_context) return false;
+
+    f_context->setDoesNotAccessMemory();
+    f_context->setDoesNotThrow();
+
+    /*-------------------------------------------------------------------------
+    * The allocas stay in the entry block, out of the loops. The context is
+    * obtained and its fields read there, once per work-group, and the rest of
+    * the entry block starts the first region.
+    *------------------------------------------------------------------------*/
+    BasicBlock *entry = &F.getEntryBlock();
+    BasicBlock::iterator inspt = entry->begin();
+
+    while (isa<AllocaInst>(inspt)) ++inspt;
+
+    RegionOf.clear();
+    Regions.clear();
+    ContextLoads.clear();
+    NumWorkItems = 0;
+
+    Context = CallInst::Create(f_context, "wg_context", inspt);
+
+    BasicBlock *head = SplitBlock(entry, inspt, this);
+
+    for (unsigned int dim = 0; dim < MAX_WORK_DIMS; ++dim)
+        LocalSize[dim] = loadContext(F,
+                             offsetof(Coal::CPUWorkGroupContext, local_size), dim);
+
+    rewriteWorkGroupFunctions(F);
+
+    /*-------------------------------------------------------------------------
+    * Each barrier gets a block of its own, which becomes the boundary between
+    * two regions once the barrier is removed. The last region ends at the
+    * return.
+    *------------------------------------------------------------------------*/
+    std::vector<BasicBlock *> cuts;
+
+    for (size_t i = 0; i < barriers.size(); ++i)
+    {
+        CallInst *barrier = barriers[i];
+        BasicBlock::iterator next = barrier;
+        ++next;
+
+        BasicBlock *cut = SplitBlock(barrier->getParent(), barrier, this);
+        SplitBlock(cut, next, this);
+        barrier->eraseFromParent();
+
+        cuts.push_back(cut);
+    }
+
+    cuts.push_back(findExitBlock(F));
+
+    /*-------------------------------------------------------------------------
+    * The blocks of a region are the ones reachable from its head without
+    * going through its cut. As the cuts dominate the exit and are out of any
+    * loop, no region can be reached from another one but through them.
+    *------------------------------------------------------------------------*/
+    for (unsigned int i = 0; i < cuts.size(); ++i)
+    {
+        std::vector<BasicBlock *> worklist(1, head);
+        RegionOf[head] = i;
+
+        while (!worklist.empty())
+        {
+            BasicBlock *bb = worklist.back();
+            worklist.pop_back();
+
+            TerminatorInst *term = bb->getTerminator();
+
+            for (unsigned int s = 0; s < term->getNumSuccessors(); ++s)
+            {
+                BasicBlock *succ = term->getSuccessor(s);
+
+                if (succ == cuts[i] || RegionOf.count(succ)) continue;
+
+                RegionOf[succ] = i;
+                worklist.push_back(succ);
+            }
+        }
+
+        if (i + 1 < cuts.size())
+            head = cuts[i]->getTerminator()->getSuccessor(0);
+    }
+
+    demoteCrossRegionValues(F);
+
+    /*-------------------------------------------------------------------------
+    * One loop per dimension and per region, always, as dimensions not
+    * queried by the kernel may still have several work-items. The first
+    * dimension is innermost. The block following the loops of a region
+    * leads to the next one.
+    *------------------------------------------------------------------------*/
+    BasicBlock *pre = entry;
+
+    Regions.resize(cuts.size());
+
+    for (unsigned int i = 0; i < cuts.size(); ++i)
+    {
+        BasicBlock *post = cuts[i];
+
+        for (unsigned int dim = 0; dim < MAX_WORK_DIMS; ++dim)
+            Regions[i].LocalId[dim] = addLoop(pre, post, LocalSize[dim]);
+
+        Regions[i].LinearId = 0;
+        pre = post;
+    }
+
+    privatizeAllocas(F);
+    rewriteWorkItemFunctions(F);
+
+    F.addFnAttr(CPU_WG_FUNCTION_ATTR);
+
+    return true;
+}
+
+char CPUWorkGroupAggregation::ID = 0;
+static RegisterPass<CPUWorkGroupAggregation>
+                   X("cpu-wga", "CPU Work Group Aggregation", false, false);
+
+}
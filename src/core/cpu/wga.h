@@ -0,0 +1,147 @@
+/******************************************************************************
+ * Copyright (c) 2014, Texas Instruments Incorporated - http://www.ti.com/
+ *   All rights reserved.
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *       * Neither the name of Texas Instruments Incorporated nor the
+ *         names of its contributors may be used to endorse or promote products
+ *         derived from this software without specific prior written permission.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *   AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *   IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *   ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ *   LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *   CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *   SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *   INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *   CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *   ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ *   THE POSSIBILITY OF SUCH DAMAGE.
+ *****************************************************************************/
+/**
+ * \file cpu/wga.h
+ * \brief Work-group aggregation for the CPU device
+ */
+#ifndef __CPU_WGA_H__
+#define __CPU_WGA_H__
+
+#include <core/config.h>
+#include <llvm/Pass.h>
+
+#include <map>
+#include <vector>
+
+/**
+ * \brief Function attribute set on the kernels turned into work-group functions
+ */
+#define CPU_WG_FUNCTION_ATTR "_wg_function"
+
+/**
+ * \brief Function attribute giving the bytes of private slots per work-item
+ *
+ * Set on the work-group functions having values or private variables living
+ * across a barrier. The runtime gives them this size times the number of
+ * work-items in \c Coal::CPUWorkGroupContext::private_data.
+ */
+#define CPU_WG_PRIVATE_ATTR "_wg_private_size"
+
+/**
+ * \brief Alignment of \c Coal::CPUWorkGroupContext::private_data
+ */
+#define CPU_WG_PRIVATE_ALIGN 128
+
+namespace llvm
+{
+
+class AllocaInst;
+class BasicBlock;
+class CallInst;
+class PHINode;
+class Type;
+class Use;
+class Value;
+
+/**
+ * \brief Turn CPU kernels into work-group functions
+ *
+ * The body of a kernel is cut at its \c barrier() calls into parallel
+ * regions. Each region is wrapped into three nested work-item loops, the
+ * first dimension innermost, so that all the work-items of the group reach a
+ * barrier before any of them goes past it. \c get_local_id() becomes the
+ * induction variable of these loops and \c get_global_id() the sum of it and
+ * of the global id of the first work-item of the group. The built-ins
+ * returning values constant in a work-group become loads, done when the
+ * kernel is entered, from the \c Coal::CPUWorkGroupContext of the group. The
+ * kernel is then called once per work-group, without an indirect call and
+ * TLS lookups per work-item, and LLVM can optimize and vectorize across
+ * work-items.
+ *
+ * Values and private variables living across a barrier, directly or through
+ * pointers derived from them, are given one slot per work-item. These arrays
+ * are taken from a buffer of the worker, not from its stack, as they grow
+ * with the size of the work-group.
+ *
+ * Only barriers reached exactly once by every work-item, that is not in a
+ * loop and dominating the return of the kernel, can be handled this way.
+ * Kernels with other barriers, kernels calling functions that were not
+ * inlined and kernels called by other kernels are left untouched. They are
+ * still run once per work-item by \c Coal::CPUKernelWorkGroup::run(), using
+ * one \c ucontext per work-item to implement \c barrier().
+ *
+ * The kernels transformed are marked with \c CPU_WG_FUNCTION_ATTR.
+ */
+class CPUWorkGroupAggregation : public FunctionPass
+{
+  public:
+    static char ID;
+
+    CPUWorkGroupAggregation();
+    virtual bool runOnFunction(Function &F);
+    virtual void getAnalysisUsage(AnalysisUsage &Info) const;
+
+  private:
+    /**
+     * \brief Part of a kernel between two barriers
+     */
+    struct Region
+    {
+        PHINode *LocalId[MAX_WORK_DIMS];    /*!< \brief Induction variables of the work-item loops */
+        Value   *LinearId;                  /*!< \brief Index of the work-item in the group, built on demand */
+    };
+
+    bool         isKernel(Function &F);
+    bool         canAggregate(Function &F, Type *sizeType,
+                              std::vector<CallInst *> &barriers);
+    BasicBlock*  findExitBlock(Function &F);
+    PHINode*     addLoop(BasicBlock *pre, BasicBlock *&post, Value *localSize);
+    BasicBlock*  useBlock(Use &use);
+    Value*       getLinearId(unsigned int region);
+    Value*       getNumWorkItems(Function &F);
+    Value*       loadContext(Function &F, size_t field, unsigned int dim);
+    Value*       selectDim(CallInst *call, Value **values, Value *outOfRange);
+    void         demoteCrossRegionValues(Function &F);
+    bool         usedAcrossRegions(AllocaInst *alloca);
+    void         privatizeAllocas(Function &F);
+    void         rewriteWorkItemFunctions(Function &F);
+    void         rewriteWorkGroupFunctions(Function &F);
+
+    std::map<BasicBlock *, unsigned int> RegionOf;
+    std::vector<Region>                  Regions;
+    std::map<size_t, Value *>            ContextLoads;
+    Value*                               Context;
+    Value*                               LocalSize[MAX_WORK_DIMS];
+    Value*                               NumWorkItems;
+};
+
+Pass *createCPUWorkGroupAggregationPass();
+
+}
+
+#endif
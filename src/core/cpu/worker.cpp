@@ -35,6 +35,7 @@
 #include "device.h"
 #include "buffer.h"
 #include "kernel.h"
+#include "transfer.h"
 #include "builtins.h"
 
 #include "../commandqueue.h"
@@ -51,24 +52,32 @@ using namespace Coal;
 
 void *worker(void *data)
 {
-    CPUDevice *device = (CPUDevice *)data;
-    bool stop = false;
+    CPUWorkQueue *own = (CPUWorkQueue *)data;
+    CPUDevice *device = own->device();
     cl_int errcode;
     Event *event;
 
+    // Work-group object reused by all the kernels run by this worker
+    CPUKernelWorkGroup work_group;
+
+    // Cores shared with other processes, if any
+    CPUCoreBudget *budget = CPUCoreBudget::instance();
+
     // Initialize TLS
     setWorkItemsData(0, 0);
 
-    while (true)
+    while ((event = device->getTask(own->index())))
     {
-        event = device->getEvent(stop);
-
-        // Ensure we have a good event and we don't have to stop
-        if (stop) break;
-        if (!event) continue;
-
         // Get info about the event and its command queue
         Event::Type t = event->type();
+        CPUKernelEvent *ke = 0;
+        CPUTransferEvent *te = 0;
+
+        if (t == Event::NDRangeKernel || t == Event::TaskKernel)
+            ke = (CPUKernelEvent *)event->deviceData();
+        else if (CPUTransferEvent::isTransfer(event))
+            te = (CPUTransferEvent *)event->deviceData();
+
         Coal::CommandQueue * queue = NULL;
         cl_command_queue d_queue = 0;
         cl_command_queue_properties queue_props = 0;
@@ -82,11 +91,19 @@ void *worker(void *data)
             queue->info(CL_QUEUE_PROPERTIES, sizeof(cl_command_queue_properties),
                         &queue_props, 0);
 
-        if (queue_props & CL_QUEUE_PROFILING_ENABLE)
-            event->updateTiming(Event::Start);
+        // Kernel and transfer events are run by several workers, only the
+        // first one marks them as running
+        if (ke ? ke->start() : (!te || te->start()))
+        {
+            if (queue_props & CL_QUEUE_PROFILING_ENABLE)
+                event->updateTiming(Event::Start);
+
+            event->setStatus(CL_RUNNING);
+        }
+
+        if (budget) budget->acquire();
 
         // Execute the action
-        event->setStatus(CL_RUNNING);
         switch (t)
         {
             case Event::ReadBuffer:
@@ -95,12 +112,19 @@ void *worker(void *data)
                 ReadWriteBufferEvent *e = (ReadWriteBufferEvent *)event;
                 CPUBuffer *buf = (CPUBuffer *)e->buffer()->deviceBuffer(device);
                 char *data = (char *)buf->data();
+                char *ptr = (char *)e->ptr();
+                size_t begin, end;
 
                 data += e->offset();
 
-                if (t == Event::ReadBuffer)
-                     std::memcpy(e->ptr(), data, e->cb());
-                else std::memcpy(data, e->ptr(), e->cb());
+                while (te->claimRange(begin, end))
+                {
+                    if (t == Event::ReadBuffer)
+                         transferCopy(ptr + begin, data + begin, end - begin,
+                                      te->nonTemporal());
+                    else transferCopy(data + begin, ptr + begin, end - begin,
+                                      te->nonTemporal());
+                }
 
                 break;
             }
@@ -109,25 +133,26 @@ void *worker(void *data)
                 CopyBufferEvent *e = (CopyBufferEvent *)event;
                 CPUBuffer *src = (CPUBuffer *)e->source()->deviceBuffer(device);
                 CPUBuffer *dst = (CPUBuffer *)e->destination()->deviceBuffer(device);
+                char *s = (char *)src->data() + e->src_offset();
+                char *d = (char *)dst->data() + e->dst_offset();
+                size_t begin, end;
 
-                std::memcpy((char*)dst->data() + e->dst_offset(), 
-                            (char*)src->data() + e->src_offset(), e->cb());
+                while (te->claimRange(begin, end))
+                    transferCopy(d + begin, s + begin, end - begin,
+                                 te->nonTemporal());
                 break;
             }
             case Event::FillBuffer:
             {
                 FillBufferEvent *e = (FillBufferEvent *)event;
                 CPUBuffer *buf = (CPUBuffer *)e->buffer()->deviceBuffer(device);
-                unsigned char *dst = (unsigned char *)buf->data();
-                const unsigned char *pattern = (unsigned char *)e->pattern();
-                size_t      pattern_size = e->pattern_size();
-                size_t      offset = e->offset();
-                size_t      size = e->size();
-
-                dst += offset;
-                for (int i = 0; i < size; i+= pattern_size, dst+=pattern_size) {
-                   std::memmove((void *)dst, (void*)pattern, pattern_size);
-                }
+                unsigned char *dst = (unsigned char *)buf->data() + e->offset();
+                size_t begin, end;
+
+                // The chunks start on multiples of the pattern size
+                while (te->claimRange(begin, end))
+                    transferFill(dst + begin, end - begin, e->pattern(),
+                                 e->pattern_size(), begin, te->nonTemporal());
                 break;
             }
             case Event::ReadBufferRect:
@@ -139,80 +164,13 @@ void *worker(void *data)
             case Event::CopyBufferToImage:
             case Event::CopyImageToBuffer:
             {
-                // src = buffer and dst = mem if note copy
-                ReadWriteCopyBufferRectEvent *e = (ReadWriteCopyBufferRectEvent *)event;
-                CPUBuffer *src_buf = (CPUBuffer *)e->source()->deviceBuffer(device);
+                CPURectCopy rect((ReadWriteCopyBufferRectEvent *)event);
+                size_t begin, end;
 
-                unsigned char *src = (unsigned char *)src_buf->data();
-                unsigned char *dst;
+                rect.bind(device);
 
-                switch (t)
-                {
-                    case Event::CopyBufferRect:
-                    case Event::CopyImage:
-                    case Event::CopyImageToBuffer:
-                    case Event::CopyBufferToImage:
-                    {
-                        CopyBufferRectEvent *cbre = (CopyBufferRectEvent *)e;
-                        CPUBuffer *dst_buf =
-                            (CPUBuffer *)cbre->destination()->deviceBuffer(device);
-
-                        dst = (unsigned char *)dst_buf->data();
-                        break;
-                    }
-                    default:
-                    {
-                        // dst = host memory location
-                        ReadWriteBufferRectEvent *rwbre = (ReadWriteBufferRectEvent *)e;
-
-                        dst = (unsigned char *)rwbre->ptr();
-                    }
-                }
-
-                // Iterate over the lines to copy and use memcpy
-                for (size_t z=0; z<e->region(2); ++z)
-                {
-                    for (size_t y=0; y<e->region(1); ++y)
-                    {
-                        unsigned char *s;
-                        unsigned char *d;
-
-                        d = imageData(dst,
-                                      e->dst_origin(0),
-                                      y + e->dst_origin(1),
-                                      z + e->dst_origin(2),
-                                      e->dst_row_pitch(),
-                                      e->dst_slice_pitch(),
-                                      1);
-
-                        s = imageData(src,
-                                      e->src_origin(0),
-                                      y + e->src_origin(1),
-                                      z + e->src_origin(2),
-                                      e->src_row_pitch(),
-                                      e->src_slice_pitch(),
-                                      1);
-
-                        // Copying and image to a buffer may need to add an offset
-                        // to the buffer address (its rectangular origin is
-                        // always (0, 0, 0)).
-                        if (t == Event::CopyBufferToImage)
-                        {
-                            CopyBufferToImageEvent *cptie = (CopyBufferToImageEvent *)e;
-                            s += cptie->offset();
-                        }
-                        else if (t == Event::CopyImageToBuffer)
-                        {
-                            CopyImageToBufferEvent *citbe = (CopyImageToBufferEvent *)e;
-                            d += citbe->offset();
-                        }
-
-                        if (t == Event::WriteBufferRect || t == Event::WriteImage)
-                            std::memcpy(s, d, e->region(0)); // Write dest (memory) in src
-                        else
-                            std::memcpy(d, s, e->region(0)); // Write src (buffer) in dest (memory), or copy the buffers
-                    }
-                }
+                while (te->claimRange(begin, end))
+                    rect.copy(begin, end, te->nonTemporal());
 
                 break;
             }
@@ -235,16 +193,31 @@ void *worker(void *data)
             case Event::TaskKernel:
             {
                 KernelEvent *e = (KernelEvent *)event;
-                CPUKernelEvent *ke = (CPUKernelEvent *)e->deviceData();
-
-                // Take an instance
-                CPUKernelWorkGroup *instance = ke->takeInstance();
-                ke = 0;     // Unlocked, don't use anymore
+                size_t begin, end, index[MAX_WORK_DIMS];
 
-                if (!instance->run())
+                if (!work_group.begin((CPUKernel *)e->deviceKernel(), e, ke))
+                {
                     errcode = CL_INVALID_PROGRAM_EXECUTABLE;
+                    work_group.end();
+                    break;
+                }
 
-                delete instance;
+                // Run work-groups until none is left to claim
+                while (errcode == CL_SUCCESS && ke->claimWorkGroups(begin, end))
+                {
+                    for (size_t wg=begin; wg<end; ++wg)
+                    {
+                        ke->workGroupIndex(wg, index);
+
+                        if (!work_group.run(index))
+                        {
+                            errcode = CL_INVALID_PROGRAM_EXECUTABLE;
+                            break;
+                        }
+                    }
+                }
+
+                work_group.end();
 
                 break;
             }
@@ -271,34 +244,33 @@ void *worker(void *data)
                 break;
         }
 
+        if (budget) budget->release();
+
         // Cleanups
-        if (errcode == CL_SUCCESS)
+        if (ke)
         {
-            bool finished = true;
-
-            if (event->type() == Event::NDRangeKernel ||
-                event->type() == Event::TaskKernel)
-            {
-                CPUKernelEvent *ke = (CPUKernelEvent *)event->deviceData();
-                finished = ke->finished();
-            }
+            // Only the worker finishing the last task completes the event,
+            // the other ones must not touch it anymore.
+            if (!ke->taskFinished(errcode == CL_SUCCESS))
+                continue;
 
-            if (finished)
-            {
-                // an event may be released once it is Complete
-                if (queue_props & CL_QUEUE_PROFILING_ENABLE)
-                    event->updateTiming(Event::End);
-                event->setStatus(CL_COMPLETE);
-            }
+            if (ke->failed())
+                errcode = CL_INVALID_PROGRAM_EXECUTABLE;
         }
-        else
+        else if (te && !te->taskFinished())
         {
-            // an event may be released once it is Complete
-            if (queue_props & CL_QUEUE_PROFILING_ENABLE)
-                    event->updateTiming(Event::End);
+            continue;
+        }
+
+        // an event may be released once it is Complete
+        if (queue_props & CL_QUEUE_PROFILING_ENABLE)
+            event->updateTiming(Event::End);
+
+        if (errcode == CL_SUCCESS)
+            event->setStatus(CL_COMPLETE);
+        else
             // The event failed
             event->setStatus((Event::Status)errcode);
-        }
     }
 
     // Free mmapped() data if needed
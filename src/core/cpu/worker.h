@@ -39,6 +39,8 @@
  * This function is run by as many thread as they are CPU cores on the host
  * system. As explained by \ref events , this function waits until there
  * are \c Coal::Event objects to process and handle them.
+ *
+ * \param data the \c Coal::CPUWorkQueue owned by this worker
  */
 void *worker(void *data);
 
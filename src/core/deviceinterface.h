@@ -42,6 +42,11 @@
 /* This pulls in legacy::PassManager when LLVM >= 3.4 */
 #include <llvm/PassManager.h>
 
+namespace llvm
+{
+    class LLVMContext;
+}
+
 namespace Coal
 {
 class DeviceInterface;
@@ -71,7 +76,7 @@ class Kernel;
 class DeviceInterface : public _cl_device_id, public Object
 {
     public:
-        DeviceInterface() : Object(Object::T_Device, 0) {}
+        DeviceInterface() : Object(Object::T_Device, 0), p_zero_copy_bytes(0) {}
         virtual ~DeviceInterface() {}
 
         /**
@@ -167,6 +172,22 @@ class DeviceInterface : public _cl_device_id, public Object
          */
         virtual void freeEventDeviceData(Event *event) = 0;
 
+        /**
+         * \brief Prepare device-specific event data for another run
+         *
+         * Called when a \c Coal::CommandGraph queues again \p event, already
+         * given to \c initEventDeviceData(). By default, its data are freed
+         * and initialized again, devices can reset them cheaper.
+         *
+         * \param event the event about to be queued again
+         * \return CL_SUCCESS in case of success
+         */
+        virtual cl_int resetEventDeviceData(Event *event)
+        {
+            freeEventDeviceData(event);
+            return initEventDeviceData(event);
+        }
+
         virtual std::string builtinsHeader(void) const = 0;
 
         virtual void init() = 0;
@@ -194,6 +215,26 @@ class DeviceInterface : public _cl_device_id, public Object
 	}
 
         virtual DeviceInterface * parentDevice() const = 0;
+
+        /**
+         * \brief Account for a copy the device did not have to make
+         *
+         * Called when the data of a transfer already are where they have to
+         * be, for instance when reading a \c CL_MEM_USE_HOST_PTR buffer to
+         * its own host pointer. Devices report the total with
+         * \c CL_DEVICE_ZERO_COPY_BYTES_TI.
+         *
+         * \param bytes size of the copy avoided
+         */
+        void zeroCopied(size_t bytes)
+        {
+            __sync_add_and_fetch(&p_zero_copy_bytes, (cl_ulong)bytes);
+        }
+
+        cl_ulong zeroCopiedBytes() const { return p_zero_copy_bytes; } /*!< \brief Total of the copies avoided, see \c zeroCopied() */
+
+    private:
+        volatile cl_ulong p_zero_copy_bytes;
 };
 
 /**
@@ -303,6 +344,43 @@ class DeviceProgram
          */
         virtual bool build(llvm::Module *module, std::string* binary_str) = 0;
 
+        /**
+         * \brief Look for a previous build of a program
+         *
+         * Devices keeping the programs they build, across runs of the
+         * application, return here the linked and optimized module of a
+         * previous build of the same source with the same options.
+         * \c Coal::Program::build() then neither compiles nor links it.
+         *
+         * \param source source of the program
+         * \param options build options
+         * \param context context in which to create the module
+         * \param log set to the build log of the previous build
+         * \return the module, 0 if the program was not built before
+         */
+        virtual llvm::Module *cachedBuild(const std::string &source,
+                                          const std::string &options,
+                                          llvm::LLVMContext &context,
+                                          std::string &log)
+        {  return 0;  }
+
+        /**
+         * \brief Keep a build of a program
+         *
+         * Called by \c Coal::Program::build() with the linked and optimized
+         * module of a program built from source.
+         *
+         * \param source source of the program
+         * \param options build options
+         * \param module linked and optimized module of the program
+         * \param log build log of the program
+         */
+        virtual void cacheBuild(const std::string &source,
+                                const std::string &options,
+                                llvm::Module *module,
+                                const std::string &log)
+        {}
+
         /**
          * \brief Extract binaries from MIXED binary
          * 
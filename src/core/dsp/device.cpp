@@ -54,6 +54,7 @@ extern "C"
 
 }
 
+#include <cstdio>
 #include <cstring>
 #include <cstdlib>
 #include <unistd.h>
@@ -136,6 +137,14 @@ DSPDevice::DSPDevice(unsigned char dsp_id)
       p_complete_pending(),
       p_mpax_default_res(NULL)
 { 
+    /*-------------------------------------------------------------------------
+    * The DSP is reset and loaded for this process only, other processes
+    * wanting it wait here. The other DSPs and the CPU device stay available.
+    *------------------------------------------------------------------------*/
+    char lock_name[32];
+    snprintf(lock_name, sizeof(lock_name), "/var/lock/opencl_dsp%d", dsp_id);
+    p_lock_fd = file_lock_acquire(lock_name);
+
     Driver *driver = Driver::instance();
 
     void *hdl = driver->reset_and_load(dsp_id);
@@ -304,7 +313,11 @@ DSPDevice::~DSPDevice()
     *------------------------------------------------------------------------*/
     if (p_dsp_id == 0) Driver::instance()->close(); 
 
-    if (!p_initialized) return;
+    if (!p_initialized)
+    {
+        file_lock_release(p_lock_fd);
+        return;
+    }
 
     /*-------------------------------------------------------------------------
     * Terminate the workers and wait for them
@@ -320,6 +333,8 @@ DSPDevice::~DSPDevice()
 
     pthread_mutex_destroy(&p_events_mutex);
     pthread_cond_destroy(&p_events_cond);
+
+    file_lock_release(p_lock_fd);
 }
 
 /******************************************************************************
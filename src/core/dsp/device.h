@@ -126,6 +126,7 @@ class DSPDevice : public DeviceInterface
         bool               p_stop; 
         bool               p_initialized;
         unsigned char      p_dsp_id;
+        int                p_lock_fd;  // flock on the DSP, see DSPDevice()
         dspheap            p_device_ddr_heap1;  // persistently mapped memory
         dspheap            p_device_ddr_heap2;  // ondemand mapped memory
         dspheap            p_device_ddr_heap3;  // addl ondemand mapped memory
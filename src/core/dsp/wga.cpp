@@ -202,14 +202,14 @@ Instruction* TIOpenclWorkGroupAggregation::createLoadGlobal
     (int32_t idx, Module* M, Instruction *before, const char *name)
 {
     llvm::ArrayType *type = ArrayType::get(
-    IntegerType::getInt32Ty(getGlobalContext()), 64);
+    IntegerType::getInt32Ty(M->getContext()), 64);
     llvm::Value* dummy     = M->getOrInsertGlobal("kernel_config_l2", type);
 
     GlobalVariable* global = M->getNamedGlobal("kernel_config_l2"); 
 
     std::vector<Value*> indices;
-    indices.push_back(ConstantInt::get(IntegerType::getInt32Ty(getGlobalContext()), 0));
-    indices.push_back(ConstantInt::get(IntegerType::getInt32Ty(getGlobalContext()), idx));
+    indices.push_back(ConstantInt::get(IntegerType::getInt32Ty(M->getContext()), 0));
+    indices.push_back(ConstantInt::get(IntegerType::getInt32Ty(M->getContext()), idx));
 
     Constant* gep = ConstantExpr::getInBoundsGetElementPtr (global, indices);
     LoadInst* ld  = new LoadInst(gep, name, before);
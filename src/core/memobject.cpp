@@ -167,11 +167,27 @@ cl_int MemObject::init()
         return CL_OUT_OF_HOST_MEMORY;
     }
 
+    // CPU devices share a single host allocation of the buffer (see
+    // CPUBuffer::allocate()). When the context only has CPU devices, the
+    // buffer is allocated now, from host_ptr, by the first one.
+    bool host_shared = (p_num_devices > 1);
+
+    for (unsigned int i=0; i<p_num_devices && host_shared; ++i)
+    {
+        cl_device_type device_type = 0;
+
+        pobj(devices[i])->info(CL_DEVICE_TYPE, sizeof(cl_device_type),
+                               &device_type, 0);
+
+        if (device_type != CL_DEVICE_TYPE_CPU)
+            host_shared = false;
+    }
+
     // If we have more than one device, the allocation on the devices is
     // defered to first use, so host_ptr can become invalid. So, copy it in
     // a RAM location and keep it.
     // SubBuffer should simply reuse Buffer data
-    if (p_num_devices > 1 && (p_flags & CL_MEM_COPY_HOST_PTR)
+    if (p_num_devices > 1 && !host_shared && (p_flags & CL_MEM_COPY_HOST_PTR)
                           && type() != SubBuffer)
     {
         void *tmp_hostptr = std::malloc(size());
@@ -221,6 +237,23 @@ cl_int MemObject::init()
         if (!p_devicebuffers[0]->allocate())
             return CL_MEM_OBJECT_ALLOCATION_FAILURE;
     }
+    else if (host_shared && (p_flags & CL_MEM_COPY_HOST_PTR)
+                         && type() != SubBuffer)
+    {
+        // Copy host_ptr once, in the memory all the devices use
+        for (unsigned int i=0; i<p_num_devices; ++i)
+        {
+            if (!p_devicebuffers[i])
+                continue;
+
+            if (!p_devicebuffers[i]->allocate())
+                return CL_MEM_OBJECT_ALLOCATION_FAILURE;
+
+            // The staging copy was avoided
+            p_devicebuffers[i]->device()->zeroCopied(size());
+            break;
+        }
+    }
 
     return CL_SUCCESS;
 }
@@ -33,12 +33,77 @@
 
 #include "object.h"
 
+#include <stdint.h>
+
 using namespace Coal;
 
-static std::list<Object *>& getKnownObjects()
+/*
+ * Set of the known objects: a hash table of buckets, lists of slots. Slots
+ * are never freed, an object leaving the set empties its slot, reused by the
+ * next object hashed to the same bucket. Slots are taken and emptied with
+ * compare-and-swap, lookups only read them, so that no thread ever waits for
+ * another one.
+ */
+namespace
+{
+const unsigned int num_buckets = 16384;
+
+struct KnownObjectSlot
+{
+    const Object * volatile object;     /*!< 0 if the slot is free */
+    KnownObjectSlot *next;              /*!< constant once the slot is in a bucket */
+};
+
+KnownObjectSlot * volatile known_objects[num_buckets];
+}
+
+static KnownObjectSlot * volatile &getBucket(const Object *object)
 {
-    static std::list<Object *> known_objects;
-    return known_objects;
+    // Objects are at least 16-byte aligned, skip the null low bits
+    uintptr_t key = (uintptr_t)object >> 4;
+
+    return known_objects[(key ^ (key >> 14)) % num_buckets];
+}
+
+static void addKnownObject(const Object *object)
+{
+    KnownObjectSlot * volatile &bucket = getBucket(object);
+
+    // Reuse a free slot if any
+    for (KnownObjectSlot *slot = bucket; slot; slot = slot->next)
+        if (!slot->object &&
+            __sync_bool_compare_and_swap(&slot->object, (const Object *)0,
+                                         object))
+            return;
+
+    KnownObjectSlot *slot = new KnownObjectSlot;
+    slot->object = object;
+
+    do
+        slot->next = bucket;
+    while (!__sync_bool_compare_and_swap(&bucket, slot->next, slot));
+}
+
+static void removeKnownObject(const Object *object)
+{
+    for (KnownObjectSlot *slot = getBucket(object); slot; slot = slot->next)
+    {
+        if (slot->object == object)
+        {
+            __sync_bool_compare_and_swap(&slot->object, object,
+                                         (const Object *)0);
+            return;
+        }
+    }
+}
+
+static bool isKnownObject(const Object *object)
+{
+    for (KnownObjectSlot *slot = getBucket(object); slot; slot = slot->next)
+        if (slot->object == object)
+            return true;
+
+    return false;
 }
 
 
@@ -48,9 +113,8 @@ Object::Object(Type type, Object *parent)
     if (parent)
         parent->reference();
 
-    // Add object in the list of known objects
-    getKnownObjects().push_front(this);
-    p_it = getKnownObjects().begin();
+    // Add object in the set of known objects
+    addKnownObject(this);
 }
 
 Object::~Object()
@@ -58,19 +122,19 @@ Object::~Object()
     if (p_parent && p_parent->dereference() && p_release_parent)
         delete p_parent;
 
-    // Remove object from the list of known objects
-    getKnownObjects().erase(p_it);
+    // Remove object from the set of known objects
+    removeKnownObject(this);
 }
 
 void Object::reference()
 {
-    p_references++;
+    __sync_add_and_fetch(&p_references, 1);
 }
 
 bool Object::dereference()
 {
-    p_references--;
-    return (p_references == 0);
+    // Only the thread dropping the last reference sees 0
+    return (__sync_sub_and_fetch(&p_references, 1) == 0);
 }
 
 void Object::setReleaseParent (bool release)
@@ -104,16 +168,9 @@ bool Object::isA(Object::Type type) const
         return false;
 
     // Check that the value isn't garbage or freed pointer
-    std::list<Object *>::const_iterator it = getKnownObjects().begin(),
-                                        e = getKnownObjects().end();
-    while (it != e)
-    {
-        if (*it == this)
-	    // OK, NOW it is safe to dereference this ptr:
-            return this->type() == type;
-
-        ++it;
-    }
+    if (!isKnownObject(this))
+        return false;
 
-    return false;
+    // OK, NOW it is safe to dereference this ptr:
+    return this->type() == type;
 }
@@ -44,9 +44,13 @@ namespace Coal
  * This class implements functions needed by all the Clover objects, like
  * reference counting, the object tree (parents/children), etc.
  * 
- * It also uses a special list of known objects, used to check that a pointer
+ * It also uses a special set of known objects, used to check that a pointer
  * passed by the user to an OpenCL function actually is an object of the correct
  * type. See \c isA().
+ *
+ * The reference counter and the set of known objects are updated with atomic
+ * operations, so that objects can be created, checked and released by any
+ * thread without locking.
  */
 class Object
 {
@@ -63,7 +67,8 @@ class Object
             T_Kernel,       /*!< \brief \c Coal::Kernel */
             T_MemObject,    /*!< \brief \c Coal::MemObject */
             T_Program,      /*!< \brief \c Coal::Program */
-            T_Sampler       /*!< \brief \c Coal::Sampler */
+            T_Sampler,      /*!< \brief \c Coal::Sampler */
+            T_CommandGraph  /*!< \brief \c Coal::CommandGraph */
         };
 
         /**
@@ -115,16 +120,18 @@ class Object
          * \note This function begins with a NULL-check on the \c this pointer,
          *       so it's safe to use even when \c this is not guaranteed not to
          *       be NULL.
+         * \note The pointer is looked up, without lock, in a hash set of the
+         *       live objects, so that the cost of the check does not depend
+         *       on the number of objects.
          * \param type type this object must have for the check to pass
          * \return true if this object exists and has the correct type
          */
         bool isA(Type type) const;
 
     private:
-        unsigned int p_references;
+        volatile unsigned int p_references;
         Object *p_parent;
         Type p_type;
-        std::list<Object *>::iterator p_it;
         bool p_release_parent;
 };
 
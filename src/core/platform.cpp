@@ -39,16 +39,6 @@
 #include "dsp/driver.h"
 #endif
 
-/*-----------------------------------------------------------------------------
-* For the lock file
-*----------------------------------------------------------------------------*/
-#include <sys/file.h>
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <fcntl.h>
-#include <unistd.h>
-#include <errno.h>
-
 using namespace Coal;
 
 // Ensure that Class Platform remains mutable to the ICD "POD" C structure, as expected
@@ -56,59 +46,14 @@ using namespace Coal;
 static_assert(std::is_standard_layout<Platform>::value,
               "Class Platform must be of C++ standard layout type.");
 
-/******************************************************************************
-* begin_file_lock_crit_section
-******************************************************************************/
-static int begin_file_lock_crit_section(char* fname)
-{
-    /*---------------------------------------------------------------------
-    * Create a lock, so only 1 OpenCL program can progress at a time.
-    * I'm not sure about the appropriateness of putting this in the ctor.
-    * We may look at delayed ctor of platform with this in it.
-    *--------------------------------------------------------------------*/
-    int lock_fd = open(fname, O_CREAT, 
-                     S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH);
-
-    std::string str_fname(fname);
-
-    if (lock_fd < 0) 
-    {
-        std::cout << "Can not open lock file " << str_fname << ", Aborting !" << std::endl;
-        exit(-1);
-    }
-
-    int res = flock(lock_fd, LOCK_EX|LOCK_NB);
-    if (res == -1)
-    {
-       if (errno == EWOULDBLOCK)
-       {
-           std::cout << "Waiting on lock " << str_fname << " ..." << std::endl;
-           res = flock(lock_fd, LOCK_EX);
-           if (res == -1)
-           {
-               std::cout << "Error Locking file " << str_fname << ", Aborting !" << std::endl;
-               exit(-1);
-           }
-           else std::cout << "Acquired lock " << str_fname << ", Proceeding!" << std::endl;
-       }
-       else
-       {
-           std::cout << "Error Locking file " << str_fname << ", Aborting !" << std::endl;
-           exit(-1);
-       }
-    }
-
-    return lock_fd;
-
-}
- 
 namespace Coal
 {
+    /*-------------------------------------------------------------------------
+    * No process-wide lock here: processes share the CPU device, each DSP
+    * device locks the DSP it loads, see DSPDevice::DSPDevice().
+    *------------------------------------------------------------------------*/
     Platform::Platform(): dispatch(&dispatch_table)
     {
-        char filename[] = "/var/lock/opencl";
-        p_lock_fd = begin_file_lock_crit_section(filename);
-
 	Coal::DeviceInterface * device = new Coal::CPUDevice(NULL,0);
         p_devices.push_back(desc(device));
 
@@ -122,9 +67,6 @@ namespace Coal
 
     Platform::~Platform()
     {
-        flock(p_lock_fd, LOCK_UN);
-        close(p_lock_fd);
-
         for (int i = 0; i < p_devices.size(); i++)
 	    delete pobj(p_devices[i]);
     }
@@ -203,9 +145,9 @@ namespace Coal
 
             case CL_PLATFORM_EXTENSIONS:
 #ifdef SHAMROCK_BUILD
-                STRING_ASSIGN("cl_khr_byte_addressable_store cl_khr_fp64 cl_khr_icd");
+                STRING_ASSIGN("cl_khr_byte_addressable_store cl_khr_fp64 cl_khr_icd cl_ti_command_graph");
 #else
-                STRING_ASSIGN("cl_khr_byte_addressable_store cl_khr_fp64 cl_ti_msmc_buffers cl_khr_icd");
+                STRING_ASSIGN("cl_khr_byte_addressable_store cl_khr_fp64 cl_ti_msmc_buffers cl_khr_icd cl_ti_command_graph");
 #endif
                 break;
 
@@ -53,7 +53,6 @@ class Platform
     private:
         KHRicdVendorDispatch *dispatch;
         std::vector <cl_device_id> p_devices;
-        int p_lock_fd;
 };
 
 }
@@ -43,11 +43,16 @@
 #include <cstdlib>
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <vector>
 #include <set>
 #include <algorithm>
+#include <map>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <deque>
+#include <pthread.h>
+#include <unistd.h>
 
 #include <llvm/ADT/StringRef.h>
 #include <llvm/ADT/SmallVector.h>
@@ -69,6 +74,7 @@
 #include <llvm/IR/InstIterator.h>
 #include <llvm/IR/DiagnosticPrinter.h>
 #include <llvm/Transforms/Utils/Cloning.h>
+#include <llvm/Transforms/Utils/ValueMapper.h>
 
 #include <runtime/stdlib.c.bc.embed.h>
 
@@ -82,19 +88,695 @@
 using namespace Coal;
 using namespace llvm;
 
+/******************************************************************************
+* stdlib, parsed once per process
+*
+* Every link needs only the few stdlib functions the program calls. The
+* bitcode is parsed once, in a context of its own, and the references between
+* its globals indexed. Each link gets a small module holding only the globals
+* reachable from the declarations of the program, cloned in the context of
+* the stdlib and read back as bitcode in the one of the program.
+******************************************************************************/
+namespace
+{
+struct StdLib
+{
+    LLVMContext context;
+    Module *module;
+    std::map<const GlobalValue *, std::vector<GlobalValue *> > refs;
+};
+
+pthread_once_t stdlib_once = PTHREAD_ONCE_INIT;
+StdLib *stdlib = 0;
+pthread_mutex_t stdlib_mutex = PTHREAD_MUTEX_INITIALIZER;  /*!< guards the context of stdlib */
+}
+
+/******************************************************************************
+* collectGlobals: globals used by a value, looking through constants
+******************************************************************************/
+static void collectGlobals(Value *value, std::set<GlobalValue *> &globals,
+                           std::set<Constant *> &visited)
+{
+    if (GlobalValue *gv = dyn_cast<GlobalValue>(value))
+    {
+        globals.insert(gv);
+        return;
+    }
+
+    Constant *c = dyn_cast<Constant>(value);
+    if (!c || !visited.insert(c).second) return;
+
+    for (unsigned i = 0; i < c->getNumOperands(); ++i)
+        collectGlobals(c->getOperand(i), globals, visited);
+}
+
+/******************************************************************************
+* parseStdLib: parse the embedded stdlib bitcode in ctx
+******************************************************************************/
+static Module *parseStdLib(LLVMContext &ctx)
+{
+    const llvm::StringRef s_data(embed_stdlib_c_bc,
+                                 sizeof(embed_stdlib_c_bc) - 1);
+    const llvm::StringRef s_name("stdlib.bc");
+
+    std::unique_ptr<llvm::MemoryBuffer> buffer =
+      llvm::MemoryBuffer::getMemBuffer(s_data, s_name, false);
+
+    ErrorOr<Module *> ModuleOrErr = parseBitcodeFile(buffer->getMemBufferRef(),
+                                                     ctx);
+
+    return ModuleOrErr ? ModuleOrErr.get() : 0;
+}
+
+/******************************************************************************
+* loadStdLib: parse and index the stdlib, once
+******************************************************************************/
+static void loadStdLib()
+{
+    StdLib *lib = new StdLib;
+
+    lib->module = parseStdLib(lib->context);
+
+    if (!lib->module)
+    {
+        delete lib;
+        return;
+    }
+
+    for (Module::global_iterator G = lib->module->global_begin(),
+         E = lib->module->global_end(); G != E; ++G)
+    {
+        std::set<GlobalValue *> globals;
+        std::set<Constant *> visited;
+
+        if (G->hasInitializer())
+            collectGlobals(G->getInitializer(), globals, visited);
+
+        lib->refs[G].assign(globals.begin(), globals.end());
+    }
+
+    for (Module::iterator F = lib->module->begin(),
+         E = lib->module->end(); F != E; ++F)
+    {
+        std::set<GlobalValue *> globals;
+        std::set<Constant *> visited;
+
+        for (inst_iterator I = inst_begin(F), IE = inst_end(F); I != IE; ++I)
+            for (unsigned op = 0; op < I->getNumOperands(); ++op)
+                collectGlobals(I->getOperand(op), globals, visited);
+
+        lib->refs[F].assign(globals.begin(), globals.end());
+    }
+
+    stdlib = lib;
+}
+
+/******************************************************************************
+* stdlibSubset: new module with the stdlib globals needed by program
+******************************************************************************/
+static Module *stdlibSubset(Module *program)
+{
+    pthread_once(&stdlib_once, loadStdLib);
+
+    if (!stdlib) return 0;
+
+    /*-------------------------------------------------------------------------
+    * Aliases are not handled below, a stdlib with some is linked as a whole
+    *------------------------------------------------------------------------*/
+    if (!stdlib->module->alias_empty())
+        return parseStdLib(program->getContext());
+
+    std::vector<std::string> declared;
+
+    for (Module::iterator F = program->begin(), E = program->end(); F != E; ++F)
+        if (F->isDeclaration())
+            declared.push_back(F->getName());
+
+    pthread_mutex_lock(&stdlib_mutex);
+
+    /*-------------------------------------------------------------------------
+    * Globals reachable from the declarations of the program
+    *------------------------------------------------------------------------*/
+    Module *lib = stdlib->module;
+    std::vector<GlobalValue *> needed;
+    std::set<GlobalValue *> seen;
+
+    for (size_t i = 0; i < declared.size(); ++i)
+    {
+        GlobalValue *gv = lib->getNamedValue(declared[i]);
+
+        if (gv && !gv->isDeclaration() && seen.insert(gv).second)
+            needed.push_back(gv);
+    }
+
+    for (size_t i = 0; i < needed.size(); ++i)
+    {
+        std::map<const GlobalValue *, std::vector<GlobalValue *> >::iterator
+            refs = stdlib->refs.find(needed[i]);
+
+        if (refs == stdlib->refs.end()) continue;
+
+        for (size_t j = 0; j < refs->second.size(); ++j)
+            if (seen.insert(refs->second[j]).second)
+                needed.push_back(refs->second[j]);
+    }
+
+    /*-------------------------------------------------------------------------
+    * Copy them, as CloneModule() does for the whole module
+    *------------------------------------------------------------------------*/
+    Module *subset = new Module(lib->getModuleIdentifier(), stdlib->context);
+    ValueToValueMapTy VMap;
+
+    subset->setDataLayout(lib->getDataLayout());
+    subset->setTargetTriple(lib->getTargetTriple());
+
+    for (size_t i = 0; i < needed.size(); ++i)
+    {
+        if (Function *F = dyn_cast<Function>(needed[i]))
+        {
+            Function *NF = Function::Create(F->getFunctionType(),
+                                            F->getLinkage(), F->getName(),
+                                            subset);
+            NF->copyAttributesFrom(F);
+            VMap[F] = NF;
+        }
+        else if (GlobalVariable *G = dyn_cast<GlobalVariable>(needed[i]))
+        {
+            GlobalVariable *NG = new GlobalVariable(*subset,
+                G->getType()->getElementType(), G->isConstant(),
+                G->getLinkage(), 0, G->getName(), 0,
+                G->getThreadLocalMode(), G->getType()->getAddressSpace());
+            NG->copyAttributesFrom(G);
+            VMap[G] = NG;
+        }
+    }
+
+    for (size_t i = 0; i < needed.size(); ++i)
+    {
+        if (GlobalVariable *G = dyn_cast<GlobalVariable>(needed[i]))
+        {
+            if (G->hasInitializer())
+                cast<GlobalVariable>(VMap[G])->setInitializer(
+                    MapValue(G->getInitializer(), VMap));
+        }
+        else if (Function *F = dyn_cast<Function>(needed[i]))
+        {
+            if (F->isDeclaration()) continue;
+
+            Function *NF = cast<Function>(VMap[F]);
+            Function::arg_iterator DestI = NF->arg_begin();
+
+            for (Function::const_arg_iterator I = F->arg_begin();
+                 I != F->arg_end(); ++I)
+            {
+                DestI->setName(I->getName());
+                VMap[I] = DestI++;
+            }
+
+            SmallVector<ReturnInst *, 8> Returns;
+            CloneFunctionInto(NF, F, VMap, /*ModuleLevelChanges=*/true,
+                              Returns);
+        }
+    }
+
+    /*-------------------------------------------------------------------------
+    * Move the subset to the context of the program
+    *------------------------------------------------------------------------*/
+    std::string bitcode;
+    llvm::raw_string_ostream ostream(bitcode);
+
+    llvm::WriteBitcodeToFile(subset, ostream);
+    ostream.flush();
+    delete subset;
+
+    pthread_mutex_unlock(&stdlib_mutex);
+
+    std::unique_ptr<llvm::MemoryBuffer> buffer =
+      llvm::MemoryBuffer::getMemBuffer(bitcode, "stdlib.bc", false);
+
+    ErrorOr<Module *> ModuleOrErr = parseBitcodeFile(buffer->getMemBufferRef(),
+                                                     program->getContext());
+
+    return ModuleOrErr ? ModuleOrErr.get() : 0;
+}
+
+/******************************************************************************
+* Build threads
+*
+* Builds given a pfn_notify are queued as jobs to a pool of threads started
+* on first use. The builds of a program, in the background or not, hold the
+* lock of its LLVM contexts, recursive as build() calls compile() and link().
+******************************************************************************/
+struct Program::BuildJob
+{
+    enum Step { Compile, Link, Build };
+
+    Step                            step;
+    Program                        *program;
+    std::string                     options;
+    bool                            has_options;
+    void (CL_CALLBACK *pfn_notify)(cl_program program, void *user_data);
+    void                           *user_data;
+    std::vector<DeviceInterface *>  devices;
+    std::vector<cl_program>         inputs;     /*!< headers or linked programs */
+    std::vector<std::string>        names;      /*!< include names of the headers */
+};
+
+namespace
+{
+pthread_once_t build_once = PTHREAD_ONCE_INIT;
+pthread_mutex_t build_jobs_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t build_jobs_cond = PTHREAD_COND_INITIALIZER;
+std::deque<Program::BuildJob *> build_jobs;
+
+// Input headers are written to a directory shared by all the programs
+pthread_mutex_t headers_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+class ContextsLock
+{
+    public:
+        ContextsLock(Program *program, bool lock = true)
+        : p_program(lock ? program : 0)
+        {
+            if (p_program) p_program->lockContexts();
+        }
+
+        ~ContextsLock()
+        {
+            if (p_program) p_program->unlockContexts();
+        }
+
+    private:
+        Program *p_program;
+};
+}
+
+static void startBuildThreads()
+{
+    long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (num_threads < 1) num_threads = 1;
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    for (long i = 0; i < num_threads; ++i)
+    {
+        pthread_t thread;
+        pthread_create(&thread, &attr, &Program::buildThread, 0);
+    }
+
+    pthread_attr_destroy(&attr);
+}
+
+void *Program::buildThread(void *)
+{
+    while (true)
+    {
+        pthread_mutex_lock(&build_jobs_mutex);
+
+        while (build_jobs.empty())
+            pthread_cond_wait(&build_jobs_cond, &build_jobs_mutex);
+
+        BuildJob *job = build_jobs.front();
+        build_jobs.pop_front();
+
+        pthread_mutex_unlock(&build_jobs_mutex);
+
+        job->program->runBuildJob(job);
+    }
+
+    return 0;
+}
+
+cl_int Program::queueBuildJob(BuildJob *job)
+{
+    pthread_once(&build_once, &startBuildThreads);
+
+    job->program = this;
+
+    // Released by runBuildJob()
+    reference();
+
+    for (size_t i = 0; i < job->inputs.size(); ++i)
+        pobj(job->inputs[i])->reference();
+
+    pthread_mutex_lock(&build_jobs_mutex);
+    build_jobs.push_back(job);
+    pthread_cond_signal(&build_jobs_cond);
+    pthread_mutex_unlock(&build_jobs_mutex);
+
+    return CL_SUCCESS;
+}
+
+void Program::runBuildJob(BuildJob *job)
+{
+    const char *options = job->has_options ? job->options.c_str() : 0;
+    DeviceInterface * const *devices =
+        job->devices.empty() ? 0 : &job->devices[0];
+    const cl_program *inputs = job->inputs.empty() ? 0 : &job->inputs[0];
+    std::vector<const char *> names;
+
+    for (size_t i = 0; i < job->names.size(); ++i)
+        names.push_back(job->names[i].c_str());
+
+    switch (job->step)
+    {
+        case BuildJob::Compile:
+            compileNow(options, job->devices.size(), devices,
+                       inputs ? job->inputs.size() : 0, inputs,
+                       names.empty() ? 0 : &names[0]);
+            break;
+        case BuildJob::Link:
+            linkNow(options, job->devices.size(), devices,
+                    job->inputs.size(), inputs);
+            break;
+        case BuildJob::Build:
+            buildNow(options, job->devices.size(), devices);
+            break;
+    }
+
+    // The state of the program is final when pfn_notify is called
+    endBuild();
+
+    job->pfn_notify(desc(this), job->user_data);
+
+    for (size_t i = 0; i < job->inputs.size(); ++i)
+        if (pobj(job->inputs[i])->dereference())
+            delete pobj(job->inputs[i]);
+
+    if (dereference())
+        delete this;
+
+    delete job;
+}
+
+/******************************************************************************
+* A program is built, compiled or linked once at a time, the other builds are
+* rejected meanwhile. The errors found without compiling are returned by
+* beginBuild(), also for the builds done in the background.
+******************************************************************************/
+cl_int Program::beginBuild(const char *options, bool compiles)
+{
+    if (!__sync_bool_compare_and_swap(&p_building, 0, 1))
+        return CL_INVALID_OPERATION;
+
+    // No kernel may be attached, see compileNow()
+    if (compiles && getNumKernels() > 0)
+    {
+        p_state = Failed;
+        endBuild();
+        return CL_INVALID_OPERATION;
+    }
+
+    if (compiles && p_type == Source && options &&
+        !Compiler::validOptions(options))
+    {
+        p_state = Failed;
+        endBuild();
+        return CL_INVALID_BUILD_OPTIONS;
+    }
+
+    return CL_SUCCESS;
+}
+
+void Program::endBuild()
+{
+    // Readers of p_building see the final state of the program
+    __sync_synchronize();
+    p_building = 0;
+}
+
+/******************************************************************************
+* Devices built together
+*
+* The devices of a program sharing a type and extensions, a device and its
+* sub-devices typically, compile and link a source to the same module. The
+* work is done once per group of such devices, the other devices of the group
+* getting copies of the module. The groups are built in parallel, each one in
+* its own LLVMContext.
+******************************************************************************/
+struct Program::DeviceGroup
+{
+    Program                         *program;
+    std::vector<DeviceDependent *>   deps;
+    std::vector<DeviceInterface *>   devices;   /*!< device_list entry of each dep */
+    LLVMContext                     *context;   /*!< of the modules to create */
+    const std::string               *options;
+    bool                             linkAsLibrary;
+    cl_uint                          num_input_programs;
+    const cl_program                *input_programs;
+    cl_int                           result;
+    pthread_t                        thread;
+};
+
+static std::string deviceGroupKey(DeviceInterface *device)
+{
+    cl_device_type type;
+    size_t size = 0;
+
+    device->info(CL_DEVICE_TYPE, sizeof(type), &type, 0);
+    device->info(CL_DEVICE_EXTENSIONS, 0, 0, &size);
+
+    std::string extensions(size, '\0');
+
+    if (size)
+        device->info(CL_DEVICE_EXTENSIONS, size, &extensions[0], 0);
+
+    std::ostringstream key;
+    key << type << '\n' << device->builtinsHeader() << '\n' << extensions;
+
+    return key.str();
+}
+
+// Copy of module in context, through bitcode if module lives in another one
+static Module *copyModule(Module *module, LLVMContext &context)
+{
+    if (&module->getContext() == &context)
+        return CloneModule(module);
+
+    std::string bitcode;
+    raw_string_ostream ostream(bitcode);
+
+    WriteBitcodeToFile(module, ostream);
+    ostream.flush();
+
+    std::unique_ptr<MemoryBuffer> buffer =
+        MemoryBuffer::getMemBuffer(bitcode, module->getModuleIdentifier(),
+                                   false);
+    ErrorOr<Module *> ModuleOrErr =
+        parseBitcodeFile(buffer->getMemBufferRef(), context);
+
+    return ModuleOrErr ? ModuleOrErr.get() : 0;
+}
+
+std::vector<Program::DeviceGroup>
+Program::deviceGroups(DeviceInterface * const *device_list, bool share)
+{
+    std::vector<DeviceGroup> groups;
+    std::map<std::string, size_t> group_of;
+    std::set<DeviceDependent *> seen;
+
+    for (cl_uint i=0; i<p_device_dependent.size(); ++i)
+    {
+        DeviceDependent &dep = deviceDependent(device_list[i]);
+
+        if (!seen.insert(&dep).second) continue;
+
+        std::string key = deviceGroupKey(dep.device);
+        std::map<std::string, size_t>::iterator it = group_of.find(key);
+
+        if (it == group_of.end() || !share)
+        {
+            DeviceGroup group;
+
+            group.program = this;
+            group.context = 0;
+            group.options = 0;
+            group.linkAsLibrary = false;
+            group.num_input_programs = 0;
+            group.input_programs = 0;
+            group.result = CL_SUCCESS;
+
+            group_of[key] = groups.size();
+            groups.push_back(group);
+            it = group_of.find(key);
+        }
+
+        groups[it->second].deps.push_back(&dep);
+        groups[it->second].devices.push_back(device_list[i]);
+    }
+
+    return groups;
+}
+
+LLVMContext *Program::createContext()
+{
+    LLVMContext *context = new LLVMContext;
+
+    p_contexts.push_back(context);
+
+    return context;
+}
+
+void Program::releaseUnusedContexts()
+{
+    std::set<LLVMContext *> used;
+
+    for (size_t i=0; i<p_device_dependent.size(); ++i)
+        if (p_device_dependent[i].linked_module)
+            used.insert(&p_device_dependent[i].linked_module->getContext());
+
+    // Deleting a context deletes the modules of the previous builds left in it
+    for (size_t i=0; i<p_contexts.size(); )
+    {
+        if (used.count(p_contexts[i]))
+        {
+            ++i;
+            continue;
+        }
+
+        delete p_contexts[i];
+        p_contexts.erase(p_contexts.begin() + i);
+    }
+}
+
+void Program::runDeviceGroups(std::vector<DeviceGroup> &groups,
+                              void *(*run)(void *))
+{
+    // The first group is done by the calling thread
+    for (size_t i=1; i<groups.size(); ++i)
+        if (pthread_create(&groups[i].thread, 0, run, &groups[i]) != 0)
+            groups[i].thread = pthread_self();
+
+    if (groups.size())
+        run(&groups[0]);
+
+    for (size_t i=1; i<groups.size(); ++i)
+    {
+        if (pthread_equal(groups[i].thread, pthread_self()))
+            run(&groups[i]);
+        else
+            pthread_join(groups[i].thread, 0);
+    }
+}
+
+void *Program::compileGroup(void *arg)
+{
+    DeviceGroup &group = *(DeviceGroup *)arg;
+    DeviceDependent &leader = *group.deps[0];
+
+    // Load source
+    const llvm::StringRef s_data(group.program->p_source);
+    const llvm::StringRef s_name("<source>");
+
+    std::unique_ptr<llvm::MemoryBuffer> buffer =
+      llvm::MemoryBuffer::getMemBuffer(s_data, s_name);
+
+    // Compile
+    int compile_result = leader.compiler->compile(*group.options,
+                                                  buffer.get(),
+                                                  *group.context);
+    if (compile_result)
+    {
+        group.result = (compile_result == CL_INVALID_BUILD_OPTIONS ?
+                        CL_INVALID_BUILD_OPTIONS : CL_COMPILE_PROGRAM_FAILURE);
+
+        for (size_t i=1; i<group.deps.size(); ++i)
+            group.deps[i]->compiler->reuse(*leader.compiler, 0);
+
+        return 0;
+    }
+
+    // Get module and its bitcode
+    leader.linked_module = leader.compiler->module();
+    leader.unlinked_binary.clear();
+
+    llvm::raw_string_ostream ostream(leader.unlinked_binary);
+    llvm::WriteBitcodeToFile(leader.linked_module, ostream);
+    ostream.flush();
+
+    for (size_t i=1; i<group.deps.size(); ++i)
+    {
+        DeviceDependent &dep = *group.deps[i];
+
+        dep.linked_module = CloneModule(leader.linked_module);
+        dep.unlinked_binary = leader.unlinked_binary;
+        dep.compiler->reuse(*leader.compiler, dep.linked_module);
+    }
+
+    return 0;
+}
+
+void *Program::linkGroup(void *arg)
+{
+    DeviceGroup &group = *(DeviceGroup *)arg;
+    DeviceDependent &leader = *group.deps[0];
+
+    group.result = group.program->linkDevice(leader, group.devices[0],
+                                             group.context,
+                                             group.linkAsLibrary,
+                                             group.num_input_programs,
+                                             group.input_programs);
+
+    for (size_t i=1; i<group.deps.size(); ++i)
+    {
+        DeviceDependent &dep = *group.deps[i];
+
+        if (group.result == CL_SUCCESS)
+        {
+            if (dep.linked_module != leader.linked_module)
+                delete dep.linked_module;
+
+            dep.linked_module = CloneModule(leader.linked_module);
+            dep.is_native_binary = leader.is_native_binary;
+        }
+
+        dep.compiler->reuse(*leader.compiler, dep.linked_module);
+    }
+
+    if (group.result != CL_SUCCESS)
+        return 0;
+
+    // Now that the LLVM modules are built, build the device-specific
+    // representations
+    for (size_t i=0; i<group.deps.size(); ++i)
+    {
+        DeviceDependent &dep = *group.deps[i];
+
+        if (!dep.program->build(dep.linked_module, &dep.unlinked_binary))
+        {
+            group.result = CL_BUILD_PROGRAM_FAILURE;
+            return 0;
+        }
+    }
+
+    return 0;
+}
+
 Program::Program(Context *ctx)
-  : Object(Object::T_Program, ctx), p_type(Invalid), p_state(Empty),
+  : Object(Object::T_Program, ctx), p_type(Invalid), p_state(Empty), p_building(0),
     p_binary_type(CL_PROGRAM_BINARY_TYPE_NONE)
 {
     p_null_device_dependent.compiler = 0;
     p_null_device_dependent.device = 0;
     p_null_device_dependent.linked_module = 0;
     p_null_device_dependent.program = 0;
+
+    pthread_mutexattr_t attr;
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&p_contexts_mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
 }
 
 Program::~Program()
 {
    resetDeviceDependent();
+
+   pthread_mutex_destroy(&p_contexts_mutex);
 }
 
 void Program::resetDeviceDependent()
@@ -110,6 +792,14 @@ void Program::resetDeviceDependent()
 
         p_device_dependent.pop_back();
     }
+
+    // The modules of the contexts are all deleted now
+    while (p_contexts.size())
+    {
+        delete p_contexts.back();
+
+        p_contexts.pop_back();
+    }
 }
 
 void Program::setDevices(cl_uint num_devices, DeviceInterface * const*devices)
@@ -219,6 +909,7 @@ std::vector<llvm::Function *> Program::kernelFunctions(DeviceDependent &dep)
 Kernel *Program::createKernel(const std::string &name, cl_int *errcode_ret)
 {
     Kernel *rs = NULL;
+    ContextsLock lock(this);
 
 	for (size_t i=0; i < kernelList.size(); i++)
     {
@@ -497,6 +1188,8 @@ cl_int Program::loadBinaries(const unsigned char **data, const size_t *lengths,
                              cl_int *binary_status, cl_uint num_devices,
                              DeviceInterface * const*device_list)
 {
+    ContextsLock lock(this);
+
     // Set device infos
     setDevices(num_devices, device_list);
 
@@ -529,8 +1222,9 @@ cl_int Program::loadBinaries(const unsigned char **data, const size_t *lengths,
             return CL_OUT_OF_HOST_MEMORY;
 
         // Make a module of it
+        // One context per device, as their binaries are linked in parallel
         ErrorOr<Module *> ModuleOrErr = parseBitcodeFile(buffer->getMemBufferRef(),
-						  llvm::getGlobalContext());
+						  *createContext());
         if (ModuleOrErr) {
              dep.linked_module = ModuleOrErr.get();
         }
@@ -635,9 +1329,49 @@ cl_int Program::compile(const char *options,
                      cl_uint num_input_headers,
                      const cl_program *input_headers,
                      const char **header_include_names)
+{
+    cl_int retcode = beginBuild(options, true);
+
+    if (retcode != CL_SUCCESS)
+        return retcode;
+
+    if (pfn_notify)
+    {
+        BuildJob *job = new BuildJob;
+
+        job->step = BuildJob::Compile;
+        job->has_options = (options != 0);
+        job->options = options ? options : "";
+        job->pfn_notify = pfn_notify;
+        job->user_data = user_data;
+        job->devices.assign(device_list, device_list + num_devices);
+
+        for (cl_uint i = 0; i < num_input_headers; ++i)
+        {
+            job->inputs.push_back(input_headers[i]);
+            job->names.push_back(header_include_names[i]);
+        }
+
+        return queueBuildJob(job);
+    }
+
+    retcode = compileNow(options, num_devices, device_list, num_input_headers,
+                         input_headers, header_include_names);
+    endBuild();
+
+    return retcode;
+}
+
+cl_int Program::compileNow(const char *options, cl_uint num_devices,
+                           DeviceInterface * const*device_list,
+                           cl_uint num_input_headers,
+                           const cl_program *input_headers,
+                           const char **header_include_names)
 {
     cl_int retcode = CL_SUCCESS;
 
+    ContextsLock lock(this);
+
 #if 0
     // If we've already built this program and are re-building
     // (for example, with different user options) then clear out the
@@ -666,6 +1400,9 @@ cl_int Program::compile(const char *options,
     std::string comp_opts = options ? options : std::string();
 
     // Place the input headers in a special directory under /tmp so compiler can find them
+    if (num_input_headers > 0)
+        pthread_mutex_lock(&headers_mutex);
+
     if (storeInputHeaders(num_input_headers, input_headers, header_include_names)) {
         retcode = CL_BUILD_PROGRAM_FAILURE;
 	goto cleanup;
@@ -674,47 +1411,35 @@ cl_int Program::compile(const char *options,
         comp_opts =  std::string("-I /") + headers_dir + std::string(" ") + comp_opts;
     }
 
-    // ASW TODO - optimize to compile for each device type only once.
-    for (cl_uint i=0; i<p_device_dependent.size(); ++i)
+    // Do we need to compile the source for each device ?
+    if (p_type == Source)
     {
-        DeviceDependent &dep = deviceDependent(device_list[i]);
+        std::vector<DeviceGroup> groups = deviceGroups(device_list, true);
 
-        // Do we need to compile the source for each device ?
-        if (p_type == Source)
+        for (size_t i=0; i<groups.size(); ++i)
         {
-            // Load source
-            const llvm::StringRef s_data(p_source);
-            const llvm::StringRef s_name("<source>");
+            groups[i].context = createContext();
+            groups[i].options = &comp_opts;
+        }
 
-            std::unique_ptr<llvm::MemoryBuffer> buffer =
-	      llvm::MemoryBuffer::getMemBuffer(s_data, s_name);
+        runDeviceGroups(groups, &compileGroup);
 
-            // Compile
-	    int compile_result = dep.compiler->compile(comp_opts, buffer.get());
-	    if (compile_result)
+        for (size_t i=0; i<groups.size(); ++i)
+        {
+            if (groups[i].result != CL_SUCCESS)
             {
-                if (compile_result == CL_INVALID_BUILD_OPTIONS) {
-                    retcode = CL_INVALID_BUILD_OPTIONS;
-		    goto cleanup;
-		}
-                else {
-                    retcode = CL_COMPILE_PROGRAM_FAILURE;
-		    goto cleanup;
-		}
+                retcode = groups[i].result;
+                break;
             }
-
-            // Get module and its bitcode
-            dep.linked_module = dep.compiler->module();
-
-            llvm::raw_string_ostream ostream(dep.unlinked_binary);
-            llvm::WriteBitcodeToFile(dep.linked_module, ostream);
-            ostream.flush();
         }
     }
 
 cleanup:
     removeInputHeaders(num_input_headers, header_include_names);
 
+    if (num_input_headers > 0)
+        pthread_mutex_unlock(&headers_mutex);
+
     if (retcode == CL_SUCCESS) {
         p_state = Compiled;
         p_binary_type = CL_PROGRAM_BINARY_TYPE_COMPILED_OBJECT;
@@ -723,166 +1448,233 @@ cleanup:
 }
 
 
-cl_int Program::link(const char *options,
-                     void (CL_CALLBACK *pfn_notify)(cl_program program,
-                                                    void *user_data),
-                     void *user_data, cl_uint num_devices,
-                     DeviceInterface * const * device_list,
-                     cl_uint num_input_programs,
-		     const cl_program * input_programs)
+cl_int Program::linkDevice(DeviceDependent &dep, DeviceInterface *device,
+                           LLVMContext *context, bool linkAsLibrary,
+                           cl_uint num_input_programs,
+                           const cl_program *input_programs)
 {
-    bool linkAsLibrary = false;
-
-    p_state = Failed;
-
-    if (options && strstr(options, "-create-library")) {
-        linkAsLibrary = true;
+    int start = 0;
+    // If no module, initialize with the first input program:
+    if (!dep.linked_module) {
+        dep.linked_module = copyModule(
+           (pobj(input_programs[0]))->deviceDependent(device).linked_module,
+           *context);
+        start = 1;
+
+        if (!dep.linked_module) {
+            dep.compiler->appendLog("link error: cannot load program\n");
+            return CL_BUILD_PROGRAM_FAILURE;
+        }
     }
 
-    // Set device infos
-    if (!p_device_dependent.size())
-    {
-        setDevices(num_devices, device_list);
-    }
+    // Link programs into this program:
+    std::string errMsg;
 
-    for (cl_uint i=0; i<p_device_dependent.size(); ++i)  {
-        DeviceDependent &dep = deviceDependent(device_list[i]);
+    for (int j = start; j <= num_input_programs; j++) {
+        Module *other;
+        bool owned = false;
 
-        // Link with the stdlib if the device needs that
-        Module *stdlib = NULL;
-        if (!dep.is_native_binary && dep.program->linkStdLib() && !linkAsLibrary)
-        {
-            // Load the stdlib bitcode
-            const llvm::StringRef s_data(embed_stdlib_c_bc,
-                                         sizeof(embed_stdlib_c_bc) - 1);
-            const llvm::StringRef s_name("stdlib.bc");
-            std::string errMsg;
-
-            std::unique_ptr<llvm::MemoryBuffer> buffer =
-	      llvm::MemoryBuffer::getMemBuffer(s_data, s_name, false);
-
-            if (!buffer)
-                return CL_OUT_OF_HOST_MEMORY;
-
-            ErrorOr<Module *> ModuleOrErr =
-                    parseBitcodeFile(buffer->getMemBufferRef(), llvm::getGlobalContext());
-            if (ModuleOrErr) {
-                 stdlib =  ModuleOrErr.get();
-            }
-            else {
-	         std::error_code EC = ModuleOrErr.getError();
-                 errMsg = EC.message();
+        if (j == num_input_programs) {
+            // Link with the stdlib if the device needs that, only what
+            // the linked programs use of it
+            if (dep.is_native_binary || !dep.program->linkStdLib() ||
+                linkAsLibrary)
+                break;
+
+            other = stdlibSubset(dep.linked_module);
+            owned = true;
+            if (!other) {
+                dep.compiler->appendLog("link error: cannot load stdlib\n");
+                return CL_BUILD_PROGRAM_FAILURE;
             }
-	}
+        }
+        else {
+            DeviceDependent &other_dep =
+              (pobj(input_programs[j]))->deviceDependent(device);
+            other = other_dep.linked_module;
 
-	int start = 0;
-	// If no module, initialize with the first input program:
-	if (!dep.linked_module) {
-	    dep.linked_module = CloneModule(
-	       (pobj(input_programs[0]))->deviceDependent(device_list[i]).linked_module);
-	    start = 1;
-            if (stdlib) num_input_programs++;
-	}
+            // clBuildProgram() links the program with itself only
+            if (other == dep.linked_module)
+                continue;
 
-	// Link programs into this program:
-        std::string errMsg;
+            // Modules compiled separately live in other contexts
+            if (&other->getContext() != &dep.linked_module->getContext())
+            {
+                other = copyModule(other, dep.linked_module->getContext());
+                owned = true;
 
-	for (int j = start; j < num_input_programs; j++) {
-	    Module *other;
-            if (j == (num_input_programs-1) && stdlib) {
-                other = stdlib;
-            }
-            else {
-                DeviceDependent &other_dep =
-		  (pobj(input_programs[j]))->deviceDependent(device_list[i]);
-                other = other_dep.linked_module;
+                if (!other) {
+                    dep.compiler->appendLog("link error: cannot load program\n");
+                    return CL_BUILD_PROGRAM_FAILURE;
+                }
             }
+        }
 
-            // Link
-	    std::string Message;
-	    raw_string_ostream Stream(Message);
-	    DiagnosticPrinterRawOStream DP(Stream);
+        // Link
+        std::string Message;
+        raw_string_ostream Stream(Message);
+        DiagnosticPrinterRawOStream DP(Stream);
 
-	    LLVMBool Result = Linker::LinkModules(dep.linked_module, other,
-		    [&](const DiagnosticInfo &DI) { DI.print(DP); });
-	    if (Result) {
-		errMsg += strdup(Message.c_str());
-                dep.compiler->appendLog("link error: ");
-                dep.compiler->appendLog(errMsg);
-                dep.compiler->appendLog("\n");
+        LLVMBool Result = Linker::LinkModules(dep.linked_module, other,
+                [&](const DiagnosticInfo &DI) { DI.print(DP); });
 
-                // DEBUG
-                std::cout << dep.compiler->log() << std::endl;
+        if (owned) delete other;
 
-                return CL_BUILD_PROGRAM_FAILURE;
-            }
-	}
+        if (Result) {
+            errMsg += strdup(Message.c_str());
+            dep.compiler->appendLog("link error: ");
+            dep.compiler->appendLog(errMsg);
+            dep.compiler->appendLog("\n");
 
+            // DEBUG
+            std::cout << dep.compiler->log() << std::endl;
 
-        if (!dep.is_native_binary && !linkAsLibrary)
+            return CL_BUILD_PROGRAM_FAILURE;
+        }
+    }
+
+
+    if (!dep.is_native_binary && !linkAsLibrary)
+    {
+        // Get list of kernels to strip other unused functions
+        std::vector<const char *> api;
+        std::vector<std::string> api_s; // Needed to keep valid data in api
+        const std::vector<llvm::Function *> &kernels = kernelFunctions(dep);
+
+        for (size_t j=0; j<kernels.size(); ++j)
         {
-            // Get list of kernels to strip other unused functions
-            std::vector<const char *> api;
-            std::vector<std::string> api_s; // Needed to keep valid data in api
-            const std::vector<llvm::Function *> &kernels = kernelFunctions(dep);
+            std::string s = kernels[j]->getName().str();
+            api_s.push_back(s);
+            api.push_back(s.c_str());
+        }
 
-            for (size_t j=0; j<kernels.size(); ++j)
+        // determine if module has barrier() function calls
+        bool hasBarrier = false;
+        llvm::CallInst* call;
+        for (llvm::Module::iterator F = dep.linked_module->begin(),
+                EF = dep.linked_module->end(); !hasBarrier && F != EF; ++F)
+            for (llvm::inst_iterator I = inst_begin(*F),
+                                     E = inst_end(*F); I != E; ++I)
             {
-                std::string s = kernels[j]->getName().str();
-                api_s.push_back(s);
-                api.push_back(s.c_str());
-            }
-
-            // determine if module has barrier() function calls
-            bool hasBarrier = false;
-            llvm::CallInst* call;
-            for (llvm::Module::iterator F = dep.linked_module->begin(),
-                    EF = dep.linked_module->end(); !hasBarrier && F != EF; ++F)
-                for (llvm::inst_iterator I = inst_begin(*F),
-                                         E = inst_end(*F); I != E; ++I)
+                if (!(call = llvm::dyn_cast<llvm::CallInst>(&*I))) continue;
+                if (!call->getCalledFunction())                    continue;
+                std::string name(call->getCalledFunction()->getName());
+                if (name == "barrier")
                 {
-                    if (!(call = llvm::dyn_cast<llvm::CallInst>(&*I))) continue;
-                    if (!call->getCalledFunction())                    continue;
-                    std::string name(call->getCalledFunction()->getName());
-                    if (name == "barrier")
-                    {
-                        hasBarrier = true;
-                        break;
-                    }
+                    hasBarrier = true;
+                    break;
                 }
+            }
 
-            // Optimize code
-            llvm::PassManager *manager = new llvm::PassManager();
+        // Optimize code
+        llvm::PassManager *manager = new llvm::PassManager();
 
-            // Common passes (primary goal : remove unused stdlib functions)
-            manager->add(llvm::createTypeBasedAliasAnalysisPass());
-            manager->add(llvm::createBasicAliasAnalysisPass());
-            manager->add(llvm::createInternalizePass(api));
-            manager->add(llvm::createIPSCCPPass());
-            manager->add(llvm::createGlobalOptimizerPass());
-            manager->add(llvm::createConstantMergePass());
-            manager->add(llvm::createAlwaysInlinerPass());
+        // Common passes (primary goal : remove unused stdlib functions)
+        manager->add(llvm::createTypeBasedAliasAnalysisPass());
+        manager->add(llvm::createBasicAliasAnalysisPass());
+        manager->add(llvm::createInternalizePass(api));
+        manager->add(llvm::createIPSCCPPass());
+        manager->add(llvm::createGlobalOptimizerPass());
+        manager->add(llvm::createConstantMergePass());
+        manager->add(llvm::createAlwaysInlinerPass());
 
-            dep.program->createOptimizationPasses(manager,
-                                       dep.compiler->optimize(), hasBarrier);
+        dep.program->createOptimizationPasses(manager,
+                                   dep.compiler->optimize(), hasBarrier);
 
-            manager->add(llvm::createGlobalDCEPass());
+        manager->add(llvm::createGlobalDCEPass());
 
-            manager->run(*dep.linked_module);
-            delete manager;
-        }
+        manager->run(*dep.linked_module);
+        delete manager;
+    }
 
-        // Now that the LLVM module is built, build the device-specific
-        // representation
-        if (!dep.program->build(dep.linked_module, &dep.unlinked_binary))
-        {
-            return CL_BUILD_PROGRAM_FAILURE;
-        }
+    return CL_SUCCESS;
+}
+
+cl_int Program::link(const char *options,
+                     void (CL_CALLBACK *pfn_notify)(cl_program program,
+                                                    void *user_data),
+                     void *user_data, cl_uint num_devices,
+                     DeviceInterface * const * device_list,
+                     cl_uint num_input_programs,
+		     const cl_program * input_programs)
+{
+    cl_int result = beginBuild(options, false);
+
+    if (result != CL_SUCCESS)
+        return result;
+
+    if (pfn_notify)
+    {
+        BuildJob *job = new BuildJob;
+
+        job->step = BuildJob::Link;
+        job->has_options = (options != 0);
+        job->options = options ? options : "";
+        job->pfn_notify = pfn_notify;
+        job->user_data = user_data;
+        job->devices.assign(device_list, device_list + num_devices);
+        job->inputs.assign(input_programs, input_programs + num_input_programs);
+
+        return queueBuildJob(job);
     }
 
+    result = linkNow(options, num_devices, device_list, num_input_programs,
+                     input_programs);
+    endBuild();
+
+    return result;
+}
+
+cl_int Program::linkNow(const char *options, cl_uint num_devices,
+                        DeviceInterface * const * device_list,
+                        cl_uint num_input_programs,
+                        const cl_program * input_programs)
+{
+    bool linkAsLibrary = false;
+
+    ContextsLock lock(this);
+
+    p_state = Failed;
+
+    if (options && strstr(options, "-create-library")) {
+        linkAsLibrary = true;
+    }
+
+    // Set device infos
+    if (!p_device_dependent.size())
+    {
+        setDevices(num_devices, device_list);
+    }
+
+    // Binaries may differ between the devices, only sources are shared
+    std::vector<DeviceGroup> groups = deviceGroups(device_list,
+                                                   p_type == Source);
+
+    for (size_t i=0; i<groups.size(); ++i)
+    {
+        // A new program gets its own context, the modules of a program
+        // built from source are already in the one of their compilation
+        if (!groups[i].deps[0]->linked_module)
+            groups[i].context = createContext();
+
+        groups[i].linkAsLibrary = linkAsLibrary;
+        groups[i].num_input_programs = num_input_programs;
+        groups[i].input_programs = input_programs;
+    }
+
+    runDeviceGroups(groups, &linkGroup);
+
+    for (size_t i=0; i<groups.size(); ++i)
+        if (groups[i].result != CL_SUCCESS)
+            return groups[i].result;
+
     p_state = (linkAsLibrary? Compiled : Built);
     p_binary_type = (linkAsLibrary? CL_PROGRAM_BINARY_TYPE_LIBRARY :
                       CL_PROGRAM_BINARY_TYPE_EXECUTABLE);
+
+    // The device programs now use the modules of this build only
+    releaseUnusedContexts();
+
     return CL_SUCCESS;
 }
 
@@ -891,18 +1683,69 @@ cl_int Program::build(const char *options,
                                                      void *user_data),
                       void *user_data, cl_uint num_devices,
                       DeviceInterface * const*device_list)
+{
+    cl_int result = beginBuild(options, true);
+
+    if (result != CL_SUCCESS)
+        return result;
+
+    if (pfn_notify)
+    {
+        BuildJob *job = new BuildJob;
+
+        job->step = BuildJob::Build;
+        job->has_options = (options != 0);
+        job->options = options ? options : "";
+        job->pfn_notify = pfn_notify;
+        job->user_data = user_data;
+        job->devices.assign(device_list, device_list + num_devices);
+
+        return queueBuildJob(job);
+    }
+
+    result = buildNow(options, num_devices, device_list);
+    endBuild();
+
+    return result;
+}
+
+cl_int Program::buildNow(const char *options, cl_uint num_devices,
+                         DeviceInterface * const*device_list)
 {
     cl_int result;
+    std::string build_opts = options ? options : std::string();
+
+    ContextsLock lock(this);
 
-    result = compile(options, pfn_notify, user_data, num_devices, device_list,
-                     0, NULL, NULL);
+    // Reuse a previous build of the same source, if all the devices kept one
+    if (p_type == Source && getNumKernels() == 0)
+    {
+        if (!p_device_dependent.size())
+            setDevices(num_devices, device_list);
+
+        if (loadCachedBuilds(build_opts))
+            return CL_SUCCESS;
+    }
+
+    result = compileNow(options, num_devices, device_list, 0, NULL, NULL);
 
     if (result == CL_SUCCESS) {
         cl_uint num_input_programs = 1;
         const cl_program input_programs[] = { desc(this) };
 
-        result = link(options, pfn_notify, user_data, num_devices,
-                      device_list, num_input_programs, input_programs);
+        result = linkNow(options, num_devices, device_list,
+                         num_input_programs, input_programs);
+    }
+
+    // Let the devices keep the linked program for the next builds
+    if (result == CL_SUCCESS && p_type == Source)
+    {
+        for (size_t i=0; i<p_device_dependent.size(); ++i)
+        {
+            DeviceDependent &dep = p_device_dependent[i];
+            dep.program->cacheBuild(p_source, build_opts, dep.linked_module,
+                                    dep.compiler->log());
+        }
     }
     else if (result == CL_COMPILE_PROGRAM_FAILURE) {
         result = CL_BUILD_PROGRAM_FAILURE;  // clBuildProgram expects this error code.
@@ -911,6 +1754,68 @@ cl_int Program::build(const char *options,
     return result;
 }
 
+bool Program::loadCachedBuilds(const std::string &options)
+{
+    std::vector<llvm::Module *> modules;
+    std::vector<std::string> logs(p_device_dependent.size());
+
+    for (size_t i=0; i<p_device_dependent.size(); ++i)
+    {
+        DeviceDependent &dep = p_device_dependent[i];
+        llvm::Module *module = dep.program->cachedBuild(p_source, options,
+                                                        *createContext(),
+                                                        logs[i]);
+
+        if (!module)
+        {
+            for (size_t j=0; j<modules.size(); ++j)
+                delete modules[j];
+
+            return false;
+        }
+
+        modules.push_back(module);
+    }
+
+    for (size_t i=0; i<p_device_dependent.size(); ++i)
+    {
+        DeviceDependent &dep = p_device_dependent[i];
+
+        dep.linked_module = modules[i];
+        dep.is_native_binary = false;
+        dep.compiler->reuse(options, logs[i]);
+
+        // Binary of the program, as returned by CL_PROGRAM_BINARIES
+        dep.unlinked_binary.clear();
+        llvm::raw_string_ostream ostream(dep.unlinked_binary);
+        llvm::WriteBitcodeToFile(dep.linked_module, ostream);
+        ostream.flush();
+
+        if (!dep.program->build(dep.linked_module, &dep.unlinked_binary))
+        {
+            p_state = Failed;
+            return false;
+        }
+    }
+
+    p_state = Built;
+    p_binary_type = CL_PROGRAM_BINARY_TYPE_EXECUTABLE;
+
+    releaseUnusedContexts();
+
+    return true;
+}
+
+void Program::lockContexts()
+{
+    pthread_mutex_lock(&p_contexts_mutex);
+}
+
+void Program::unlockContexts()
+{
+    pthread_mutex_unlock(&p_contexts_mutex);
+}
+
 Program::Type Program::type() const
 {
     return p_type;
@@ -918,7 +1823,7 @@ Program::Type Program::type() const
 
 Program::State Program::state() const
 {
-    return p_state;
+    return p_building ? Building : p_state;
 }
 
 cl_int Program::info(cl_program_info param_name,
@@ -938,6 +1843,13 @@ cl_int Program::info(cl_program_info param_name,
         size_t size_t_var;
     };
 
+    // The devices, binaries and kernels are changed by the builds, read them
+    // once no build is running. The other fields do not depend on the builds.
+    bool from_build = (param_name != CL_PROGRAM_REFERENCE_COUNT &&
+                       param_name != CL_PROGRAM_CONTEXT &&
+                       param_name != CL_PROGRAM_SOURCE);
+    ContextsLock lock(const_cast<Program *>(this), from_build);
+
     switch (param_name)
     {
         case CL_PROGRAM_REFERENCE_COUNT:
@@ -1073,7 +1985,13 @@ cl_int Program::buildInfo(DeviceInterface *device,
 {
     const void *value = 0;
     size_t value_length = 0;
-    const DeviceDependent &dep = deviceDependent(device);
+
+    // The devices and their logs are changed by the builds, read them once
+    // no build is running. The status of a running one is read without lock.
+    bool building = p_building;
+    ContextsLock lock(const_cast<Program *>(this), !building);
+    const DeviceDependent &dep =
+        building ? p_null_device_dependent : deviceDependent(device);
 
     union {
         cl_build_status cl_build_status_var;
@@ -1083,7 +2001,7 @@ cl_int Program::buildInfo(DeviceInterface *device,
     switch (param_name)
     {
         case CL_PROGRAM_BUILD_STATUS:
-            switch (p_state)
+            switch (state())
             {
                 case Empty:
                 case Loaded:
@@ -1096,16 +2014,30 @@ cl_int Program::buildInfo(DeviceInterface *device,
                 case Failed:
                     SIMPLE_ASSIGN(cl_build_status, CL_BUILD_ERROR);
                     break;
-                // TODO: CL_BUILD_IN_PROGRESS
+                case Building:
+                    SIMPLE_ASSIGN(cl_build_status, CL_BUILD_IN_PROGRESS);
+                    break;
             }
             break;
 
         case CL_PROGRAM_BUILD_OPTIONS:
+            if (!dep.compiler)
+            {
+                value = "";
+                value_length = 1;
+                break;
+            }
             value = dep.compiler->options().c_str();
             value_length = dep.compiler->options().size() + 1;
             break;
 
         case CL_PROGRAM_BUILD_LOG:
+            if (!dep.compiler)
+            {
+                value = "";
+                value_length = 1;
+                break;
+            }
             value = dep.compiler->log().c_str();
             value_length = dep.compiler->log().size() + 1;
             break;
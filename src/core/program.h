@@ -38,6 +38,7 @@
 #include "icd.h"
 
 #include <CL/cl.h>
+#include <pthread.h>
 #include <string>
 #include <vector>
 
@@ -50,6 +51,7 @@ struct _cl_program: public Coal::descriptor<Coal::Program, _cl_program> {};
 
 namespace llvm
 {
+    class LLVMContext;
     class MemoryBuffer;
     class Module;
     class Function;
@@ -103,6 +105,7 @@ class Program : public _cl_program, public Object
             Built,   /*!< Built */
             Compiled,/*!< Compiled */
             Failed,  /*!< Build failed */
+            Building,/*!< Being built, compiled or linked in the background */
         };
 
         /**
@@ -152,7 +155,9 @@ class Program : public _cl_program, public Object
          *
          * \param options options to pass to the compiler, see the OpenCL
          *        specification.
-         * \param pfn_notify callback function called at the end of the build
+         * \param pfn_notify callback function called at the end of the build.
+         *        If given, the compilation is done by a build thread and this
+         *        function returns once it is queued, see \c Coal::Program::build()
          * \param user_data user data given to \p pfn_notify
          * \param num_devices number of devices for which binaries are being
          *        built. If it's a source-based program, this can be 0.
@@ -179,7 +184,9 @@ class Program : public _cl_program, public Object
          *
          * \param options options to pass to the linker, see the OpenCL
          *        specification.
-         * \param pfn_notify callback function called at the end of the build
+         * \param pfn_notify callback function called at the end of the build.
+         *        If given, the link is done by a build thread and this
+         *        function returns once it is queued, see \c Coal::Program::build()
          * \param user_data user data given to \p pfn_notify
          * \param num_devices number of devices for which binaries are being
          *        built.
@@ -203,6 +210,26 @@ class Program : public _cl_program, public Object
          * resulting binaries if the devices for which they are compiled asks
          * \c Coal::Program to do so, using \c Coal::DeviceProgram::linkStdLib().
          *
+         * Programs built from source are reused from the devices caches,
+         * when all of them have one, see \c Coal::DeviceProgram::cachedBuild().
+         *
+         * The devices of the same type are compiled and linked once, the
+         * different types in parallel, each in its own \c llvm::LLVMContext.
+         *
+         * When \p pfn_notify is given, the build is queued to a pool of build
+         * threads shared by all the programs and this function returns
+         * \c CL_SUCCESS at once. The program, and the input programs of a
+         * link, are retained until the build is done. The program is in the
+         * \c Building state meanwhile, then \p pfn_notify is called by the
+         * build thread. Errors are then reported by the state of the program
+         * and its build log. Each program has its own LLVM contexts, see
+         * \c lockContexts(), so that different programs build in parallel.
+         *
+         * A program is built, compiled or linked once at a time: meanwhile,
+         * \c build(), \c compile() and \c link() return
+         * \c CL_INVALID_OPERATION. Attached kernels and invalid options are
+         * reported at once, also when \p pfn_notify is given.
+         *
          * \param options options to pass to the compiler, see the OpenCL
          *        specification.
          * \param pfn_notify callback function called at the end of the build
@@ -284,12 +311,27 @@ class Program : public _cl_program, public Object
 
         std::string source() { return p_source; }
 
+        /**
+         * \brief Lock the LLVM contexts of the program
+         *
+         * An LLVM context must not be used by two threads at once. The
+         * builds of the program, the creation of its kernels and the code
+         * generation of its kernels by the JIT take this recursive lock, the
+         * contexts of the program being used by no other program.
+         */
+        void lockContexts();
+        void unlockContexts();  /*!< \brief Unlock the LLVM contexts, see \c lockContexts() */
+
         std::vector<Kernel *> kernelList;
         std::vector<Kernel *> kernelReleasedList;
 
+        struct BuildJob;                    /*!< \brief Build queued to the build threads */
+        static void *buildThread(void *);   /*!< \brief Body of the build threads */
+
     private:
         Type        p_type;
         State       p_state;
+        volatile int p_building;    /*!< \brief Being built, compiled or linked, see \c build() */
         cl_program_binary_type p_binary_type;
         std::string p_source;
 
@@ -305,12 +347,44 @@ class Program : public _cl_program, public Object
 
         std::vector<DeviceDependent> p_device_dependent;
         DeviceDependent              p_null_device_dependent;
+        std::vector<llvm::LLVMContext *> p_contexts;   /*!< \brief Contexts of the modules built */
+        pthread_mutex_t p_contexts_mutex;
+
+        struct DeviceGroup;
 
         void setDevices(cl_uint num_devices, DeviceInterface * const*devices);
 	void resetDeviceDependent();
         DeviceDependent &deviceDependent(DeviceInterface *device);
         const DeviceDependent &deviceDependent(DeviceInterface *device) const;
         std::vector<llvm::Function *> kernelFunctions(DeviceDependent &dep);
+        bool loadCachedBuilds(const std::string &options);
+        std::vector<DeviceGroup> deviceGroups(DeviceInterface * const *device_list,
+                                              bool share);
+        llvm::LLVMContext *createContext();
+        void releaseUnusedContexts();   /*!< \brief Delete the contexts no module of the devices lives in, once the device programs are rebuilt */
+        void runDeviceGroups(std::vector<DeviceGroup> &groups,
+                             void *(*run)(void *));
+        cl_int linkDevice(DeviceDependent &dep, DeviceInterface *device,
+                          llvm::LLVMContext *context, bool linkAsLibrary,
+                          cl_uint num_input_programs,
+                          const cl_program *input_programs);
+        static void *compileGroup(void *);
+        static void *linkGroup(void *);
+        cl_int compileNow(const char *options, cl_uint num_devices,
+                          DeviceInterface * const*device_list,
+                          cl_uint num_input_headers,
+                          const cl_program *input_headers,
+                          const char **header_include_names);
+        cl_int linkNow(const char *options, cl_uint num_devices,
+                       DeviceInterface * const * device_list,
+                       cl_uint num_input_programs,
+                       const cl_program * input_programs);
+        cl_int buildNow(const char *options, cl_uint num_devices,
+                        DeviceInterface * const*device_list);
+        cl_int beginBuild(const char *options, bool compiles);
+        void endBuild();
+        cl_int queueBuildJob(BuildJob *job);
+        void runBuildJob(BuildJob *job);
 };
 
 }
@@ -35,6 +35,20 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <iostream>
+#include <string>
 
 #include "util.h"
 
@@ -66,3 +80,382 @@ uint32_t parse_file_line_value(const char *fname, const char *sname,
     return val;
 }
 
+/******************************************************************************
+* Take an exclusive flock on a lock file, waiting for it, return its fd
+******************************************************************************/
+int file_lock_acquire(const char *fname)
+{
+    int lock_fd = open(fname, O_CREAT,
+                     S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH);
+
+    std::string str_fname(fname);
+
+    if (lock_fd < 0)
+    {
+        std::cout << "Can not open lock file " << str_fname << ", Aborting !" << std::endl;
+        exit(-1);
+    }
+
+    int res = flock(lock_fd, LOCK_EX|LOCK_NB);
+    if (res == -1)
+    {
+       if (errno == EWOULDBLOCK)
+       {
+           std::cout << "Waiting on lock " << str_fname << " ..." << std::endl;
+           res = flock(lock_fd, LOCK_EX);
+           if (res == -1)
+           {
+               std::cout << "Error Locking file " << str_fname << ", Aborting !" << std::endl;
+               exit(-1);
+           }
+           else std::cout << "Acquired lock " << str_fname << ", Proceeding!" << std::endl;
+       }
+       else
+       {
+           std::cout << "Error Locking file " << str_fname << ", Aborting !" << std::endl;
+           exit(-1);
+       }
+    }
+
+    return lock_fd;
+}
+
+/******************************************************************************
+* Release a lock taken by file_lock_acquire()
+******************************************************************************/
+void file_lock_release(int lock_fd)
+{
+    if (lock_fd < 0) return;
+
+    flock(lock_fd, LOCK_UN);
+    close(lock_fd);
+}
+
+/******************************************************************************
+* Directory only the user can write
+*
+* Files cached across runs, like programs, must not be planted by another
+* user. A directory is then only used if it is a real directory, not a
+* symbolic link, owned by the user and with no access for the others.
+******************************************************************************/
+static bool private_dir(const std::string &path)
+{
+    struct stat st;
+
+    if (mkdir(path.c_str(), 0700) != 0 && errno != EEXIST)
+        return false;
+
+    if (lstat(path.c_str(), &st) != 0)
+        return false;
+
+    return S_ISDIR(st.st_mode) && st.st_uid == getuid() &&
+           (st.st_mode & 0777) == 0700;
+}
+
+std::string user_private_dir(const char *name)
+{
+    std::string base;
+    const char *xdg  = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+
+    // XDG_CACHE_HOME is ignored if relative, as the spec asks
+    if (xdg && xdg[0] == '/')
+        base = xdg;
+    else if (home && home[0] == '/')
+        base = std::string(home) + "/.cache";
+    else
+        return std::string();
+
+    mkdir(base.c_str(), 0700);
+
+    std::string dir = base + "/ti_opencl";
+
+    if (!private_dir(dir))
+        return std::string();
+
+    dir += "/";
+    dir += name;
+
+    if (!private_dir(dir))
+        return std::string();
+
+    return dir;
+}
+
+/******************************************************************************
+* Pool of small blocks
+*
+* Each thread keeps free lists of blocks, one per multiple of POOL_GRANULE
+* bytes. Objects created and destroyed at a high rate, like events, then
+* reuse blocks without going through malloc.
+*
+* A block starts with a header naming the cache of the thread which
+* allocated it. Blocks freed by another thread, like events enqueued by the
+* application and freed by the workers, go back to that cache through a
+* lock-free list per class: the freeing threads push blocks on it, and the
+* owner takes the whole list at once when its own free list is empty. Taking
+* the whole list, and never a single block, makes the list immune to ABA.
+*
+* The cache of an exiting thread frees its blocks and is kept for the next
+* thread, marked orphaned meanwhile: the blocks then pushed are freed by the
+* pushing thread. Blocks are always malloc()ed with their rounded size, so
+* that any of them can go back to the system when a free list is full.
+******************************************************************************/
+#define POOL_GRANULE     64
+#define POOL_NUM_CLASSES 32     // blocks of up to 2 KB
+#define POOL_MAX_FREE    256    // free blocks kept per class and thread
+#define POOL_HEADER      16     // keeps the blocks aligned as malloc() does
+
+namespace
+{
+struct PoolBlock
+{
+    PoolBlock *next;
+};
+
+struct PoolCache
+{
+    PoolBlock           *free_list[POOL_NUM_CLASSES];
+    unsigned int         num_free[POOL_NUM_CLASSES];
+    PoolBlock * volatile remote[POOL_NUM_CLASSES];  // freed by other threads
+    volatile int         orphaned;
+    PoolCache           *next_orphan;
+};
+
+struct PoolHeader
+{
+    PoolCache *owner;
+};
+
+__thread PoolCache *pool_cache;
+pthread_key_t       pool_key;
+pthread_once_t      pool_key_once = PTHREAD_ONCE_INIT;
+
+// Caches of the exited threads, given to the next threads
+pthread_mutex_t     pool_orphans_mutex = PTHREAD_MUTEX_INITIALIZER;
+PoolCache          *pool_orphans;
+
+// Free a list of blocks, given by their headers
+void pool_free_list(PoolBlock *block)
+{
+    while (block)
+    {
+        PoolBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+}
+
+void pool_drain_remote(PoolCache *cache)
+{
+    for (unsigned int i = 0; i < POOL_NUM_CLASSES; ++i)
+        pool_free_list(__sync_lock_test_and_set(&cache->remote[i],
+                                                (PoolBlock *)0));
+}
+
+void pool_cache_destroy(void *data)
+{
+    PoolCache *cache = (PoolCache *)data;
+
+    // The pushers see it once it is set, and free their blocks themselves
+    __sync_lock_test_and_set(&cache->orphaned, 1);
+    __sync_synchronize();
+
+    for (unsigned int i = 0; i < POOL_NUM_CLASSES; ++i)
+    {
+        pool_free_list(cache->free_list[i]);
+        cache->free_list[i] = 0;
+        cache->num_free[i] = 0;
+    }
+
+    pool_drain_remote(cache);
+
+    pthread_mutex_lock(&pool_orphans_mutex);
+    cache->next_orphan = pool_orphans;
+    pool_orphans = cache;
+    pthread_mutex_unlock(&pool_orphans_mutex);
+
+    pool_cache = NULL;
+}
+
+void pool_key_create()
+{
+    pthread_key_create(&pool_key, pool_cache_destroy);
+}
+
+// Free lists of the calling thread, given back when it exits
+PoolCache *pool_get_cache()
+{
+    if (!pool_cache)
+    {
+        pthread_once(&pool_key_once, pool_key_create);
+
+        pthread_mutex_lock(&pool_orphans_mutex);
+        pool_cache = pool_orphans;
+        if (pool_cache) pool_orphans = pool_cache->next_orphan;
+        pthread_mutex_unlock(&pool_orphans_mutex);
+
+        if (pool_cache)
+            __sync_lock_release(&pool_cache->orphaned);
+        else
+            pool_cache = (PoolCache *)calloc(1, sizeof(PoolCache));
+
+        if (pool_cache)
+            pthread_setspecific(pool_key, pool_cache);
+    }
+
+    return pool_cache;
+}
+
+// Class of a block, its size with the header in granules
+size_t pool_class(size_t size)
+{
+    return (size + POOL_HEADER + POOL_GRANULE - 1) / POOL_GRANULE;
+}
+}
+
+void *pool_alloc(size_t size)
+{
+    size_t cls = pool_class(size);
+
+    if (cls > POOL_NUM_CLASSES)
+        return malloc(size);
+
+    PoolCache *cache = pool_get_cache();
+    PoolBlock *block = 0;
+
+    if (cache)
+    {
+        // Take back the blocks other threads freed
+        if (!cache->free_list[cls - 1] && cache->remote[cls - 1])
+        {
+            PoolBlock *list = __sync_lock_test_and_set(&cache->remote[cls - 1],
+                                                       (PoolBlock *)0);
+
+            while (list)
+            {
+                PoolBlock *next = list->next;
+
+                if (cache->num_free[cls - 1] < POOL_MAX_FREE)
+                {
+                    list->next = cache->free_list[cls - 1];
+                    cache->free_list[cls - 1] = list;
+                    cache->num_free[cls - 1]++;
+                }
+                else
+                    free(list);
+
+                list = next;
+            }
+        }
+
+        block = cache->free_list[cls - 1];
+
+        if (block)
+        {
+            cache->free_list[cls - 1] = block->next;
+            cache->num_free[cls - 1]--;
+        }
+    }
+
+    if (!block)
+        block = (PoolBlock *)malloc(cls * POOL_GRANULE);
+
+    if (!block)
+        return 0;
+
+    ((PoolHeader *)block)->owner = cache;
+
+    return (char *)block + POOL_HEADER;
+}
+
+void pool_free(void *ptr, size_t size)
+{
+    if (!ptr) return;
+
+    size_t cls = pool_class(size);
+
+    if (cls > POOL_NUM_CLASSES)
+    {
+        free(ptr);
+        return;
+    }
+
+    PoolBlock *block = (PoolBlock *)((char *)ptr - POOL_HEADER);
+    PoolCache *owner = ((PoolHeader *)block)->owner;
+
+    if (!owner)
+    {
+        free(block);
+        return;
+    }
+
+    if (owner != pool_cache)
+    {
+        // Give it back to the thread which allocated it
+        PoolBlock *head;
+
+        do
+        {
+            head = owner->remote[cls - 1];
+            block->next = head;
+        }
+        while (!__sync_bool_compare_and_swap(&owner->remote[cls - 1],
+                                             head, block));
+
+        // The owner exited, nobody takes the list
+        if (owner->orphaned)
+            pool_drain_remote(owner);
+
+        return;
+    }
+
+    if (owner->num_free[cls - 1] >= POOL_MAX_FREE)
+    {
+        free(block);
+        return;
+    }
+
+    block->next = owner->free_list[cls - 1];
+    owner->free_list[cls - 1] = block;
+    owner->num_free[cls - 1]++;
+}
+
+/******************************************************************************
+* Adaptive waits
+******************************************************************************/
+static unsigned int   spin_us      = 20;
+static pthread_once_t spin_us_once = PTHREAD_ONCE_INIT;
+
+static void read_spin_us()
+{
+    const char *value = getenv("TI_OCL_WAIT_SPIN_US");
+
+    if (value)
+        spin_us = strtoul(value, NULL, 10);
+}
+
+unsigned int wait_spin_us()
+{
+    pthread_once(&spin_us_once, read_spin_us);
+    return spin_us;
+}
+
+uint64_t time_now_us()
+{
+    struct timespec tp;
+
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+
+    return (uint64_t)tp.tv_sec * 1000000 + tp.tv_nsec / 1000;
+}
+
+void futex_wait(volatile int *addr, int val)
+{
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+void futex_wake(volatile int *addr)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
@@ -33,9 +33,80 @@
 #ifndef _UTIL_H
 #define _UTIL_H
 
+#include <stdint.h>
+#include <stddef.h>
+
+#include <string>
+
 // Parse first line in a file, read integer immediately following a string
 uint32_t parse_file_line_value(const char *fname, const char *sname,
                                uint32_t default_val);
 
+// Take an exclusive flock on a lock file, waiting for it, return its fd
+int file_lock_acquire(const char *fname);
+
+// Release a lock taken by file_lock_acquire()
+void file_lock_release(int lock_fd);
+
+// Directory only the user can write, $XDG_CACHE_HOME/ti_opencl/<name> or
+// $HOME/.cache/ti_opencl/<name>, created if needed, empty if none is usable
+std::string user_private_dir(const char *name);
+
+// Allocate a small block from free lists of the calling thread, 0 if no memory
+void *pool_alloc(size_t size);
+
+// Give back a block of pool_alloc(), size must be the one it was allocated with.
+// Any thread can free it, it goes back to the thread which allocated it.
+void pool_free(void *ptr, size_t size);
+
+// Microseconds a waiting thread polls before sleeping, TI_OCL_WAIT_SPIN_US
+unsigned int wait_spin_us();
+
+// Monotonic time in microseconds
+uint64_t time_now_us();
+
+// Sleep while *addr holds val, may return spuriously
+void futex_wait(volatile int *addr, int val);
+
+// Wake all the threads sleeping in futex_wait() on addr
+void futex_wake(volatile int *addr);
+
+// Tell the CPU we are busy-waiting
+static inline void cpu_relax()
+{
+#if defined(__i386__) || defined(__x86_64__)
+    __asm__ __volatile__("pause" ::: "memory");
+#elif defined(__arm__) || defined(__aarch64__)
+    __asm__ __volatile__("yield" ::: "memory");
+#else
+    __sync_synchronize();
+#endif
+}
+
+// Poll cond() for up to wait_spin_us() microseconds, true once it holds.
+// Commands shorter than the wake-up of a sleeping thread are then waited
+// for without sleeping.
+template <typename Cond>
+bool spin_until(Cond cond)
+{
+    unsigned int spin_us = wait_spin_us();
+
+    if (cond()) return true;
+    if (spin_us == 0) return false;
+
+    uint64_t deadline = time_now_us() + spin_us;
+
+    for (unsigned int i = 1; ; ++i)
+    {
+        cpu_relax();
+
+        if (cond()) return true;
+
+        // Reading the clock costs more than a poll, do it once in a while
+        if ((i & 63) == 0 && time_now_us() >= deadline)
+            return false;
+    }
+}
+
 #endif // _UTIL_H
 
@@ -31,8 +31,10 @@
 
 #include "test_commandqueue.h"
 #include "CL/cl.h"
+#include "CL/cl_ext.h"
 
 #include <unistd.h>
+#include <pthread.h>
 
 START_TEST (test_create_command_queue)
 {
@@ -1002,6 +1004,515 @@ START_TEST (test_misc_events)
 }
 END_TEST
 
+static void *complete_user_events(void *arg)
+{
+    cl_event *uevents = (cl_event *)arg;
+
+    // Late enough for clWaitForEvents() to sleep
+    usleep(20000);
+    clSetUserEventStatus(uevents[0], CL_COMPLETE);
+    usleep(20000);
+    clSetUserEventStatus(uevents[1], CL_COMPLETE);
+
+    return 0;
+}
+
+START_TEST (test_wait_for_events)
+{
+    cl_platform_id platform      = 0;
+    cl_uint        num_platforms = 0;
+    clGetPlatformIDs(1, &platform, &num_platforms);
+
+    cl_device_id device;
+    cl_context ctx;
+    cl_command_queue queue;
+    cl_mem buf;
+    cl_int result;
+    cl_event events[3];
+    cl_int status;
+    pthread_t thread;
+    int data[16];
+
+    result = clGetDeviceIDs(platform, CL_DEVICE_TYPE_DEFAULT, 1, &device, 0);
+    fail_if(
+        result != CL_SUCCESS,
+        "unable to get the default device"
+    );
+
+    ctx = clCreateContext(0, 1, &device, 0, 0, &result);
+    fail_if(
+        result != CL_SUCCESS || ctx == 0,
+        "unable to create a valid context"
+    );
+
+    queue = clCreateCommandQueue(ctx, device, 0, &result);
+    fail_if(
+        result != CL_SUCCESS || queue == 0,
+        "cannot create a command queue"
+    );
+
+    buf = clCreateBuffer(ctx, CL_MEM_READ_WRITE, sizeof(data), 0, &result);
+    fail_if(
+        result != CL_SUCCESS,
+        "cannot create a buffer"
+    );
+
+    /*
+     * Two user events completed by another thread, and a write waiting for
+     * the first one. clWaitForEvents() waits once for the three of them.
+     */
+    for (int i = 0; i < 2; ++i)
+    {
+        events[i] = clCreateUserEvent(ctx, &result);
+        fail_if(
+            result != CL_SUCCESS,
+            "unable to create an user event"
+        );
+    }
+
+    result = clEnqueueWriteBuffer(queue, buf, CL_FALSE, 0, sizeof(data), data,
+                                  1, &events[0], &events[2]);
+    fail_if(
+        result != CL_SUCCESS,
+        "unable to enqueue a write"
+    );
+
+    pthread_create(&thread, 0, complete_user_events, events);
+
+    result = clWaitForEvents(3, events);
+    fail_if(
+        result != CL_SUCCESS,
+        "unable to wait for the events"
+    );
+
+    for (int i = 0; i < 3; ++i)
+    {
+        result = clGetEventInfo(events[i], CL_EVENT_COMMAND_EXECUTION_STATUS,
+                                sizeof(cl_int), &status, 0);
+        fail_if(
+            result != CL_SUCCESS || status != CL_COMPLETE,
+            "the events waited for must be complete"
+        );
+    }
+
+    pthread_join(thread, 0);
+
+    // Events already complete are not waited for
+    result = clWaitForEvents(3, events);
+    fail_if(
+        result != CL_SUCCESS,
+        "unable to wait for complete events"
+    );
+
+    for (int i = 0; i < 3; ++i)
+        clReleaseEvent(events[i]);
+
+    clReleaseMemObject(buf);
+    clReleaseCommandQueue(queue);
+    clReleaseContext(ctx);
+}
+END_TEST
+
+START_TEST (test_ooo_barrier)
+{
+    cl_platform_id platform      = 0;
+    cl_uint        num_platforms = 0;
+    clGetPlatformIDs(1, &platform, &num_platforms);
+
+    cl_device_id device;
+    cl_context ctx;
+    cl_command_queue queue;
+    cl_mem buf;
+    cl_int result;
+    cl_event uevent, write, marker;
+    cl_int status;
+    int data[16];
+
+    result = clGetDeviceIDs(platform, CL_DEVICE_TYPE_DEFAULT, 1, &device, 0);
+    fail_if(
+        result != CL_SUCCESS,
+        "unable to get the default device"
+    );
+
+    ctx = clCreateContext(0, 1, &device, 0, 0, &result);
+    fail_if(
+        result != CL_SUCCESS || ctx == 0,
+        "unable to create a valid context"
+    );
+
+    queue = clCreateCommandQueue(ctx, device,
+                                 CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE,
+                                 &result);
+    fail_if(
+        result != CL_SUCCESS || queue == 0,
+        "cannot create an out-of-order command queue"
+    );
+
+    buf = clCreateBuffer(ctx, CL_MEM_READ_WRITE, sizeof(data), 0, &result);
+    fail_if(
+        result != CL_SUCCESS,
+        "cannot create a buffer"
+    );
+
+    /*
+     * A write waiting for an user event, then a barrier and a marker. The
+     * marker must wait for the write, through the barrier.
+     */
+    uevent = clCreateUserEvent(ctx, &result);
+    fail_if(
+        result != CL_SUCCESS,
+        "unable to create an user event"
+    );
+
+    result = clEnqueueWriteBuffer(queue, buf, CL_FALSE, 0, sizeof(data), data,
+                                  1, &uevent, &write);
+    fail_if(
+        result != CL_SUCCESS,
+        "unable to enqueue a write"
+    );
+
+    result = clEnqueueBarrier(queue);
+    fail_if(
+        result != CL_SUCCESS,
+        "unable to enqueue a barrier"
+    );
+
+    result = clEnqueueMarker(queue, &marker);
+    fail_if(
+        result != CL_SUCCESS,
+        "unable to enqueue a marker"
+    );
+
+    result = clGetEventInfo(marker, CL_EVENT_COMMAND_EXECUTION_STATUS,
+                            sizeof(cl_int), &status, 0);
+    fail_if(
+        result != CL_SUCCESS || status != CL_QUEUED,
+        "the marker must wait for the barrier"
+    );
+
+    clSetUserEventStatus(uevent, CL_COMPLETE);
+    clFinish(queue);
+
+    result = clGetEventInfo(marker, CL_EVENT_COMMAND_EXECUTION_STATUS,
+                            sizeof(cl_int), &status, 0);
+    fail_if(
+        result != CL_SUCCESS || status != CL_COMPLETE,
+        "the marker must be complete once the write is"
+    );
+
+    clReleaseEvent(uevent);
+    clReleaseEvent(write);
+    clReleaseEvent(marker);
+
+    /*
+     * The same with a failed user event: the write, the barrier and the
+     * marker are terminated, and clFinish() returns.
+     */
+    uevent = clCreateUserEvent(ctx, &result);
+    fail_if(
+        result != CL_SUCCESS,
+        "unable to create an user event"
+    );
+
+    result = clEnqueueWriteBuffer(queue, buf, CL_FALSE, 0, sizeof(data), data,
+                                  1, &uevent, &write);
+    fail_if(
+        result != CL_SUCCESS,
+        "unable to enqueue a write"
+    );
+
+    result = clEnqueueBarrier(queue);
+    fail_if(
+        result != CL_SUCCESS,
+        "unable to enqueue a barrier"
+    );
+
+    result = clEnqueueMarker(queue, &marker);
+    fail_if(
+        result != CL_SUCCESS,
+        "unable to enqueue a marker"
+    );
+
+    clSetUserEventStatus(uevent, -1);
+    clFinish(queue);
+
+    result = clGetEventInfo(write, CL_EVENT_COMMAND_EXECUTION_STATUS,
+                            sizeof(cl_int), &status, 0);
+    fail_if(
+        result != CL_SUCCESS || status >= 0,
+        "the write must be terminated"
+    );
+
+    result = clGetEventInfo(marker, CL_EVENT_COMMAND_EXECUTION_STATUS,
+                            sizeof(cl_int), &status, 0);
+    fail_if(
+        result != CL_SUCCESS || status >= 0,
+        "the marker after the barrier must be terminated"
+    );
+
+    clReleaseEvent(uevent);
+    clReleaseEvent(write);
+    clReleaseEvent(marker);
+    clReleaseMemObject(buf);
+    clReleaseCommandQueue(queue);
+    clReleaseContext(ctx);
+}
+END_TEST
+
+static const char graph_source[] =
+    "__kernel void fill(__global int *buf, int value) {\n"
+    "    buf[get_global_id(0)] = value;\n"
+    "}\n";
+
+static bool buffer_holds(cl_command_queue queue, cl_mem buf, int value)
+{
+    int data[64];
+
+    if (clEnqueueReadBuffer(queue, buf, CL_TRUE, 0, sizeof(data), data,
+                            0, 0, 0) != CL_SUCCESS)
+        return false;
+
+    for (int i = 0; i < 64; ++i)
+        if (data[i] != value)
+            return false;
+
+    return true;
+}
+
+START_TEST (test_command_graph)
+{
+    cl_platform_id platform      = 0;
+    cl_uint        num_platforms = 0;
+    clGetPlatformIDs(1, &platform, &num_platforms);
+
+    cl_device_id device;
+    cl_context ctx;
+    cl_command_queue queue, ooo_queue;
+    cl_program program;
+    cl_kernel kernel;
+    cl_mem buf;
+    cl_command_graph_ti graph;
+    cl_event event, uevent, marker;
+    cl_int result, status;
+    int value, data[64];
+    size_t global_size = 64;
+
+    const char *src = graph_source;
+    size_t program_len = sizeof(graph_source);
+
+    result = clGetDeviceIDs(platform, CL_DEVICE_TYPE_DEFAULT, 1, &device, 0);
+    fail_if(
+        result != CL_SUCCESS,
+        "unable to get the default device"
+    );
+
+    ctx = clCreateContext(0, 1, &device, 0, 0, &result);
+    fail_if(
+        result != CL_SUCCESS || ctx == 0,
+        "unable to create a valid context"
+    );
+
+    queue = clCreateCommandQueue(ctx, device, 0, &result);
+    fail_if(
+        result != CL_SUCCESS || queue == 0,
+        "cannot create a command queue"
+    );
+
+    program = clCreateProgramWithSource(ctx, 1, &src, &program_len, &result);
+    fail_if(
+        result != CL_SUCCESS,
+        "cannot create a program from source"
+    );
+
+    result = clBuildProgram(program, 1, &device, "", 0, 0);
+    fail_if(
+        result != CL_SUCCESS,
+        "cannot build the program"
+    );
+
+    kernel = clCreateKernel(program, "fill", &result);
+    fail_if(
+        result != CL_SUCCESS,
+        "unable to create the kernel"
+    );
+
+    buf = clCreateBuffer(ctx, CL_MEM_READ_WRITE, sizeof(data), 0, &result);
+    fail_if(
+        result != CL_SUCCESS,
+        "cannot create a buffer"
+    );
+
+    uevent = clCreateUserEvent(ctx, &result);
+    fail_if(
+        result != CL_SUCCESS,
+        "unable to create an user event"
+    );
+
+    /*
+     * Record a kernel filling the buffer with 1. The commands that would be
+     * waited for, return an event or wait for events are rejected.
+     */
+    value = 1;
+    clSetKernelArg(kernel, 0, sizeof(cl_mem), &buf);
+    clSetKernelArg(kernel, 1, sizeof(int), &value);
+
+    result = clBeginCommandGraphTI(queue);
+    fail_if(
+        result != CL_SUCCESS,
+        "unable to begin a command graph"
+    );
+
+    result = clBeginCommandGraphTI(queue);
+    fail_if(
+        result != CL_INVALID_OPERATION,
+        "a queue records one graph at a time"
+    );
+
+    result = clEnqueueNDRangeKernel(queue, kernel, 1, 0, &global_size, 0,
+                                    0, 0, 0);
+    fail_if(
+        result != CL_SUCCESS,
+        "unable to record a kernel"
+    );
+
+    result = clEnqueueNDRangeKernel(queue, kernel, 1, 0, &global_size, 0,
+                                    0, 0, &event);
+    fail_if(
+        result != CL_INVALID_OPERATION,
+        "a recorded command cannot return an event"
+    );
+
+    result = clEnqueueNDRangeKernel(queue, kernel, 1, 0, &global_size, 0,
+                                    1, &uevent, 0);
+    fail_if(
+        result != CL_INVALID_OPERATION,
+        "a recorded command cannot wait for events"
+    );
+
+    result = clEnqueueReadBuffer(queue, buf, CL_TRUE, 0, sizeof(data), data,
+                                 0, 0, 0);
+    fail_if(
+        result != CL_INVALID_OPERATION,
+        "a recorded command cannot be blocking"
+    );
+
+    graph = clEndCommandGraphTI(queue, &result);
+    fail_if(
+        result != CL_SUCCESS || graph == 0,
+        "unable to end the command graph"
+    );
+
+    /*
+     * The recorded kernel keeps its arguments: replays fill with 1, even
+     * once the argument is changed.
+     */
+    value = 2;
+    clSetKernelArg(kernel, 1, sizeof(int), &value);
+
+    result = clEnqueueCommandGraphTI(queue, graph, 0, 0, &marker);
+    fail_if(
+        result != CL_SUCCESS,
+        "unable to replay the command graph"
+    );
+
+    result = clWaitForEvents(1, &marker);
+    fail_if(
+        result != CL_SUCCESS,
+        "unable to wait for the marker of the replay"
+    );
+
+    result = clGetEventInfo(marker, CL_EVENT_COMMAND_EXECUTION_STATUS,
+                            sizeof(cl_int), &status, 0);
+    fail_if(
+        result != CL_SUCCESS || status != CL_COMPLETE,
+        "the marker must be complete"
+    );
+
+    fail_if(
+        !buffer_holds(queue, buf, 1),
+        "the replay must use the arguments recorded"
+    );
+
+    clReleaseEvent(marker);
+
+    // Replayed again, after the given event
+    std::memset(data, 0, sizeof(data));
+    clEnqueueWriteBuffer(queue, buf, CL_TRUE, 0, sizeof(data), data,
+                         0, 0, 0);
+
+    result = clEnqueueCommandGraphTI(queue, graph, 1, &uevent, 0);
+    fail_if(
+        result != CL_SUCCESS,
+        "unable to replay the command graph again"
+    );
+
+    clSetUserEventStatus(uevent, CL_COMPLETE);
+    clFinish(queue);
+
+    fail_if(
+        !buffer_holds(queue, buf, 1),
+        "the second replay must fill the buffer"
+    );
+
+    clReleaseCommandGraphTI(graph);
+
+    /*
+     * On an out-of-order queue, the commands of a graph still run in order:
+     * a write of 3 then the kernel, the buffer ends with the value of the
+     * kernel.
+     */
+    ooo_queue = clCreateCommandQueue(ctx, device,
+                                     CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE,
+                                     &result);
+    fail_if(
+        result != CL_SUCCESS || ooo_queue == 0,
+        "cannot create an out-of-order command queue"
+    );
+
+    for (int i = 0; i < 64; ++i)
+        data[i] = 3;
+
+    value = 4;
+    clSetKernelArg(kernel, 1, sizeof(int), &value);
+
+    clBeginCommandGraphTI(ooo_queue);
+    clEnqueueWriteBuffer(ooo_queue, buf, CL_FALSE, 0, sizeof(data), data,
+                         0, 0, 0);
+    clEnqueueNDRangeKernel(ooo_queue, kernel, 1, 0, &global_size, 0, 0, 0, 0);
+    graph = clEndCommandGraphTI(ooo_queue, &result);
+    fail_if(
+        result != CL_SUCCESS || graph == 0,
+        "unable to record on an out-of-order queue"
+    );
+
+    for (int replay = 0; replay < 3; ++replay)
+    {
+        result = clEnqueueCommandGraphTI(ooo_queue, graph, 0, 0, &marker);
+        fail_if(
+            result != CL_SUCCESS,
+            "unable to replay on an out-of-order queue"
+        );
+
+        clWaitForEvents(1, &marker);
+        clReleaseEvent(marker);
+
+        fail_if(
+            !buffer_holds(ooo_queue, buf, 4),
+            "the commands of a graph must run in order"
+        );
+    }
+
+    clReleaseCommandGraphTI(graph);
+    clReleaseEvent(uevent);
+    clReleaseMemObject(buf);
+    clReleaseKernel(kernel);
+    clReleaseProgram(program);
+    clReleaseCommandQueue(ooo_queue);
+    clReleaseCommandQueue(queue);
+    clReleaseContext(ctx);
+}
+END_TEST
+
 TCase *cl_commandqueue_tcase_create(void)
 {
     TCase *tc = NULL;
@@ -1017,5 +1528,8 @@ TCase *cl_commandqueue_tcase_create(void)
     tcase_add_test(tc, test_copy_image_buffer);
 #endif
     tcase_add_test(tc, test_misc_events);
+    tcase_add_test(tc, test_wait_for_events);
+    tcase_add_test(tc, test_ooo_barrier);
+    tcase_add_test(tc, test_command_graph);
     return tc;
 }
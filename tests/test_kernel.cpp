@@ -26,6 +26,7 @@
  */
 
 #include <iostream>
+#include <cstdlib>
 
 #include "test_kernel.h"
 #include "CL/cl.h"
@@ -47,6 +48,25 @@ static const char source[] =
     "    buf[i % 256] = 2 * (i % 256);\n"
     "}\n";
 
+static const char barrier_source[] =
+    "__kernel void exchange(__global int *out, __local int *tmp) {\n"
+    "    int t[512];\n"
+    "    size_t l = get_local_id(0), n = get_local_size(0);\n"
+    "    size_t g = get_global_id(0);\n"
+    "\n"
+    "    for (int k = 0; k < 512; ++k) t[k] = (int)g + k;\n"
+    "    int *p = t + (l & 511);\n"
+    "\n"
+    "    tmp[l] = (int)g;\n"
+    "    barrier(CLK_LOCAL_MEM_FENCE);\n"
+    "    int v = tmp[n - 1 - l];\n"
+    "    barrier(CLK_LOCAL_MEM_FENCE);\n"
+    "    tmp[l] = t[(l + 1) & 511];\n"
+    "    barrier(CLK_LOCAL_MEM_FENCE);\n"
+    "\n"
+    "    out[g] = v + 3 * tmp[(l + 1) % n] + 5 * *p;\n"
+    "}\n";
+
 static void native_kernel(void *args)
 {
     struct ags
@@ -311,11 +331,125 @@ START_TEST (test_native_kernel)
 }
 END_TEST
 
+START_TEST (test_barrier_private)
+{
+    cl_platform_id platform = 0;
+    cl_device_id device;
+    cl_context ctx;
+    cl_command_queue queue;
+    cl_program program;
+    cl_kernel kernel;
+    cl_int result;
+    cl_mem buf;
+
+    const char *src = barrier_source;
+    const size_t global_size = 8192;
+    int *data = (int *)std::malloc(global_size * sizeof(int));
+
+    result = clGetDeviceIDs(platform, CL_DEVICE_TYPE_DEFAULT, 1, &device, 0);
+    fail_if(
+        result != CL_SUCCESS,
+        "unable to get the default device"
+    );
+
+    ctx = clCreateContext(0, 1, &device, 0, 0, &result);
+    fail_if(
+        result != CL_SUCCESS || ctx == 0,
+        "unable to create a valid context"
+    );
+
+    queue = clCreateCommandQueue(ctx, device, 0, &result);
+    fail_if(
+        result != CL_SUCCESS,
+        "unable to create a command queue"
+    );
+
+    program = clCreateProgramWithSource(ctx, 1, &src, 0, &result);
+    fail_if(
+        result != CL_SUCCESS,
+        "cannot create a program from source with sane arguments"
+    );
+
+    result = clBuildProgram(program, 1, &device, "", 0, 0);
+    fail_if(
+        result != CL_SUCCESS,
+        "cannot build a valid program"
+    );
+
+    kernel = clCreateKernel(program, "exchange", &result);
+    fail_if(
+        result != CL_SUCCESS,
+        "unable to create a valid kernel"
+    );
+
+    buf = clCreateBuffer(ctx, CL_MEM_READ_WRITE, global_size * sizeof(int),
+                         0, &result);
+    fail_if(
+        result != CL_SUCCESS,
+        "cannot create a valid read-write buffer"
+    );
+
+    // A small group, and one whose private arrays do not fit on a stack
+    const size_t local_sizes[] = { 16, 4096 };
+
+    for (int s = 0; s < 2; ++s)
+    {
+        size_t n = local_sizes[s];
+
+        result = clSetKernelArg(kernel, 0, sizeof(cl_mem), &buf);
+        result |= clSetKernelArg(kernel, 1, n * sizeof(int), 0);
+        fail_if(
+            result != CL_SUCCESS,
+            "cannot set kernel arguments"
+        );
+
+        result = clEnqueueNDRangeKernel(queue, kernel, 1, 0, &global_size, &n,
+                                        0, 0, 0);
+        fail_if(
+            result != CL_SUCCESS,
+            "unable to queue the kernel"
+        );
+
+        result = clEnqueueReadBuffer(queue, buf, 1, 0,
+                                     global_size * sizeof(int), data, 0, 0, 0);
+        fail_if(
+            result != CL_SUCCESS,
+            "unable to read the buffer"
+        );
+
+        bool ok = true;
+
+        for (size_t g = 0; g < global_size && ok; ++g)
+        {
+            size_t l = g % n, b = g - l, m = (l + 1) % n;
+            int v = (int)(b + n - 1 - l);
+            int next = (int)(b + m) + (int)((m + 1) & 511);
+            int own = (int)g + (int)(l & 511);
+
+            ok = (data[g] == v + 3 * next + 5 * own);
+        }
+
+        fail_if(
+            !ok,
+            "__local and private data must survive the barriers of each work-item"
+        );
+    }
+
+    clReleaseMemObject(buf);
+    clReleaseKernel(kernel);
+    clReleaseProgram(program);
+    clReleaseCommandQueue(queue);
+    clReleaseContext(ctx);
+    std::free(data);
+}
+END_TEST
+
 TCase *cl_kernel_tcase_create(void)
 {
     TCase *tc = NULL;
     tc = tcase_create("kernel");
     tcase_add_test(tc, test_native_kernel);
     tcase_add_test(tc, test_compiled_kernel);
+    tcase_add_test(tc, test_barrier_private);
     return tc;
 }
@@ -26,9 +26,11 @@
  */
 
 #include <iostream>
+#include <cstdlib>
 
 #include "test_mem.h"
 #include "CL/cl.h"
+#include "CL/cl_ext.h"
 
 START_TEST (test_create_buffer)
 {
@@ -332,6 +334,229 @@ START_TEST (test_images)
 }
 END_TEST
 
+START_TEST (test_fill_copy_buffer)
+{
+    cl_context ctx;
+    cl_mem buf, copy;
+    cl_command_queue queue;
+    cl_device_id device;
+    cl_int result;
+
+    // Several transfer chunks of the CPU device, with an odd tail
+    const size_t size = 3 * 1024 * 1024 + 333;
+    unsigned char *data = (unsigned char *)malloc(size);
+    unsigned char *zero = (unsigned char *)calloc(size, 1);
+    unsigned char pattern[128];
+
+    for (unsigned int i = 0; i < sizeof(pattern); ++i)
+        pattern[i] = i * 7 + 1;
+
+    result = clGetDeviceIDs(0, CL_DEVICE_TYPE_DEFAULT, 1, &device, 0);
+    fail_if(
+        result != CL_SUCCESS,
+        "cannot get a device"
+    );
+
+    ctx = clCreateContext(0, 1, &device, 0, 0, &result);
+    fail_if(
+        result != CL_SUCCESS,
+        "unable to create a valid context"
+    );
+
+    queue = clCreateCommandQueue(ctx, device, 0, &result);
+    fail_if(
+        result != CL_SUCCESS || queue == 0,
+        "cannot create a command queue"
+    );
+
+    buf = clCreateBuffer(ctx, CL_MEM_READ_WRITE, size, 0, &result);
+    fail_if(
+        result != CL_SUCCESS,
+        "cannot create a valid read-write buffer"
+    );
+
+    // Every pattern size, at an offset and a length not multiple of a chunk
+    for (size_t pattern_size = 1; pattern_size <= 128; pattern_size *= 2)
+    {
+        size_t offset = 3 * pattern_size;
+        size_t len = ((size - 2 * offset) / pattern_size) * pattern_size;
+
+        result = clEnqueueWriteBuffer(queue, buf, 1, 0, size, zero, 0, 0, 0);
+        fail_if(
+            result != CL_SUCCESS,
+            "unable to clear the buffer"
+        );
+
+        result = clEnqueueFillBuffer(queue, buf, pattern, pattern_size,
+                                     offset, len, 0, 0, 0);
+        fail_if(
+            result != CL_SUCCESS,
+            "unable to fill the buffer"
+        );
+
+        result = clEnqueueReadBuffer(queue, buf, 1, 0, size, data, 0, 0, 0);
+        fail_if(
+            result != CL_SUCCESS,
+            "unable to read the filled buffer"
+        );
+
+        bool ok = true;
+
+        for (size_t i = 0; i < size && ok; ++i)
+        {
+            if (i < offset || i >= offset + len)
+                ok = (data[i] == 0);
+            else
+                ok = (data[i] == pattern[(i - offset) % pattern_size]);
+        }
+
+        fail_if(
+            !ok,
+            "the fill must repeat the pattern in phase across chunks and leave the rest untouched"
+        );
+    }
+
+    // Copy between odd offsets, so that no chunk is aligned
+    copy = clCreateBuffer(ctx, CL_MEM_READ_WRITE, size, 0, &result);
+    fail_if(
+        result != CL_SUCCESS,
+        "cannot create a valid read-write buffer"
+    );
+
+    for (size_t i = 0; i < size; ++i)
+        data[i] = (i * 13) >> 3;
+
+    result = clEnqueueWriteBuffer(queue, buf, 1, 0, size, data, 0, 0, 0);
+    fail_if(
+        result != CL_SUCCESS,
+        "unable to write the buffer"
+    );
+
+    result = clEnqueueWriteBuffer(queue, copy, 1, 0, size, zero, 0, 0, 0);
+    fail_if(
+        result != CL_SUCCESS,
+        "unable to clear the buffer"
+    );
+
+    result = clEnqueueCopyBuffer(queue, buf, copy, 7, 13, size - 20, 0, 0, 0);
+    fail_if(
+        result != CL_SUCCESS,
+        "unable to copy the buffer"
+    );
+
+    result = clEnqueueReadBuffer(queue, copy, 1, 0, size, data, 0, 0, 0);
+    fail_if(
+        result != CL_SUCCESS,
+        "unable to read the copied buffer"
+    );
+
+    bool ok = true;
+
+    for (size_t i = 0; i < size && ok; ++i)
+    {
+        if (i < 13 || i >= size - 7)
+            ok = (data[i] == 0);
+        else
+            ok = (data[i] == (unsigned char)(((i - 6) * 13) >> 3));
+    }
+
+    fail_if(
+        !ok,
+        "the copy must move every byte to its shifted position"
+    );
+
+    clReleaseCommandQueue(queue);
+    clReleaseMemObject(copy);
+    clReleaseMemObject(buf);
+    clReleaseContext(ctx);
+    free(zero);
+    free(data);
+}
+END_TEST
+
+START_TEST (test_zero_copy_bytes)
+{
+    cl_context ctx;
+    cl_mem buf;
+    cl_command_queue queue;
+    cl_device_id device;
+    cl_int result;
+    cl_ulong before, after;
+    char s[] = "Hello, Denis !";
+    char data[16];
+
+    result = clGetDeviceIDs(0, CL_DEVICE_TYPE_DEFAULT, 1, &device, 0);
+    fail_if(
+        result != CL_SUCCESS,
+        "cannot get a device"
+    );
+
+    ctx = clCreateContext(0, 1, &device, 0, 0, &result);
+    fail_if(
+        result != CL_SUCCESS,
+        "unable to create a valid context"
+    );
+
+    queue = clCreateCommandQueue(ctx, device, 0, &result);
+    fail_if(
+        result != CL_SUCCESS || queue == 0,
+        "cannot create a command queue"
+    );
+
+    buf = clCreateBuffer(ctx, CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR,
+                         sizeof(s), s, &result);
+    fail_if(
+        result != CL_SUCCESS,
+        "cannot create a valid CL_MEM_USE_HOST_PTR read-write buffer"
+    );
+
+    result = clGetDeviceInfo(device, CL_DEVICE_ZERO_COPY_BYTES_TI,
+                             sizeof(cl_ulong), &before, 0);
+    fail_if(
+        result != CL_SUCCESS,
+        "unable to get the zero-copy byte count"
+    );
+
+    // Reading to and writing from the host pointer itself copies nothing
+    result = clEnqueueReadBuffer(queue, buf, 1, 7, 5, s + 7, 0, 0, 0);
+    fail_if(
+        result != CL_SUCCESS,
+        "unable to read the buffer in place"
+    );
+
+    result = clEnqueueWriteBuffer(queue, buf, 1, 0, sizeof(s), s, 0, 0, 0);
+    fail_if(
+        result != CL_SUCCESS,
+        "unable to write the buffer in place"
+    );
+
+    result = clGetDeviceInfo(device, CL_DEVICE_ZERO_COPY_BYTES_TI,
+                             sizeof(cl_ulong), &after, 0);
+    fail_if(
+        result != CL_SUCCESS || after != before + 5 + sizeof(s),
+        "the in-place read and write must be counted as zero-copy bytes"
+    );
+
+    // A read to another pointer is a real copy
+    result = clEnqueueReadBuffer(queue, buf, 1, 0, sizeof(s), data, 0, 0, 0);
+    fail_if(
+        result != CL_SUCCESS || strncmp(data, "Hello, Denis !", sizeof(s)),
+        "unable to read the buffer"
+    );
+
+    result = clGetDeviceInfo(device, CL_DEVICE_ZERO_COPY_BYTES_TI,
+                             sizeof(cl_ulong), &before, 0);
+    fail_if(
+        result != CL_SUCCESS || before != after,
+        "a copying read must not be counted as zero-copy bytes"
+    );
+
+    clReleaseCommandQueue(queue);
+    clReleaseMemObject(buf);
+    clReleaseContext(ctx);
+}
+END_TEST
+
 TCase *cl_mem_tcase_create(void)
 {
     TCase *tc = NULL;
@@ -342,5 +567,7 @@ TCase *cl_mem_tcase_create(void)
     tcase_add_test(tc, test_read_write_subbuf);
 #endif
     tcase_add_test(tc, test_images);
+    tcase_add_test(tc, test_fill_copy_buffer);
+    tcase_add_test(tc, test_zero_copy_bytes);
     return tc;
 }
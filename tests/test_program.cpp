@@ -28,6 +28,7 @@
 #include "test_program.h"
 #include "CL/cl.h"
 
+#include <cmath>
 #include <cstdlib>
 #include <cstring>
 
@@ -40,6 +41,17 @@ const char program_source[] =
     "   a[i].xwyz = 3.1415926f * b[0].xyzw * b[0].wzyx;\n"
     "}\n";
 
+const char stdlib_source[] =
+    "float scale(float x) {\n"
+    "    return 2.0f * x;\n"
+    "}\n"
+    "\n"
+    "__kernel void test(__global float *a) {\n"
+    "   int i = get_global_id(0);\n"
+    "\n"
+    "   a[i] = clamp(scale(sqrt(a[i])), 0.0f, 10.0f);\n"
+    "}\n";
+
 START_TEST (test_create_program)
 {
     cl_platform_id platform = 0;
@@ -236,6 +248,113 @@ START_TEST (test_program_build_info)
 }
 END_TEST
 
+START_TEST (test_program_build_run)
+{
+    cl_platform_id platform = 0;
+    cl_device_id device;
+    cl_context ctx;
+    cl_command_queue queue;
+    cl_program program;
+    cl_kernel kernel;
+    cl_mem buf;
+    cl_int result;
+
+    const char *src = stdlib_source;
+    float data[64];
+
+    result = clGetDeviceIDs(platform, CL_DEVICE_TYPE_DEFAULT, 1, &device, 0);
+    fail_if(
+        result != CL_SUCCESS,
+        "unable to get the default device"
+    );
+
+    ctx = clCreateContext(0, 1, &device, 0, 0, &result);
+    fail_if(
+        result != CL_SUCCESS || ctx == 0,
+        "unable to create a valid context"
+    );
+
+    queue = clCreateCommandQueue(ctx, device, 0, &result);
+    fail_if(
+        result != CL_SUCCESS,
+        "unable to create a command queue"
+    );
+
+    program = clCreateProgramWithSource(ctx, 1, &src, 0, &result);
+    fail_if(
+        result != CL_SUCCESS,
+        "cannot create a program from source with sane arguments"
+    );
+
+    // Build twice, the second build replaces the first one
+    for (int build = 0; build < 2; ++build)
+    {
+        result = clBuildProgram(program, 1, &device, "", 0, 0);
+        fail_if(
+            result != CL_SUCCESS,
+            "cannot build a program calling user and built-in functions"
+        );
+    }
+
+    kernel = clCreateKernel(program, "test", &result);
+    fail_if(
+        result != CL_SUCCESS,
+        "unable to create a valid kernel"
+    );
+
+    for (int i = 0; i < 64; ++i)
+        data[i] = (float)(i * i);
+
+    buf = clCreateBuffer(ctx, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+                         sizeof(data), data, &result);
+    fail_if(
+        result != CL_SUCCESS,
+        "cannot create a valid read-write buffer"
+    );
+
+    result = clSetKernelArg(kernel, 0, sizeof(cl_mem), &buf);
+    fail_if(
+        result != CL_SUCCESS,
+        "cannot set kernel argument"
+    );
+
+    size_t global_size = 64;
+
+    result = clEnqueueNDRangeKernel(queue, kernel, 1, 0, &global_size, 0,
+                                    0, 0, 0);
+    fail_if(
+        result != CL_SUCCESS,
+        "unable to queue the kernel"
+    );
+
+    result = clEnqueueReadBuffer(queue, buf, 1, 0, sizeof(data), data, 0, 0, 0);
+    fail_if(
+        result != CL_SUCCESS,
+        "unable to read the buffer"
+    );
+
+    bool ok = true;
+
+    for (int i = 0; i < 64 && ok; ++i)
+    {
+        float expected = (2 * i > 10 ? 10.0f : (float)(2 * i));
+
+        ok = (std::fabs(data[i] - expected) < 1e-4f);
+    }
+
+    fail_if(
+        !ok,
+        "the kernel hasn't done its job, the buffer is wrong"
+    );
+
+    clReleaseMemObject(buf);
+    clReleaseKernel(kernel);
+    clReleaseProgram(program);
+    clReleaseCommandQueue(queue);
+    clReleaseContext(ctx);
+}
+END_TEST
+
 TCase *cl_program_tcase_create(void)
 {
     TCase *tc = NULL;
@@ -243,5 +362,6 @@ TCase *cl_program_tcase_create(void)
     tcase_add_test(tc, test_create_program);
     tcase_add_test(tc, test_program_binary);
     tcase_add_test(tc, test_program_build_info);
+    tcase_add_test(tc, test_program_build_run);
     return tc;
 }